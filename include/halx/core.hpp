@@ -4,7 +4,9 @@
 #include <stm32cubemx_helper/device.hpp>
 
 #include "core/common.hpp"
+#include "core/cycle_counter.hpp"
 #include "core/function.hpp"
 #include "core/notifier.hpp"
 #include "core/ring_buffer.hpp"
+#include "core/seq_lock.hpp"
 #include "core/timeout.hpp"
@@ -0,0 +1,84 @@
+#pragma once
+
+#include <cstdint>
+
+#include "common.hpp"
+
+namespace halx::core {
+
+#ifdef DWT_CTRL_CYCCNTENA_Msk
+
+namespace detail {
+
+// `get_cycle_count64()` が前回読んだ値と、そのときの HAL のティック [ms]
+struct CycleCountAnchor {
+  uint64_t cycle_count;
+  uint32_t tick;
+};
+
+inline CycleCountAnchor cycle_count_anchor{};
+
+} // namespace detail
+
+inline void enable_cycle_counter() {
+  if ((DWT->CTRL & DWT_CTRL_CYCCNTENA_Msk) != 0) {
+    return;
+  }
+  CoreDebug->DEMCR = CoreDebug->DEMCR | CoreDebug_DEMCR_TRCENA_Msk;
+  DWT->CTRL = DWT->CTRL | DWT_CTRL_CYCCNTENA_Msk;
+  uint32_t primask = __get_PRIMASK();
+  __disable_irq();
+  detail::cycle_count_anchor = {DWT->CYCCNT, HAL_GetTick()};
+  __set_PRIMASK(primask);
+}
+
+inline uint32_t get_cycle_count() { return DWT->CYCCNT; }
+
+/**
+ * DWT のサイクルカウンタを 64bit に拡張した値を返します。割り込みからも
+ * 呼び出せます。
+ *
+ * 前回呼んでからの経過時間を HAL のティックで見積もり、その間に
+ * カウンタが何回桁あふれしたかを決めます。2^32 サイクル(170MHz で
+ * 約25秒)より長く呼ばれなくても値は飛びません。ティックが一周する
+ * 約49日以内に1回は呼び出してください。
+ */
+inline uint64_t get_cycle_count64() {
+  constexpr uint64_t WRAP = 1ull << 32;
+  auto &anchor = detail::cycle_count_anchor;
+  uint32_t primask = __get_PRIMASK();
+  __disable_irq();
+  uint32_t count = DWT->CYCCNT;
+  uint32_t tick = HAL_GetTick();
+  uint64_t expected =
+      anchor.cycle_count +
+      static_cast<uint64_t>(tick - anchor.tick) * (SystemCoreClock / 1000);
+  // 下位 32bit が `count` の値のうち、見積もりに最も近いもの。ティックの
+  // 誤差は数 ms なので、半周 (170MHz で約12秒) ずれることはない
+  uint64_t cycle_count = (expected & ~(WRAP - 1)) | count;
+  if (cycle_count + WRAP / 2 < expected) {
+    cycle_count += WRAP;
+  } else if (cycle_count > expected + WRAP / 2 && cycle_count >= WRAP) {
+    cycle_count -= WRAP;
+  }
+  anchor = {cycle_count, tick};
+  __set_PRIMASK(primask);
+  return cycle_count;
+}
+
+#else
+
+// DWT のないコア (Cortex-M0/M0+) ではティックから換算する
+inline void enable_cycle_counter() {}
+
+inline uint64_t get_cycle_count64() {
+  return static_cast<uint64_t>(HAL_GetTick()) * (SystemCoreClock / 1000);
+}
+
+inline uint32_t get_cycle_count() {
+  return static_cast<uint32_t>(get_cycle_count64());
+}
+
+#endif
+
+} // namespace halx::core
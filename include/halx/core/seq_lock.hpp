@@ -0,0 +1,47 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <type_traits>
+
+namespace halx::core {
+
+/**
+ * 書き込み1つ・読み出し複数のシーケンスロックです。割り込みで更新した
+ * 複数ワードの値を、スレッドからロックなしで一貫した状態で読み出せます。
+ * 読み出し中に書き込みがあれば読み直すので、書き込む割り込みより優先度の
+ * 高い割り込みからは `load()` を呼ばないでください。
+ */
+template <class T> class SeqLock {
+  static_assert(std::is_trivially_copyable_v<T>);
+
+public:
+  // 書き込み中は sequence_ が奇数になる
+  void store(const T &value) {
+    uint32_t sequence = sequence_.load(std::memory_order_relaxed);
+    sequence_.store(sequence + 1, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+    value_ = value;
+    sequence_.store(sequence + 2, std::memory_order_release);
+  }
+
+  T load() const {
+    while (true) {
+      uint32_t sequence = sequence_.load(std::memory_order_acquire);
+      if (sequence % 2 != 0) {
+        continue;
+      }
+      T value = value_;
+      std::atomic_thread_fence(std::memory_order_acquire);
+      if (sequence_.load(std::memory_order_relaxed) == sequence) {
+        return value;
+      }
+    }
+  }
+
+private:
+  std::atomic<uint32_t> sequence_{0};
+  T value_{};
+};
+
+} // namespace halx::core
@@ -1,8 +1,15 @@
 #pragma once
 
+#include "peripheral/adc.hpp"
 #include "peripheral/can.hpp"
+#include "peripheral/encoder.hpp"
 #include "peripheral/exti.hpp"
 #include "peripheral/gpio.hpp"
+#include "peripheral/i2c.hpp"
+#include "peripheral/input_capture.hpp"
+#include "peripheral/pulse_train.hpp"
 #include "peripheral/pwm.hpp"
+#include "peripheral/rate_scheduler.hpp"
+#include "peripheral/spi.hpp"
 #include "peripheral/tim.hpp"
 #include "peripheral/uart.hpp"
@@ -0,0 +1,183 @@
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <optional>
+#include <span>
+
+#include "halx/core.hpp"
+
+namespace halx::peripheral {
+
+#ifdef HAL_ADC_MODULE_ENABLED
+
+// レギュラー変換のランク数の上限
+inline constexpr size_t ADC_MAX_CHANNEL_COUNT = 16;
+
+/**
+ * ADC のスキャン変換の結果を循環モードの DMA でバッファに書き込み、
+ * DMA の半分完了・完了割り込みで、書き終わった半分を平均して最新値に
+ * します。最新値は `core::SeqLock` で読むので、変換を待たずに読めます。
+ * 読み出し中に更新されると読み直すので、`get_value()` / `get_values()` は
+ * DMA の割り込みより優先度の高い割り込みから呼ばないでください (更新が
+ * 終わらず戻らなくなります)。割り込みで値を使う場合は `attach_callback()`
+ * を使ってください。
+ *
+ * CubeMX で ADC の `Scan Conversion Mode` と `DMA Continuous Requests` を
+ * 有効にし、DMA を `Circular`、データ幅を `Half Word` で設定してください。
+ * PWM に同期させる場合は `External Trigger Conversion Source` に TIM の
+ * TRGO を指定します。ハードウェアのオーバーサンプリングがある ADC では、
+ * CubeMX で設定すれば平均済みの値が DMA で書き込まれます。
+ *
+ * バッファの大きさは `2 * チャンネル数 * oversampling` にしてください。
+ * 半分のバッファに `oversampling` 回のスキャンが入り、その平均が1回分の
+ * 最新値になります。
+ *
+ * @code{.cpp}
+ * #include <cstdio>
+ * #include <halx/core.hpp>
+ * #include <halx/peripheral.hpp>
+ *
+ * extern ADC_HandleTypeDef hadc1; // 3チャンネル
+ *
+ * extern "C" void main_thread(void *) {
+ *   using namespace halx::core;
+ *   using namespace halx::peripheral;
+ *
+ *   static uint16_t buf[2 * 3 * 4];
+ *   Adc<&hadc1> adc1(buf, 4);
+ *   adc1.start();
+ *
+ *   while (true) {
+ *     std::array<uint16_t, 3> values;
+ *     adc1.get_values(values);
+ *     printf("%u %u %u\r\n", values[0], values[1], values[2]);
+ *     if (auto value = adc1.get_value(0)) {
+ *       printf("%u\r\n", *value);
+ *     }
+ *     delay(10);
+ *   }
+ * }
+ * @endcode
+ */
+template <ADC_HandleTypeDef *Handle> class Adc {
+private:
+  struct State {
+    std::span<uint16_t> buf;
+    size_t channel_count = 0;
+    size_t oversampling;
+    void (*callback)(void *context, std::span<const uint16_t> values) =
+        nullptr;
+    void *context = nullptr;
+    core::SeqLock<std::array<uint16_t, ADC_MAX_CHANNEL_COUNT>> values;
+
+    State(std::span<uint16_t> buf, size_t oversampling)
+        : buf{buf}, oversampling{oversampling} {
+      stm32cubemx_helper::set_context<Handle, State>(this);
+      HAL_ADC_RegisterCallback(
+          Handle, HAL_ADC_CONVERSION_HALF_CB_ID, [](ADC_HandleTypeDef *) {
+            auto state = stm32cubemx_helper::get_context<Handle, State>();
+            state->update(0);
+          });
+      HAL_ADC_RegisterCallback(
+          Handle, HAL_ADC_CONVERSION_COMPLETE_CB_ID, [](ADC_HandleTypeDef *) {
+            auto state = stm32cubemx_helper::get_context<Handle, State>();
+            state->update(state->get_half_size());
+          });
+    }
+
+    ~State() {
+      HAL_ADC_Stop_DMA(Handle);
+      HAL_ADC_UnRegisterCallback(Handle, HAL_ADC_CONVERSION_HALF_CB_ID);
+      HAL_ADC_UnRegisterCallback(Handle, HAL_ADC_CONVERSION_COMPLETE_CB_ID);
+      stm32cubemx_helper::set_context<Handle, State>(nullptr);
+    }
+
+    size_t get_half_size() const { return channel_count * oversampling; }
+
+    // `offset` から半分のバッファをチャンネルごとに平均する
+    void update(size_t offset) {
+      std::array<uint16_t, ADC_MAX_CHANNEL_COUNT> latest{};
+      for (size_t i = 0; i < channel_count; ++i) {
+        uint32_t sum = 0;
+        for (size_t j = 0; j < oversampling; ++j) {
+          sum += buf[offset + j * channel_count + i];
+        }
+        latest[i] = (sum + oversampling / 2) / oversampling;
+      }
+      values.store(latest);
+      if (callback) {
+        callback(context, {latest.data(), channel_count});
+      }
+    }
+  };
+
+public:
+  Adc(std::span<uint16_t> buf, size_t oversampling = 1)
+      : state_{std::make_unique<State>(buf, oversampling)} {}
+
+  // `MX_ADCx_Init()` の前に構築してもよいように、チャンネル数は `start()`
+  // で読み出す
+  bool start() {
+    size_t channel_count = Handle->Init.NbrOfConversion;
+    size_t size = 2 * channel_count * state_->oversampling;
+    if (channel_count == 0 || channel_count > ADC_MAX_CHANNEL_COUNT ||
+        state_->oversampling == 0 || state_->buf.size() < size) {
+      return false;
+    }
+    state_->channel_count = channel_count;
+    return HAL_ADC_Start_DMA(Handle,
+                             reinterpret_cast<uint32_t *>(state_->buf.data()),
+                             size) == HAL_OK;
+  }
+
+  bool stop() { return HAL_ADC_Stop_DMA(Handle) == HAL_OK; }
+
+  // `start()` までは 0
+  size_t get_channel_count() const { return state_->channel_count; }
+
+  // `channel` 番目 (スキャン順) の最新値。範囲外なら std::nullopt
+  std::optional<uint16_t> get_value(size_t channel) const {
+    if (channel >= state_->channel_count) {
+      return std::nullopt;
+    }
+    return state_->values.load()[channel];
+  }
+
+  // 全チャンネルの同じ回の最新値を `values` に書き込む
+  void get_values(std::span<uint16_t> values) const {
+    size_t count = std::min(values.size(), state_->channel_count);
+    auto latest = state_->values.load();
+    std::copy_n(latest.begin(), count, values.begin());
+  }
+
+  // 新しい値ごとに DMA の割り込みから呼ばれる。`start()` 前に設定する
+  bool attach_callback(void (*callback)(void *context,
+                                        std::span<const uint16_t> values),
+                       void *context) {
+    if (state_->callback) {
+      return false;
+    }
+    state_->callback = callback;
+    state_->context = context;
+    return true;
+  }
+
+  bool detach_callback() {
+    if (!state_->callback) {
+      return false;
+    }
+    state_->callback = nullptr;
+    return true;
+  }
+
+private:
+  std::unique_ptr<State> state_;
+};
+
+#endif
+
+} // namespace halx::peripheral
@@ -1,6 +1,10 @@
 #pragma once
 
+#include "can/bridge.hpp"
 #include "can/common.hpp"
+#include "can/dispatch_table.hpp"
+#include "can/filter_planner.hpp"
+#include "can/tx_coalescer.hpp"
 
 #ifdef HAL_CAN_MODULE_ENABLED
 #include "can/bxcan.hpp"
@@ -20,12 +24,19 @@ template <auto *Handle>
 class Can<Handle, CAN_HandleTypeDef *> : public CanBase {
 public:
   using CanBase::attach_rx_filter;
+  using CanBase::subscribe;
+  using CanBase::transmit;
+  using CanBase::transmit_burst;
 
   bool start() override { return can_.start(); }
   bool stop() override { return can_.stop(); }
   bool transmit(const CanMessage &msg, uint32_t timeout) override {
     return can_.transmit(msg, timeout);
   }
+  size_t transmit_burst(std::span<const CanMessage> msgs,
+                        uint32_t timeout) override {
+    return can_.transmit_burst(msgs, timeout);
+  }
   std::optional<size_t>
   attach_rx_filter(const CanFilter &filter,
                    void (*callback)(void *context, const CanMessage &msg),
@@ -35,6 +46,50 @@ public:
   bool detach_rx_filter(size_t filter_index) override {
     return can_.detach_rx_filter(filter_index);
   }
+  bool subscribe(uint32_t id, bool ide,
+                 void (*callback)(void *context, const CanMessage &msg),
+                 void *context) override {
+    return can_.subscribe(id, ide, callback, context);
+  }
+  bool unsubscribe(uint32_t id, bool ide) override {
+    return can_.unsubscribe(id, ide);
+  }
+  std::optional<size_t>
+  attach_tx_callback(void (*callback)(void *context, const CanTxEvent &event),
+                     void *context) override {
+    return can_.attach_tx_callback(callback, context);
+  }
+  bool detach_tx_callback(size_t index) override {
+    return can_.detach_tx_callback(index);
+  }
+  uint32_t get_rx_overrun_count(uint32_t fifo) const override {
+    return can_.get_rx_overrun_count(fifo);
+  }
+  uint32_t get_rx_count(size_t filter_index) const override {
+    return can_.get_rx_count(filter_index);
+  }
+  CanStats get_stats() const override { return can_.get_stats(); }
+  void set_bus_off_recovery(bool enable) override {
+    can_.set_bus_off_recovery(enable);
+  }
+  bool enable_deferred_dispatch(size_t capacity) override {
+    return can_.enable_deferred_dispatch(capacity);
+  }
+  bool enable_deferred_dispatch(size_t capacity, IRQn_Type irqn) {
+    return can_.enable_deferred_dispatch(capacity, irqn);
+  }
+  size_t dispatch_pending(uint32_t timeout) override {
+    return can_.dispatch_pending(timeout);
+  }
+
+  std::optional<std::vector<size_t>> attach_rx_filter_plan(
+      const BxCanFilterPlan &plan, uint32_t fifo,
+      void (*callback)(void *context, const CanMessage &msg), void *context) {
+    return can_.attach_rx_filter_plan(plan, fifo, callback, context);
+  }
+  size_t get_free_rx_filter_count() const {
+    return can_.get_free_rx_filter_count();
+  }
 
 private:
   BxCan<Handle> can_;
@@ -54,15 +109,88 @@ public:
   bool transmit(const CanMessage &msg, uint32_t timeout) override {
     return can_.transmit(msg, timeout);
   }
+  size_t transmit_burst(std::span<const CanMessage> msgs,
+                        uint32_t timeout) override {
+    return can_.transmit_burst(msgs, timeout);
+  }
+  bool supports_fd() const override { return can_.supports_fd(); }
+  bool transmit(const CanFdMessage &msg, uint32_t timeout) override {
+    return can_.transmit(msg, timeout);
+  }
+  size_t transmit_burst(std::span<const CanFdMessage> msgs,
+                        uint32_t timeout) override {
+    return can_.transmit_burst(msgs, timeout);
+  }
   std::optional<size_t>
   attach_rx_filter(const CanFilter &filter,
                    void (*callback)(void *context, const CanMessage &msg),
                    void *context) override {
     return can_.attach_rx_filter(filter, callback, context);
   }
+  std::optional<size_t>
+  attach_rx_filter(const CanFilter &filter,
+                   void (*callback)(void *context, const CanFdMessage &msg),
+                   void *context) override {
+    return can_.attach_rx_filter(filter, callback, context);
+  }
   bool detach_rx_filter(size_t filter_index) override {
     return can_.detach_rx_filter(filter_index);
   }
+  bool subscribe(uint32_t id, bool ide,
+                 void (*callback)(void *context, const CanMessage &msg),
+                 void *context) override {
+    return can_.subscribe(id, ide, callback, context);
+  }
+  bool subscribe(uint32_t id, bool ide,
+                 void (*callback)(void *context, const CanFdMessage &msg),
+                 void *context) override {
+    return can_.subscribe(id, ide, callback, context);
+  }
+  bool unsubscribe(uint32_t id, bool ide) override {
+    return can_.unsubscribe(id, ide);
+  }
+  std::optional<size_t>
+  attach_tx_callback(void (*callback)(void *context, const CanTxEvent &event),
+                     void *context) override {
+    return can_.attach_tx_callback(callback, context);
+  }
+  bool detach_tx_callback(size_t index) override {
+    return can_.detach_tx_callback(index);
+  }
+  uint32_t get_rx_overrun_count(uint32_t fifo) const override {
+    return can_.get_rx_overrun_count(fifo);
+  }
+  uint32_t get_rx_count(size_t filter_index) const override {
+    return can_.get_rx_count(filter_index);
+  }
+  CanStats get_stats() const override { return can_.get_stats(); }
+  void set_bus_off_recovery(bool enable) override {
+    can_.set_bus_off_recovery(enable);
+  }
+  bool enable_deferred_dispatch(size_t capacity) override {
+    return can_.enable_deferred_dispatch(capacity);
+  }
+  bool enable_deferred_dispatch(size_t capacity, IRQn_Type irqn) {
+    return can_.enable_deferred_dispatch(capacity, irqn);
+  }
+  size_t dispatch_pending(uint32_t timeout) override {
+    return can_.dispatch_pending(timeout);
+  }
+
+  std::optional<std::vector<size_t>> attach_rx_filter_plan(
+      const FdCanFilterPlan &plan, uint32_t fifo,
+      void (*callback)(void *context, const CanMessage &msg), void *context) {
+    return can_.attach_rx_filter_plan(plan, fifo, callback, context);
+  }
+  std::optional<std::vector<size_t>> attach_rx_filter_plan(
+      const FdCanFilterPlan &plan, uint32_t fifo,
+      void (*callback)(void *context, const CanFdMessage &msg),
+      void *context) {
+    return can_.attach_rx_filter_plan(plan, fifo, callback, context);
+  }
+  size_t get_free_rx_filter_count(bool ide) const {
+    return can_.get_free_rx_filter_count(ide);
+  }
 
 private:
   FdCan<Handle> can_;
@@ -0,0 +1,336 @@
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <optional>
+#include <vector>
+
+#include "halx/core.hpp"
+
+#include "common.hpp"
+
+namespace halx::peripheral {
+
+enum class CanBridgeDirection : uint8_t {
+  A_TO_B,
+  B_TO_A,
+};
+
+/**
+ * 転送ルールです。`filter` に一致したフレームを、ID の `rewrite_mask` の
+ * ビットを `rewrite_id` で置き換え、`ide` / `fd` / `brs` の形式で転送先に
+ * 送信します。`rewrite_mask` が 0 なら ID はそのままです。
+ *
+ * `fd` が true のルールは、転送先が CAN FD を送信できない
+ * (`CanBase::supports_fd()` が false) と追加できません。CAN FD から
+ * クラシック CAN への転送で 8 バイトを超えるフレームは捨てられます。
+ */
+struct CanBridgeRule {
+  CanFilter filter;
+  uint32_t rewrite_id;
+  uint32_t rewrite_mask;
+  bool ide;
+  bool fd;
+  bool brs;
+};
+
+/**
+ * 転送方向ごとの統計です。遅延は受信割り込みで転送キューに積んでから
+ * 転送先の送信キューに積むまでの時間で、`core::get_cycle_count64()` と同じ
+ * CPU サイクル単位です。受信フレームの `timestamp` は使わないので、
+ * `VirtualCan` のように時計の違うノードでも測れます。
+ * `forward()` を呼ぶスレッドがシーケンスロックで更新するので、
+ * `get_stats()` は割り込みから呼ばないでください。
+ *
+ * - `drop_count`: 転送キューが満杯で捨てたフレーム数
+ * - `reject_count`: 転送先の形式に変換できず捨てたフレーム数
+ */
+struct CanBridgeStats {
+  uint32_t forwarded_count;
+  uint32_t drop_count;
+  uint32_t reject_count;
+  uint64_t max_latency;
+  uint64_t average_latency;
+};
+
+/**
+ * 2つの CAN の間でフレームを転送します。受信割り込みではルールに従って
+ * 変換したフレームを方向ごとの転送キューに積むだけで、送信は `forward()`
+ * を呼ぶスレッドで行うので、転送先が混んでいても受信割り込みを止めません。
+ *
+ * @code{.cpp}
+ * #include <halx/core.hpp>
+ * #include <halx/peripheral.hpp>
+ *
+ * extern CAN_HandleTypeDef hcan1;
+ * extern FDCAN_HandleTypeDef hfdcan2;
+ *
+ * extern "C" void main_thread(void *) {
+ *   using namespace halx::core;
+ *   using namespace halx::peripheral;
+ *
+ *   Can<&hcan1> can1;    // 足回り
+ *   Can<&hfdcan2> can2;  // アーム
+ *
+ *   CanBridge bridge(can1, can2, 16);
+ *   // 0x200-0x20F を 0x400-0x40F として CAN FD (BRS) で転送
+ *   bridge.add_rule(CanBridgeDirection::A_TO_B,
+ *                   {.filter = {.id = 0x200, .mask = 0x7F0, .ide = false,
+ *                               .fifo = 0},
+ *                    .rewrite_id = 0x400,
+ *                    .rewrite_mask = 0x7F0,
+ *                    .ide = false,
+ *                    .fd = true,
+ *                    .brs = true});
+ *   // 0x500 はそのままクラシック CAN で転送
+ *   bridge.add_rule(CanBridgeDirection::B_TO_A,
+ *                   {.filter = {.id = 0x500, .mask = 0x7FF, .ide = false,
+ *                               .fifo = 0},
+ *                    .rewrite_id = 0,
+ *                    .rewrite_mask = 0,
+ *                    .ide = false,
+ *                    .fd = false,
+ *                    .brs = false});
+ *
+ *   can1.start();
+ *   can2.start();
+ *
+ *   while (true) {
+ *     bridge.forward(MAX_DELAY);
+ *   }
+ * }
+ * @endcode
+ */
+class CanBridge {
+public:
+  // `capacity` は転送方向・受信 FIFO ごとの転送キューの長さ
+  CanBridge(CanBase &a, CanBase &b, size_t capacity) : cans_{&a, &b} {
+    // 遅延の統計に使う
+    core::enable_cycle_counter();
+    for (auto &direction : directions_) {
+      for (auto &queue : direction.queues) {
+        queue = std::make_unique<core::RingBuffer<Frame>>(capacity);
+      }
+    }
+  }
+
+  ~CanBridge() {
+    for (size_t i = 0; i < routes_.size(); ++i) {
+      remove_rule(i);
+    }
+  }
+
+  CanBridge(const CanBridge &) = delete;
+  CanBridge &operator=(const CanBridge &) = delete;
+
+  std::optional<size_t> add_rule(CanBridgeDirection direction,
+                                 const CanBridgeRule &rule) {
+    if (rule.filter.fifo > 1) {
+      return std::nullopt;
+    }
+    // CAN FD を送れない転送先に積むと、送信を再試行し続けて止まる
+    if (rule.fd && !cans_[1 - static_cast<size_t>(direction)]->supports_fd()) {
+      return std::nullopt;
+    }
+    auto route = std::make_unique<Route>(this, direction, rule);
+    auto &source = *cans_[static_cast<size_t>(direction)];
+    // FDCAN なら CAN FD のフレームも受け取れるコールバックを使う
+    auto filter_index = source.attach_rx_filter(
+        rule.filter,
+        [](void *context, const CanFdMessage &msg) {
+          static_cast<Route *>(context)->receive(msg);
+        },
+        route.get());
+    if (!filter_index) {
+      filter_index = source.attach_rx_filter(
+          rule.filter,
+          [](void *context, const CanMessage &msg) {
+            static_cast<Route *>(context)->receive(to_can_fd_message(msg));
+          },
+          route.get());
+    }
+    if (!filter_index) {
+      return std::nullopt;
+    }
+    route->filter_index = *filter_index;
+    routes_.push_back(std::move(route));
+    return routes_.size() - 1;
+  }
+
+  bool remove_rule(size_t rule_index) {
+    if (rule_index >= routes_.size() || !routes_[rule_index]) {
+      return false;
+    }
+    auto &route = routes_[rule_index];
+    if (!cans_[static_cast<size_t>(route->direction)]->detach_rx_filter(
+            route->filter_index)) {
+      return false;
+    }
+    route.reset();
+    return true;
+  }
+
+  /**
+   * 転送キューのフレームを転送先に送信し、送信したフレーム数を返します。
+   * キューが空なら `timeout` まで受信を待ちます。転送先の送信キューが満杯
+   * のフレームは保持して、次の呼び出しで再送します。
+   */
+  size_t forward(uint32_t timeout) {
+    notifier_.reset();
+    if (!has_pending()) {
+      notifier_.wait(0x1, timeout);
+    }
+    size_t count = 0;
+    for (size_t i = 0; i < directions_.size(); ++i) {
+      count += forward_direction(directions_[i], *cans_[1 - i]);
+    }
+    if (count == 0 && has_pending()) {
+      core::yield();
+    }
+    return count;
+  }
+
+  CanBridgeStats get_stats(CanBridgeDirection direction) const {
+    const auto &state = directions_[static_cast<size_t>(direction)];
+    ForwardStats forward_stats = state.forward_stats.load();
+    return {
+        .forwarded_count = forward_stats.forwarded_count,
+        .drop_count = state.drop_count.load(std::memory_order_relaxed),
+        .reject_count = state.reject_count.load(std::memory_order_relaxed),
+        .max_latency = forward_stats.max_latency,
+        .average_latency =
+            forward_stats.forwarded_count > 0
+                ? forward_stats.latency_sum / forward_stats.forwarded_count
+                : 0,
+    };
+  }
+
+private:
+  struct Route {
+    CanBridge *bridge;
+    CanBridgeDirection direction;
+    CanBridgeRule rule;
+    size_t filter_index = 0;
+
+    Route(CanBridge *bridge, CanBridgeDirection direction,
+          const CanBridgeRule &rule)
+        : bridge{bridge}, direction{direction}, rule{rule} {}
+
+    // 受信割り込みから呼ばれる
+    void receive(const CanFdMessage &msg) {
+      auto &state = bridge->directions_[static_cast<size_t>(direction)];
+      if (!rule.fd && msg.dlc > 8) {
+        state.reject_count.fetch_add(1, std::memory_order_relaxed);
+        return;
+      }
+      CanFdMessage forwarded = msg;
+      forwarded.id =
+          (msg.id & ~rule.rewrite_mask) | (rule.rewrite_id & rule.rewrite_mask);
+      forwarded.id &= rule.ide ? 0x1FFFFFFF : 0x7FF;
+      forwarded.ide = rule.ide;
+      forwarded.brs = rule.fd && rule.brs;
+      if (!state.queues[rule.filter.fifo]->push(
+              {forwarded, rule.fd, core::get_cycle_count64()})) {
+        state.drop_count.fetch_add(1, std::memory_order_relaxed);
+        return;
+      }
+      bridge->notifier_.set(0x1);
+    }
+  };
+
+  struct Frame {
+    CanFdMessage msg;
+    bool fd;
+    // 転送キューに積んだ時刻 [サイクル]
+    uint64_t queued_cycle;
+  };
+
+  struct ForwardStats {
+    uint32_t forwarded_count;
+    uint64_t max_latency;
+    uint64_t latency_sum;
+  };
+
+  struct DirectionState {
+    // 受信 FIFO ごとに別の割り込みから積むので、キューも FIFO ごとに分ける
+    std::array<std::unique_ptr<core::RingBuffer<Frame>>, 2> queues;
+    // 転送先の送信キューが満杯で送れなかったフレーム
+    std::optional<Frame> held;
+    std::atomic<uint32_t> drop_count{0};
+    std::atomic<uint32_t> reject_count{0};
+    // 64bit の値は Cortex-M でアトミックに読めないので、`forward()` の
+    // スレッドで更新した写しをシーケンスロックで公開する
+    ForwardStats forward_stats_copy{};
+    core::SeqLock<ForwardStats> forward_stats;
+  };
+
+  std::array<CanBase *, 2> cans_;
+  std::array<DirectionState, 2> directions_;
+  std::vector<std::unique_ptr<Route>> routes_;
+  core::Notifier notifier_;
+
+  bool has_pending() const {
+    return std::any_of(
+        directions_.begin(), directions_.end(),
+        [](const DirectionState &state) {
+          return state.held || state.queues[0]->size() > 0 ||
+                 state.queues[1]->size() > 0;
+        });
+  }
+
+  size_t forward_direction(DirectionState &state, CanBase &destination) {
+    size_t count = 0;
+    for (auto &queue : state.queues) {
+      while (state.held || (state.held = queue->pop())) {
+        if (!transmit(*state.held, destination)) {
+          return count;
+        }
+        uint64_t latency =
+            core::get_cycle_count64() - state.held->queued_cycle;
+        auto &stats = state.forward_stats_copy;
+        ++stats.forwarded_count;
+        stats.max_latency = std::max(stats.max_latency, latency);
+        stats.latency_sum += latency;
+        state.forward_stats.store(stats);
+        state.held.reset();
+        ++count;
+      }
+    }
+    return count;
+  }
+
+  static bool transmit(const Frame &frame, CanBase &destination) {
+    if (frame.fd) {
+      return destination.transmit(frame.msg, 0);
+    }
+    CanMessage msg{
+        .id = frame.msg.id,
+        .ide = frame.msg.ide,
+        .dlc = frame.msg.dlc,
+        .data = {},
+        .timestamp = frame.msg.timestamp,
+    };
+    std::copy_n(frame.msg.data.begin(), frame.msg.dlc, msg.data.begin());
+    return destination.transmit(msg, 0);
+  }
+
+  static CanFdMessage to_can_fd_message(const CanMessage &msg) {
+    CanFdMessage fd_msg{
+        .id = msg.id,
+        .ide = msg.ide,
+        .brs = false,
+        .dlc = msg.dlc,
+        .data = {},
+        .timestamp = msg.timestamp,
+    };
+    std::copy_n(msg.data.begin(), std::min<uint8_t>(msg.dlc, 8),
+                fd_msg.data.begin());
+    return fd_msg;
+  }
+};
+
+} // namespace halx::peripheral
@@ -0,0 +1,81 @@
+#pragma once
+
+#include <array>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+
+namespace halx::peripheral {
+
+/**
+ * クラシック CAN フレームのビット数です(ビットスタッフィングを除く、
+ * フレーム間スペース 3 ビットを含む)。
+ */
+inline constexpr uint32_t get_can_frame_bits(bool ide, uint8_t dlc) {
+  return (ide ? 67 : 47) + 8 * (dlc > 8 ? 8 : dlc);
+}
+
+/**
+ * CAN FD フレームのビット数を、ノミナルビットタイム換算で返します。
+ * `data_bit_ratio_q16` はデータビットタイム / ノミナルビットタイム
+ * (16.16 固定小数点) で、BRS なしなら 1.0 (0x10000) を渡します。
+ */
+inline constexpr uint32_t get_can_fd_frame_bits(bool ide, uint8_t size,
+                                                uint32_t data_bit_ratio_q16) {
+  uint32_t arbitration_bits = ide ? 36 : 17;
+  uint32_t data_phase_bits = 1 + 4 + 8 * size + 4 + (size > 16 ? 21 : 17) + 1;
+  uint32_t tail_bits = 12;
+  return arbitration_bits + tail_bits +
+         static_cast<uint32_t>(
+             (static_cast<uint64_t>(data_phase_bits) * data_bit_ratio_q16) >>
+             16);
+}
+
+/**
+ * 送受信したフレームのビット数を時間で区切ったバケットに積算し、直近
+ * `BUCKET_COUNT * BUCKET_TICKS` ティックのバス負荷率を推定します。
+ * `add_frame()` は割り込みから呼び出せます。
+ */
+class CanBusLoad {
+public:
+  static constexpr size_t BUCKET_COUNT = 10;
+  static constexpr uint32_t BUCKET_TICKS = 100;
+
+  void add_frame(uint32_t bits, uint32_t tick) {
+    uint32_t epoch = tick / BUCKET_TICKS;
+    auto &bucket = buckets_[epoch % BUCKET_COUNT];
+    if (bucket.epoch.load(std::memory_order_relaxed) != epoch) {
+      bucket.epoch.store(epoch, std::memory_order_relaxed);
+      bucket.bits.store(0, std::memory_order_relaxed);
+    }
+    bucket.bits.fetch_add(bits, std::memory_order_relaxed);
+  }
+
+  // 負荷率 (0.0-1.0) を返す。`bitrate` はノミナルビットレート [bit/s]
+  float get_load(uint32_t tick, uint32_t bitrate) const {
+    if (bitrate == 0) {
+      return 0.0f;
+    }
+    uint32_t epoch = tick / BUCKET_TICKS;
+    uint64_t bits = 0;
+    // 積算中の現在のバケットは除き、完了した直前のバケットを合計する
+    for (size_t i = 1; i <= BUCKET_COUNT; ++i) {
+      const auto &bucket = buckets_[(epoch - i) % BUCKET_COUNT];
+      if (bucket.epoch.load(std::memory_order_relaxed) == epoch - i) {
+        bits += bucket.bits.load(std::memory_order_relaxed);
+      }
+    }
+    float window = static_cast<float>(BUCKET_COUNT * BUCKET_TICKS) / 1000.0f;
+    return static_cast<float>(bits) / (window * bitrate);
+  }
+
+private:
+  struct Bucket {
+    std::atomic<uint32_t> epoch{UINT32_MAX};
+    std::atomic<uint32_t> bits{0};
+  };
+
+  std::array<Bucket, BUCKET_COUNT> buckets_{};
+};
+
+} // namespace halx::peripheral
@@ -2,13 +2,21 @@
 
 #include <algorithm>
 #include <array>
+#include <atomic>
 #include <cstdint>
 #include <iterator>
 #include <memory>
 #include <optional>
+#include <span>
+#include <vector>
 
 #include "halx/core.hpp"
 
+#include "bus_load.hpp"
+#include "common.hpp"
+#include "dispatch_table.hpp"
+#include "filter_planner.hpp"
+
 namespace halx::peripheral {
 
 template <CAN_HandleTypeDef *Handle> class BxCan {
@@ -16,49 +24,231 @@ private:
   struct State {
     static constexpr uint32_t FILTER_BANK_SIZE = 14;
 
+    struct PendingMessage {
+      size_t filter_index;
+      CanMessage msg;
+    };
+
+    struct TimestampAnchor {
+      uint64_t timestamp;
+      uint16_t hardware_timestamp;
+      bool valid;
+    };
+
     std::array<void (*)(void *context, const CanMessage &msg), FILTER_BANK_SIZE>
         rx_callbacks{};
     std::array<void *, FILTER_BANK_SIZE> rx_callback_contexts{};
+    std::array<uint32_t, FILTER_BANK_SIZE> filter_fifos{};
+    std::array<uint8_t, FILTER_BANK_SIZE> filter_counts{};
+    std::array<std::array<uint8_t, FILTER_BANK_SIZE * 4>, 2>
+        filter_match_indices{};
+    std::array<std::atomic<uint32_t>, 2> rx_overrun_counts{};
+    std::array<std::atomic<uint32_t>, FILTER_BANK_SIZE> rx_counts{};
+    std::atomic<uint32_t> rx_count{};
+    std::atomic<uint32_t> tx_count{};
+    std::atomic<uint32_t> tx_retry_count{};
+    std::atomic<uint32_t> bus_off_count{};
+    std::atomic<uint32_t> rx_drop_count{};
+    CanBusLoad bus_load;
+    uint32_t bitrate = 0;
+    bool bus_off_recovery = Handle->Init.AutoBusOff == ENABLE;
+    CanDispatchTable<CanMessage> dispatch_table;
+    std::vector<size_t> dispatch_filter_indices;
+    CanTxCallbackList tx_callbacks;
+    uint32_t cycles_per_tick_q16 = 0;
+    // FIFO0, FIFO1, 送信完了 でそれぞれ別の割り込みから使う
+    std::array<TimestampAnchor, 3> timestamp_anchors{};
+    // FIFO ごとに別の割り込みから積むので、キューも FIFO ごとに分ける
+    std::array<std::unique_ptr<core::RingBuffer<PendingMessage>>, 2>
+        pending_queues;
+    core::Notifier notifier;
+    std::optional<IRQn_Type> dispatch_irqn;
 
     State() {
       stm32cubemx_helper::set_context<Handle, State>(this);
+      HAL_CAN_RegisterCallback(Handle, HAL_CAN_RX_FIFO0_MSG_PENDING_CB_ID,
+                               [](CAN_HandleTypeDef *hcan) {
+                                 receive(hcan, CAN_RX_FIFO0);
+                               });
+      HAL_CAN_RegisterCallback(Handle, HAL_CAN_RX_FIFO1_MSG_PENDING_CB_ID,
+                               [](CAN_HandleTypeDef *hcan) {
+                                 receive(hcan, CAN_RX_FIFO1);
+                               });
+      HAL_CAN_RegisterCallback(Handle, HAL_CAN_TX_MAILBOX0_COMPLETE_CB_ID,
+                               [](CAN_HandleTypeDef *hcan) {
+                                 complete_transmit(hcan, 0);
+                               });
+      HAL_CAN_RegisterCallback(Handle, HAL_CAN_TX_MAILBOX1_COMPLETE_CB_ID,
+                               [](CAN_HandleTypeDef *hcan) {
+                                 complete_transmit(hcan, 1);
+                               });
+      HAL_CAN_RegisterCallback(Handle, HAL_CAN_TX_MAILBOX2_COMPLETE_CB_ID,
+                               [](CAN_HandleTypeDef *hcan) {
+                                 complete_transmit(hcan, 2);
+                               });
       HAL_CAN_RegisterCallback(
-          Handle, HAL_CAN_RX_FIFO0_MSG_PENDING_CB_ID,
-          [](CAN_HandleTypeDef *hcan) {
-            CAN_RxHeaderTypeDef rx_header;
-            CanMessage msg;
-
+          Handle, HAL_CAN_ERROR_CB_ID, [](CAN_HandleTypeDef *hcan) {
             auto state = stm32cubemx_helper::get_context<Handle, State>();
-
-            while (HAL_CAN_GetRxMessage(hcan, CAN_RX_FIFO0, &rx_header,
-                                        msg.data.data()) == HAL_OK) {
-              if (rx_header.FilterMatchIndex >= State::FILTER_BANK_SIZE) {
-                continue;
-              }
-              auto rx_callback =
-                  state->rx_callbacks[rx_header.FilterMatchIndex];
-              if (rx_callback) {
-                update_rx_message(msg, rx_header);
-                rx_callback(
-                    state->rx_callback_contexts[rx_header.FilterMatchIndex],
-                    msg);
-              }
+            if ((hcan->ErrorCode & HAL_CAN_ERROR_RX_FOV0) != 0) {
+              state->rx_overrun_counts[0].fetch_add(1,
+                                                    std::memory_order_relaxed);
+            }
+            if ((hcan->ErrorCode & HAL_CAN_ERROR_RX_FOV1) != 0) {
+              state->rx_overrun_counts[1].fetch_add(1,
+                                                    std::memory_order_relaxed);
             }
+            if ((hcan->ErrorCode & HAL_CAN_ERROR_BOF) != 0) {
+              state->bus_off_count.fetch_add(1, std::memory_order_relaxed);
+            }
+            hcan->ErrorCode =
+                hcan->ErrorCode & ~(HAL_CAN_ERROR_RX_FOV0 |
+                                    HAL_CAN_ERROR_RX_FOV1 | HAL_CAN_ERROR_BOF);
           });
+      filter_counts.fill(1);
+      for (size_t filter_index = 0; filter_index < FILTER_BANK_SIZE;
+           ++filter_index) {
+        disable_rx_filter(filter_index);
+      }
+      update_filter_match_indices();
+      core::enable_cycle_counter();
     }
 
     ~State() {
       HAL_CAN_UnRegisterCallback(Handle, HAL_CAN_RX_FIFO0_MSG_PENDING_CB_ID);
+      HAL_CAN_UnRegisterCallback(Handle, HAL_CAN_RX_FIFO1_MSG_PENDING_CB_ID);
+      HAL_CAN_UnRegisterCallback(Handle, HAL_CAN_TX_MAILBOX0_COMPLETE_CB_ID);
+      HAL_CAN_UnRegisterCallback(Handle, HAL_CAN_TX_MAILBOX1_COMPLETE_CB_ID);
+      HAL_CAN_UnRegisterCallback(Handle, HAL_CAN_TX_MAILBOX2_COMPLETE_CB_ID);
+      HAL_CAN_UnRegisterCallback(Handle, HAL_CAN_ERROR_CB_ID);
       stm32cubemx_helper::set_context<Handle, State>(nullptr);
     }
+
+    // FMI はフィルターの有効・無効にかかわらず、FIFO ごとにバンク順で
+    // 振られるので、FMI からバンク番号への対応表を作り直す
+    void update_filter_match_indices() {
+      std::array<size_t, 2> counts{};
+      for (auto &indices : filter_match_indices) {
+        indices.fill(FILTER_BANK_SIZE);
+      }
+      for (size_t filter_index = 0; filter_index < FILTER_BANK_SIZE;
+           ++filter_index) {
+        uint32_t fifo = filter_fifos[filter_index];
+        for (size_t i = 0; i < filter_counts[filter_index]; ++i) {
+          filter_match_indices[fifo][counts[fifo]++] = filter_index;
+        }
+      }
+    }
+
+    // TTCM のタイマーは現在値を読めないので、前回のフレームの時刻を基準に
+    // ハードウェアタイムスタンプの差分を足す。基準が古い(タイマーが一周
+    // しうる)か、現在時刻を追い越す場合は割り込み時の時刻を基準に取り直す
+    uint64_t get_timestamp(TimestampAnchor &anchor,
+                           uint32_t hardware_timestamp) const {
+      uint64_t now = core::get_cycle_count64();
+      if (cycles_per_tick_q16 == 0) {
+        return now;
+      }
+      uint16_t ticks =
+          static_cast<uint16_t>(hardware_timestamp) - anchor.hardware_timestamp;
+      uint64_t timestamp =
+          anchor.timestamp +
+          ((static_cast<uint64_t>(ticks) * cycles_per_tick_q16) >> 16);
+      // 2^16 ティック分のサイクル数
+      uint64_t period = cycles_per_tick_q16;
+      if (!anchor.valid || timestamp > now ||
+          now - anchor.timestamp >= period) {
+        timestamp = now;
+      }
+      anchor = {timestamp, static_cast<uint16_t>(hardware_timestamp), true};
+      return timestamp;
+    }
+
+    static inline void complete_transmit(CAN_HandleTypeDef *hcan,
+                                         size_t mailbox_index) {
+      auto state = stm32cubemx_helper::get_context<Handle, State>();
+      if (state->tx_callbacks.empty()) {
+        return;
+      }
+      uint32_t tir = hcan->Instance->sTxMailBox[mailbox_index].TIR;
+      CanTxEvent event{};
+      event.ide = (tir & CAN_TI0R_IDE) != 0;
+      event.id =
+          event.ide ? tir >> CAN_TI0R_EXID_Pos : tir >> CAN_TI0R_STID_Pos;
+      event.timestamp = state->get_timestamp(
+          state->timestamp_anchors[2],
+          HAL_CAN_GetTxTimestamp(hcan, CAN_TX_MAILBOX0 << mailbox_index));
+      state->tx_callbacks.invoke(event);
+    }
+
+    static inline void receive(CAN_HandleTypeDef *hcan, uint32_t fifo) {
+      CAN_RxHeaderTypeDef rx_header;
+      CanMessage msg;
+      bool is_pending = false;
+
+      auto state = stm32cubemx_helper::get_context<Handle, State>();
+
+      while (HAL_CAN_GetRxMessage(hcan, fifo, &rx_header, msg.data.data()) ==
+             HAL_OK) {
+        msg.timestamp = state->get_timestamp(state->timestamp_anchors[fifo],
+                                             rx_header.Timestamp);
+        state->rx_count.fetch_add(1, std::memory_order_relaxed);
+        state->bus_load.add_frame(
+            get_can_frame_bits(rx_header.IDE == CAN_ID_EXT, rx_header.DLC),
+            core::get_tick());
+        if (rx_header.FilterMatchIndex >=
+            state->filter_match_indices[fifo].size()) {
+          continue;
+        }
+        size_t filter_index =
+            state->filter_match_indices[fifo][rx_header.FilterMatchIndex];
+        if (filter_index >= FILTER_BANK_SIZE) {
+          continue;
+        }
+        state->rx_counts[filter_index].fetch_add(1, std::memory_order_relaxed);
+        if (!state->rx_callbacks[filter_index]) {
+          continue;
+        }
+        update_rx_message(msg, rx_header);
+        if (auto &pending_queue = state->pending_queues[fifo]) {
+          if (pending_queue->push({filter_index, msg})) {
+            is_pending = true;
+          } else {
+            state->rx_drop_count.fetch_add(1, std::memory_order_relaxed);
+          }
+        } else {
+          state->dispatch(filter_index, msg);
+        }
+      }
+      if (is_pending) {
+        state->notifier.set(0x1);
+        if (state->dispatch_irqn) {
+          HAL_NVIC_SetPendingIRQ(*state->dispatch_irqn);
+        }
+      }
+    }
+
+    void dispatch(size_t filter_index, const CanMessage &msg) {
+      if (auto rx_callback = rx_callbacks[filter_index]) {
+        rx_callback(rx_callback_contexts[filter_index], msg);
+      }
+    }
   };
 
 public:
   BxCan() : state_{std::make_unique<State>()} {}
 
   bool start() {
-    if (HAL_CAN_ActivateNotification(Handle, CAN_IT_RX_FIFO0_MSG_PENDING) !=
-        HAL_OK) {
+    update_bit_timing();
+    // ABOM は初期化モード中 (HAL_CAN_Start 前) に設定する
+    if (state_->bus_off_recovery) {
+      Handle->Instance->MCR = Handle->Instance->MCR | CAN_MCR_ABOM;
+    } else {
+      Handle->Instance->MCR = Handle->Instance->MCR & ~CAN_MCR_ABOM;
+    }
+    if (!attach_dispatch_filters()) {
+      return false;
+    }
+    if (HAL_CAN_ActivateNotification(Handle, NOTIFICATIONS) != HAL_OK) {
       return false;
     }
     return HAL_CAN_Start(Handle) == HAL_OK;
@@ -68,24 +258,50 @@ public:
     if (HAL_CAN_Stop(Handle) != HAL_OK) {
       return false;
     }
-    return HAL_CAN_DeactivateNotification(
-               Handle, CAN_IT_RX_FIFO0_MSG_PENDING) == HAL_OK;
+    if (HAL_CAN_DeactivateNotification(Handle, NOTIFICATIONS) != HAL_OK) {
+      return false;
+    }
+    detach_dispatch_filters();
+    return true;
   }
 
   bool transmit(const CanMessage &msg, uint32_t timeout) {
     CAN_TxHeaderTypeDef tx_header = create_tx_header(msg);
-    uint32_t tx_mailbox;
     core::Timeout is_timeout{timeout};
-    while (HAL_CAN_AddTxMessage(Handle, &tx_header, msg.data.data(),
-                                &tx_mailbox) != HAL_OK) {
+    while (!add_tx_message(tx_header, msg.data.data())) {
       if (is_timeout) {
         return false;
       }
+      state_->tx_retry_count.fetch_add(1, std::memory_order_relaxed);
       core::yield();
     }
+    count_tx_message(msg);
     return true;
   }
 
+  size_t transmit_burst(std::span<const CanMessage> msgs, uint32_t timeout) {
+    core::Timeout is_timeout{timeout};
+    size_t count = 0;
+    while (count < msgs.size()) {
+      uint32_t free_level = HAL_CAN_GetTxMailboxesFreeLevel(Handle);
+      while (free_level > 0 && count < msgs.size()) {
+        CAN_TxHeaderTypeDef tx_header = create_tx_header(msgs[count]);
+        if (!add_tx_message(tx_header, msgs[count].data.data())) {
+          break;
+        }
+        count_tx_message(msgs[count]);
+        --free_level;
+        ++count;
+      }
+      if (count == msgs.size() || is_timeout) {
+        break;
+      }
+      state_->tx_retry_count.fetch_add(1, std::memory_order_relaxed);
+      core::yield();
+    }
+    return count;
+  }
+
   std::optional<size_t>
   attach_rx_filter(const CanFilter &filter,
                    void (*callback)(void *context, const CanMessage &msg),
@@ -99,20 +315,213 @@ public:
     }
     state_->rx_callbacks[*filter_index] = callback;
     state_->rx_callback_contexts[*filter_index] = context;
+    state_->filter_fifos[*filter_index] = filter.fifo == 1 ? 1 : 0;
+    state_->update_filter_match_indices();
     return filter_index;
   }
 
+  std::optional<std::vector<size_t>> attach_rx_filter_plan(
+      const BxCanFilterPlan &plan, uint32_t fifo,
+      void (*callback)(void *context, const CanMessage &msg), void *context) {
+    if (!callback || get_free_rx_filter_count() < plan.banks.size()) {
+      return std::nullopt;
+    }
+    std::vector<size_t> filter_indices;
+    for (const auto &bank : plan.banks) {
+      auto filter_index = find_rx_filter_index({});
+      if (!enable_rx_filter_bank(bank, fifo, *filter_index)) {
+        for (size_t attached_index : filter_indices) {
+          detach_rx_filter(attached_index);
+        }
+        return std::nullopt;
+      }
+      state_->rx_callbacks[*filter_index] = callback;
+      state_->rx_callback_contexts[*filter_index] = context;
+      state_->filter_fifos[*filter_index] = fifo == 1 ? 1 : 0;
+      state_->filter_counts[*filter_index] = bank.filter_count();
+      filter_indices.push_back(*filter_index);
+    }
+    state_->update_filter_match_indices();
+    return filter_indices;
+  }
+
   bool detach_rx_filter(size_t filter_index) {
     if (!disable_rx_filter(filter_index)) {
       return false;
     }
     state_->rx_callbacks[filter_index] = nullptr;
+    state_->filter_fifos[filter_index] = 0;
+    state_->filter_counts[filter_index] = 1;
+    state_->update_filter_match_indices();
+    return true;
+  }
+
+  bool subscribe(uint32_t id, bool ide,
+                 void (*callback)(void *context, const CanMessage &msg),
+                 void *context) {
+    return state_->dispatch_table.subscribe(id, ide, callback, context);
+  }
+
+  bool unsubscribe(uint32_t id, bool ide) {
+    return state_->dispatch_table.unsubscribe(id, ide);
+  }
+
+  size_t get_free_rx_filter_count() const {
+    return std::count(state_->rx_callbacks.begin(), state_->rx_callbacks.end(),
+                      nullptr);
+  }
+
+  std::optional<size_t>
+  attach_tx_callback(void (*callback)(void *context, const CanTxEvent &event),
+                     void *context) {
+    uint32_t primask = __get_PRIMASK();
+    __disable_irq();
+    auto index = state_->tx_callbacks.attach(callback, context);
+    __set_PRIMASK(primask);
+    if (!index) {
+      return std::nullopt;
+    }
+    if (HAL_CAN_ActivateNotification(Handle, CAN_IT_TX_MAILBOX_EMPTY) !=
+        HAL_OK) {
+      detach_tx_callback(*index);
+      return std::nullopt;
+    }
+    return index;
+  }
+
+  bool detach_tx_callback(size_t index) {
+    uint32_t primask = __get_PRIMASK();
+    __disable_irq();
+    bool detached = state_->tx_callbacks.detach(index);
+    bool is_empty = state_->tx_callbacks.empty();
+    __set_PRIMASK(primask);
+    if (detached && is_empty) {
+      // 送信完了の割り込みは、コールバックがなくなったら止める
+      HAL_CAN_DeactivateNotification(Handle, CAN_IT_TX_MAILBOX_EMPTY);
+    }
+    return detached;
+  }
+
+  // 範囲外の FIFO やフィルター番号には 0 を返す
+  uint32_t get_rx_overrun_count(uint32_t fifo) const {
+    if (fifo >= state_->rx_overrun_counts.size()) {
+      return 0;
+    }
+    return state_->rx_overrun_counts[fifo].load(std::memory_order_relaxed);
+  }
+
+  uint32_t get_rx_count(size_t filter_index) const {
+    if (filter_index >= state_->rx_counts.size()) {
+      return 0;
+    }
+    return state_->rx_counts[filter_index].load(std::memory_order_relaxed);
+  }
+
+  CanStats get_stats() const {
+    uint32_t esr = Handle->Instance->ESR;
+    CanStats stats{};
+    stats.tx_count = state_->tx_count.load(std::memory_order_relaxed);
+    stats.tx_retry_count =
+        state_->tx_retry_count.load(std::memory_order_relaxed);
+    stats.rx_count = state_->rx_count.load(std::memory_order_relaxed);
+    stats.rx_overrun_counts = {get_rx_overrun_count(0),
+                               get_rx_overrun_count(1)};
+    stats.tec = (esr >> CAN_ESR_TEC_Pos) & 0xFF;
+    stats.rec = (esr >> CAN_ESR_REC_Pos) & 0xFF;
+    stats.last_error_code = (esr & CAN_ESR_LEC) >> CAN_ESR_LEC_Pos;
+    stats.error_passive = (esr & CAN_ESR_EPVF) != 0;
+    stats.bus_off = (esr & CAN_ESR_BOFF) != 0;
+    stats.bus_off_count = state_->bus_off_count.load(std::memory_order_relaxed);
+    stats.rx_drop_count = state_->rx_drop_count.load(std::memory_order_relaxed);
+    stats.bus_load =
+        state_->bus_load.get_load(core::get_tick(), state_->bitrate);
+    return stats;
+  }
+
+  // 受信コールバックを割り込みから dispatch_pending() に移す。start() 前に呼ぶ
+  bool enable_deferred_dispatch(size_t capacity) {
+    for (auto &pending_queue : state_->pending_queues) {
+      pending_queue =
+          std::make_unique<core::RingBuffer<typename State::PendingMessage>>(
+              capacity);
+    }
     return true;
   }
 
+  // RTOS がない場合に、受信時に保留にする割り込みを指定する。
+  // 空いている割り込みを低い優先度で有効にし、そのハンドラから
+  // dispatch_pending(0) を呼ぶ
+  bool enable_deferred_dispatch(size_t capacity, IRQn_Type irqn) {
+    state_->dispatch_irqn = irqn;
+    return enable_deferred_dispatch(capacity);
+  }
+
+  size_t dispatch_pending(uint32_t timeout) {
+    auto &pending_queues = state_->pending_queues;
+    if (!pending_queues[0]) {
+      return 0;
+    }
+    state_->notifier.reset();
+    if (pending_queues[0]->size() == 0 && pending_queues[1]->size() == 0) {
+      state_->notifier.wait(0x1, timeout);
+    }
+    size_t count = 0;
+    for (auto &pending_queue : pending_queues) {
+      while (auto pending = pending_queue->pop()) {
+        state_->dispatch(pending->filter_index, pending->msg);
+        ++count;
+      }
+    }
+    return count;
+  }
+
+  // true にすると、バスオフから自動で復帰する (bxCAN の ABOM)。
+  // 次の start() から有効になる
+  void set_bus_off_recovery(bool enable) { state_->bus_off_recovery = enable; }
+
 private:
+  static constexpr uint32_t NOTIFICATIONS =
+      CAN_IT_RX_FIFO0_MSG_PENDING | CAN_IT_RX_FIFO0_OVERRUN |
+      CAN_IT_RX_FIFO1_MSG_PENDING | CAN_IT_RX_FIFO1_OVERRUN | CAN_IT_BUSOFF |
+      CAN_IT_ERROR;
+
   std::unique_ptr<State> state_;
 
+  // ビットレートと、1ビットタイムあたりの CPU サイクル数 (16.16 固定小数点)
+  // を求める。TTCM が無効ならハードウェアタイムスタンプは使わない
+  void update_bit_timing() {
+    uint32_t pclk = HAL_RCC_GetPCLK1Freq();
+    uint32_t btr = Handle->Instance->BTR;
+    uint32_t time_quanta = 3 + ((btr & CAN_BTR_TS1) >> CAN_BTR_TS1_Pos) +
+                           ((btr & CAN_BTR_TS2) >> CAN_BTR_TS2_Pos);
+    uint64_t bit_clocks = ((btr & CAN_BTR_BRP) + 1) * time_quanta;
+    state_->bitrate = pclk / bit_clocks;
+    state_->cycles_per_tick_q16 = 0;
+    if (Handle->Init.TimeTriggeredMode == ENABLE && pclk != 0) {
+      state_->cycles_per_tick_q16 =
+          ((static_cast<uint64_t>(SystemCoreClock) * bit_clocks) << 16) / pclk;
+    }
+  }
+
+  // 周期送信や送信完了コールバックの割り込みからも送信するので、HAL が
+  // 空きメールボックスを選んでから書き込むまでを割り込み禁止にする
+  static bool add_tx_message(const CAN_TxHeaderTypeDef &tx_header,
+                             const uint8_t *data) {
+    uint32_t tx_mailbox;
+    uint32_t primask = __get_PRIMASK();
+    __disable_irq();
+    HAL_StatusTypeDef status =
+        HAL_CAN_AddTxMessage(Handle, &tx_header, data, &tx_mailbox);
+    __set_PRIMASK(primask);
+    return status == HAL_OK;
+  }
+
+  void count_tx_message(const CanMessage &msg) {
+    state_->tx_count.fetch_add(1, std::memory_order_relaxed);
+    state_->bus_load.add_frame(get_can_frame_bits(msg.ide, msg.dlc),
+                               core::get_tick());
+  }
+
   std::optional<size_t> find_rx_filter_index(const CanFilter &) {
     auto it = std::find(state_->rx_callbacks.begin(),
                         state_->rx_callbacks.end(), nullptr);
@@ -122,29 +531,86 @@ private:
     return std::distance(state_->rx_callbacks.begin(), it);
   }
 
+  // subscribe() された ID をまとめてフィルターに割り当て、受信したフレームを
+  // ID ごとの表で振り分ける。フィルターを通過した余分な ID はここで捨てる
+  bool attach_dispatch_filters() {
+    if (!state_->dispatch_filter_indices.empty()) {
+      return true;
+    }
+    // 通信中は subscribe() できないように、ID がなくても表を確定する
+    state_->dispatch_table.build();
+    if (state_->dispatch_table.empty()) {
+      return true;
+    }
+    auto plan = plan_bxcan_filters(state_->dispatch_table.get_ids(),
+                                   get_free_rx_filter_count());
+    if (!plan) {
+      state_->dispatch_table.release();
+      return false;
+    }
+    auto filter_indices = attach_rx_filter_plan(
+        *plan, 0,
+        [](void *context, const CanMessage &msg) {
+          auto *dispatch_table =
+              static_cast<CanDispatchTable<CanMessage> *>(context);
+          dispatch_table->dispatch(msg);
+        },
+        &state_->dispatch_table);
+    if (!filter_indices) {
+      state_->dispatch_table.release();
+      return false;
+    }
+    state_->dispatch_filter_indices = std::move(*filter_indices);
+    return true;
+  }
+
+  void detach_dispatch_filters() {
+    for (size_t filter_index : state_->dispatch_filter_indices) {
+      detach_rx_filter(filter_index);
+    }
+    state_->dispatch_filter_indices.clear();
+    state_->dispatch_table.release();
+  }
+
   static inline bool enable_rx_filter(const CanFilter &filter,
                                       uint32_t filter_index) {
-    CAN_FilterTypeDef filter_config{};
+    BxCanFilterBank bank{};
     if (filter.ide) {
-      filter_config.FilterIdHigh = filter.id >> 13;
-      filter_config.FilterIdLow = ((filter.id << 3) & 0xFFFF) | 0x4;
-      filter_config.FilterMaskIdHigh = filter.mask >> 13;
-      filter_config.FilterMaskIdLow = ((filter.mask << 3) & 0xFFFF) | 0x4;
+      bank.filter_id_high = filter.id >> 13;
+      bank.filter_id_low = ((filter.id << 3) & 0xFFFF) | 0x4;
+      bank.filter_mask_id_high = filter.mask >> 13;
+      bank.filter_mask_id_low = ((filter.mask << 3) & 0xFFFF) | 0x4;
     } else {
-      filter_config.FilterIdHigh = filter.id << 5;
-      filter_config.FilterIdLow = 0x0;
-      filter_config.FilterMaskIdHigh = filter.mask << 5;
-      filter_config.FilterMaskIdLow = 0x0;
+      bank.filter_id_high = filter.id << 5;
+      bank.filter_id_low = 0x0;
+      bank.filter_mask_id_high = filter.mask << 5;
+      bank.filter_mask_id_low = 0x0;
     }
-    filter_config.FilterFIFOAssignment = CAN_FILTER_FIFO0;
+    bank.list_mode = false;
+    bank.scale_32bit = true;
+    return enable_rx_filter_bank(bank, filter.fifo, filter_index);
+  }
+
+  static inline bool enable_rx_filter_bank(const BxCanFilterBank &bank,
+                                           uint32_t fifo,
+                                           uint32_t filter_index) {
+    CAN_FilterTypeDef filter_config{};
+    filter_config.FilterIdHigh = bank.filter_id_high;
+    filter_config.FilterIdLow = bank.filter_id_low;
+    filter_config.FilterMaskIdHigh = bank.filter_mask_id_high;
+    filter_config.FilterMaskIdLow = bank.filter_mask_id_low;
+    filter_config.FilterFIFOAssignment =
+        fifo == 1 ? CAN_FILTER_FIFO1 : CAN_FILTER_FIFO0;
     filter_config.FilterBank = filter_index;
 #ifdef CAN2
     if (Handle->Instance == CAN2) {
       filter_config.FilterBank += State::FILTER_BANK_SIZE;
     }
 #endif
-    filter_config.FilterMode = CAN_FILTERMODE_IDMASK;
-    filter_config.FilterScale = CAN_FILTERSCALE_32BIT;
+    filter_config.FilterMode =
+        bank.list_mode ? CAN_FILTERMODE_IDLIST : CAN_FILTERMODE_IDMASK;
+    filter_config.FilterScale =
+        bank.scale_32bit ? CAN_FILTERSCALE_32BIT : CAN_FILTERSCALE_16BIT;
     filter_config.FilterActivation = ENABLE;
     filter_config.SlaveStartFilterBank = State::FILTER_BANK_SIZE;
 
@@ -159,7 +625,11 @@ private:
       filter_config.FilterBank += State::FILTER_BANK_SIZE;
     }
 #endif
+    filter_config.FilterFIFOAssignment = CAN_FILTER_FIFO0;
+    filter_config.FilterMode = CAN_FILTERMODE_IDMASK;
+    filter_config.FilterScale = CAN_FILTERSCALE_32BIT;
     filter_config.FilterActivation = DISABLE;
+    filter_config.SlaveStartFilterBank = State::FILTER_BANK_SIZE;
 
     return HAL_CAN_ConfigFilter(Handle, &filter_config) == HAL_OK;
   }
@@ -1,27 +1,164 @@
 #pragma once
 
 #include <array>
+#include <cstddef>
 #include <cstdint>
 #include <functional>
 #include <optional>
-
-#include "halx/core.hpp"
+#include <span>
 
 namespace halx::peripheral {
 
+/**
+ * `fifo` は受信に使う FIFO (0 または 1) です。FIFO1 は別の割り込み
+ * (bxCAN: RX1, FDCAN: 割り込みライン1) で処理されるので、高頻度・高優先度の
+ * フレームを FIFO1 に振り分け、CubeMX の NVIC 設定で優先度を分けられます。
+ */
 struct CanFilter {
   uint32_t id;
   uint32_t mask;
   bool ide;
+  uint32_t fifo = 0;
 };
 
+/**
+ * `timestamp` は受信時刻で、`core::get_cycle_count64()` と同じ CPU サイクル
+ * 単位です。FDCAN のタイムスタンプカウンタ、bxCAN のタイムトリガモード
+ * (TTCM) が使えればフレームの受信時刻、使えなければ割り込み時の時刻になります。
+ * 送信時は無視されます。`VirtualCan` だけはノードの時計(ナノ秒)の時刻です。
+ */
 struct CanMessage {
   uint32_t id;
   bool ide;
   uint8_t dlc;
   std::array<uint8_t, 8> data;
+  uint64_t timestamp = 0;
+};
+
+/**
+ * CAN FD フレーム。`dlc` はデータのバイト数(0-64)で、送信時は DLC
+ * で表現できる長さ(12, 16, 20, 24, 32, 48, 64)に切り上げられます。
+ * `brs` が true のときデータフェーズをデータビットレートで送信します。
+ * `timestamp` は `CanMessage::timestamp` と同じです。
+ */
+struct CanFdMessage {
+  uint32_t id;
+  bool ide;
+  bool brs;
+  uint8_t dlc;
+  std::array<uint8_t, 64> data;
+  uint64_t timestamp = 0;
+};
+
+/**
+ * 送信完了の通知です。`timestamp` は `CanMessage::timestamp` と同じ単位です。
+ */
+struct CanTxEvent {
+  uint32_t id;
+  bool ide;
+  uint64_t timestamp;
+};
+
+// 1つの CAN に登録できる送信完了コールバックの数
+inline constexpr size_t CAN_TX_CALLBACK_SIZE = 4;
+
+/**
+ * 送信完了コールバックの登録先です。ドライバーが持ち、送信完了の割り込み
+ * から `invoke()` を呼びます。`attach()` / `detach()` は割り込みを禁止して
+ * 呼んでください。
+ */
+class CanTxCallbackList {
+public:
+  using Callback = void (*)(void *context, const CanTxEvent &event);
+
+  std::optional<size_t> attach(Callback callback, void *context) {
+    if (!callback) {
+      return std::nullopt;
+    }
+    for (size_t i = 0; i < entries_.size(); ++i) {
+      if (!entries_[i].callback) {
+        entries_[i] = {callback, context};
+        return i;
+      }
+    }
+    return std::nullopt;
+  }
+
+  bool detach(size_t index) {
+    if (index >= entries_.size() || !entries_[index].callback) {
+      return false;
+    }
+    entries_[index] = {};
+    return true;
+  }
+
+  bool empty() const {
+    for (const auto &entry : entries_) {
+      if (entry.callback) {
+        return false;
+      }
+    }
+    return true;
+  }
+
+  void invoke(const CanTxEvent &event) const {
+    for (const auto &entry : entries_) {
+      if (entry.callback) {
+        entry.callback(entry.context, event);
+      }
+    }
+  }
+
+private:
+  struct Entry {
+    Callback callback = nullptr;
+    void *context = nullptr;
+  };
+
+  std::array<Entry, CAN_TX_CALLBACK_SIZE> entries_{};
+};
+
+/**
+ * `get_stats()` で取得するバスの状態です。
+ *
+ * - `tx_count` / `rx_count`: 送信キューに積んだ / 受信したフレーム数
+ * - `tx_retry_count`: 送信キューが満杯で `transmit` が再試行した回数
+ * - `tec` / `rec`: 送信 / 受信エラーカウンタ
+ * - `last_error_code`: 最後に検出したプロトコルエラー (LEC)
+ * - `bus_off_count`: バスオフになった回数
+ * - `rx_drop_count`: 遅延ディスパッチのキューが満杯で捨てたフレーム数
+ * - `bus_load`: 直近1秒のバス負荷率の推定値 (0.0-1.0)
+ */
+struct CanStats {
+  uint32_t tx_count;
+  uint32_t tx_retry_count;
+  uint32_t rx_count;
+  std::array<uint32_t, 2> rx_overrun_counts;
+  uint32_t tec;
+  uint32_t rec;
+  uint32_t last_error_code;
+  bool error_passive;
+  bool bus_off;
+  uint32_t bus_off_count;
+  uint32_t rx_drop_count;
+  float bus_load;
 };
 
+inline constexpr std::array<uint8_t, 16> CAN_DLC_TO_SIZE{
+    0, 1, 2, 3, 4, 5, 6, 7, 8, 12, 16, 20, 24, 32, 48, 64};
+
+inline constexpr std::array<uint8_t, 65> CAN_SIZE_TO_DLC = [] {
+  std::array<uint8_t, 65> table{};
+  uint8_t dlc = 0;
+  for (size_t size = 0; size < table.size(); ++size) {
+    if (size > CAN_DLC_TO_SIZE[dlc]) {
+      ++dlc;
+    }
+    table[size] = dlc;
+  }
+  return table;
+}();
+
 /**
  * @code{.cpp}
  * #include <cstdio>
@@ -49,6 +186,17 @@ struct CanMessage {
  *   RingBuffer<CanMessage> rx_queue(10);
  *   can1.attach_rx_queue(rx_filter, rx_queue);
  *
+ *   // ID ごとの受信コールバック (start() 前に登録する)
+ *   // start() で登録済みの ID がフィルターにまとめて割り当てられる
+ *   for (uint32_t id = 0x201; id <= 0x208; ++id) {
+ *     can1.subscribe(
+ *         id, false,
+ *         [](void *, const CanMessage &msg) {
+ *           printf("motor: %d\r\n", (int)(msg.id - 0x200));
+ *         },
+ *         nullptr);
+ *   }
+ *
  *   // CAN通信開始
  *   can1.start();
  *
@@ -66,6 +214,27 @@ struct CanMessage {
  *     tx_message.data[0]++;
  *   }
  *
+ *   // 複数フレームを空いている送信メールボックスにまとめて投入
+ *   std::array<CanMessage, 4> tx_messages{};
+ *   for (size_t i = 0; i < tx_messages.size(); ++i) {
+ *     tx_messages[i] = {.id = static_cast<uint32_t>(0x10 + i),
+ *                       .ide = false,
+ *                       .dlc = 8,
+ *                       .data = {}};
+ *   }
+ *   size_t sent = can1.transmit_burst(tx_messages, 10);
+ *   printf("sent: %d\r\n", (int)sent);
+ *
+ *   // CAN FD で64バイト送信 (FDCAN のみ)
+ *   CanFdMessage tx_fd_message = {
+ *       .id = 0x4,
+ *       .ide = false,
+ *       .brs = true,
+ *       .dlc = 64,
+ *       .data = {0x0},
+ *   };
+ *   can1.transmit(tx_fd_message, MAX_DELAY);
+ *
  *   while (true) {
  *     // 受信
  *     CanMessage rx_message;
@@ -77,28 +246,148 @@ struct CanMessage {
  *   }
  * }
  * @endcode
+ *
+ * 受信コールバックを割り込みではなくスレッドで実行する (遅延ディスパッチ)
+ * ときは、`start()` 前に `enable_deferred_dispatch()` を呼び、優先度の高い
+ * 専用のスレッドで `dispatch_pending()` を呼び続けます。呼ぶスレッドが
+ * なければ、受信したフレームはキューが満杯になると捨てられます。
+ *
+ * @code{.cpp}
+ * #include <cstdio>
+ * #include <halx/core.hpp>
+ * #include <halx/peripheral.hpp>
+ * #include <halx/rtos.hpp>
+ *
+ * extern FDCAN_HandleTypeDef hfdcan1;
+ *
+ * extern "C" void main_thread(void *) {
+ *   using namespace halx::core;
+ *   using namespace halx::peripheral;
+ *   using namespace halx::rtos;
+ *
+ *   Can<&hfdcan1> can1;
+ *   can1.subscribe(
+ *       0x201, false,
+ *       [](void *, const CanMessage &msg) {
+ *         // スレッドで実行されるので、printf やミューテックスも使える
+ *         printf("data: %d\r\n", (int)msg.data[0]);
+ *       },
+ *       nullptr);
+ *   can1.enable_deferred_dispatch(32);
+ *   can1.start();
+ *
+ *   // 受信コールバックを実行する専用のスレッド
+ *   Thread dispatcher(
+ *       [&can1] {
+ *         while (true) {
+ *           can1.dispatch_pending(MAX_DELAY);
+ *         }
+ *       },
+ *       1024, osPriorityRealtime);
+ *
+ *   while (true) {
+ *     delay(100);
+ *   }
+ * }
+ * @endcode
  */
 class CanBase {
 public:
   virtual ~CanBase() {}
   virtual bool start() = 0;
   virtual bool stop() = 0;
+  // 割り込みからも `timeout` を 0 にして呼べる。送信キューに積む間だけ
+  // 割り込みを禁止するので、スレッドからの送信とキューの空きを取り合わない
   virtual bool transmit(const CanMessage &msg, uint32_t timeout) = 0;
+  // 送信キューに積めたフレーム数を返す。既定の実装は `transmit()` を順に
+  // 呼び、失敗したところで止める
+  virtual size_t transmit_burst(std::span<const CanMessage> msgs,
+                                uint32_t timeout) {
+    return transmit_each(msgs, timeout);
+  }
   virtual std::optional<size_t>
   attach_rx_filter(const CanFilter &filter,
                    void (*callback)(void *context, const CanMessage &msg),
                    void *context) = 0;
   virtual bool detach_rx_filter(size_t filter_index) = 0;
 
+  // 以下は既定の実装を持つので、これらを実装していない CanBase の
+  // サブクラスもそのままコンパイルできる。既定の実装は常に失敗するか 0 を
+  // 返す
+
+  // start() 前に呼ぶ。通信中は false を返す
+  virtual bool subscribe(uint32_t, bool,
+                         void (*)(void *context, const CanMessage &msg),
+                         void *) {
+    return false;
+  }
+  // 通信中はコールバックを無効にするだけで、フィルターは次の start() で
+  // 作り直す
+  virtual bool unsubscribe(uint32_t, bool) { return false; }
+  // 複数登録でき、`detach_tx_callback()` に渡す番号を返す。
+  // `CAN_TX_CALLBACK_SIZE` 個を超えると std::nullopt を返す
+  virtual std::optional<size_t>
+  attach_tx_callback(void (*)(void *context, const CanTxEvent &event),
+                     void *) {
+    return std::nullopt;
+  }
+  virtual bool detach_tx_callback(size_t) { return false; }
+  virtual uint32_t get_rx_overrun_count(uint32_t) const { return 0; }
+  virtual uint32_t get_rx_count(size_t) const { return 0; }
+  virtual CanStats get_stats() const { return {}; }
+  virtual void set_bus_off_recovery(bool) {}
+  virtual bool enable_deferred_dispatch(size_t) { return false; }
+  virtual size_t dispatch_pending(uint32_t) { return 0; }
+
+  // CAN FD のフレームを送信できるか。false なら CAN FD の送信は常に失敗する
+  virtual bool supports_fd() const { return false; }
+  virtual bool transmit(const CanFdMessage &, uint32_t) { return false; }
+  virtual size_t transmit_burst(std::span<const CanFdMessage> msgs,
+                                uint32_t timeout) {
+    return transmit_each(msgs, timeout);
+  }
+  virtual std::optional<size_t>
+  attach_rx_filter(const CanFilter &,
+                   void (*)(void *context, const CanFdMessage &msg), void *) {
+    return std::nullopt;
+  }
+  virtual bool subscribe(uint32_t, bool,
+                         void (*)(void *context, const CanFdMessage &msg),
+                         void *) {
+    return false;
+  }
+
   template <class Queue>
   std::optional<size_t> attach_rx_queue(const CanFilter &filter, Queue &queue) {
-    return attach_rx_filter(
-        filter,
-        [](void *context, const CanMessage &msg) {
-          auto *queue = static_cast<Queue *>(context);
-          queue->push(msg);
-        },
-        &queue);
+    if constexpr (requires(Queue &queue, const CanFdMessage &msg) {
+                    queue.push(msg);
+                  }) {
+      return attach_rx_filter(
+          filter,
+          [](void *context, const CanFdMessage &msg) {
+            auto *queue = static_cast<Queue *>(context);
+            queue->push(msg);
+          },
+          &queue);
+    } else {
+      return attach_rx_filter(
+          filter,
+          [](void *context, const CanMessage &msg) {
+            auto *queue = static_cast<Queue *>(context);
+            queue->push(msg);
+          },
+          &queue);
+    }
+  }
+
+private:
+  template <class Message>
+  size_t transmit_each(std::span<const Message> msgs, uint32_t timeout) {
+    size_t count = 0;
+    while (count < msgs.size() && transmit(msgs[count], timeout)) {
+      ++count;
+    }
+    return count;
   }
 };
 
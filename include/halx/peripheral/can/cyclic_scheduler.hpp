@@ -0,0 +1,289 @@
+#pragma once
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <numeric>
+#include <optional>
+#include <vector>
+
+#include "halx/core.hpp"
+#include "halx/peripheral/tim.hpp"
+
+#include "bus_load.hpp"
+#include "common.hpp"
+
+namespace halx::peripheral {
+
+/**
+ * 周期送信エントリの送信状況です。間隔は `core::get_cycle_count()` と同じ
+ * CPU サイクル単位で、ジッタは `max_interval - min_interval` です。
+ *
+ * - `sent_count`: 送信キューに積んだフレーム数
+ * - `late_count`: 送信キューが満杯で、次のティックに送信を持ち越した回数
+ * - `coalesced_count`: 持ち越し中に次の周期が来て、1フレームにまとめた回数
+ */
+struct CanCyclicStats {
+  uint32_t sent_count;
+  uint32_t late_count;
+  uint32_t coalesced_count;
+  uint32_t min_interval;
+  uint32_t max_interval;
+};
+
+/**
+ * タイマー割り込みから周期的に CAN フレームを送信するスケジューラーです。
+ * 周期と位相はタイマー割り込みの回数(ティック)で指定します。
+ *
+ * - 位相を省略すると、既存のエントリと送信タイミングが重なりにくい位相を
+ *   選び、バス負荷を時間方向に分散します
+ * - `producer` を指定すると、送信の直前に割り込みから呼び出し、最新の値で
+ *   フレームを作らせます。指定しない場合は `update()` で渡した最新の値を
+ *   送信します
+ * - 送信キューが満杯のときは次のティックで再試行し、その間に次の周期が
+ *   来ても1フレームにまとめて最新の値だけを送信します
+ *
+ * タイマー割り込みから `CanBase::transmit()` を呼びます。bxCAN / FDCAN の
+ * ドライバは送信キューに積む間だけ割り込みを禁止するので、同じ CAN に
+ * スレッドから送信しても送信メールボックスを取り合ってフレームが失われる
+ * ことはありません。
+ *
+ * `add()` / `remove()` は `start()` 前か `stop()` 後に呼んでください。
+ * タイマーを使うので `halx/peripheral.hpp` には含まれません。このヘッダーを
+ * 直接インクルードしてください。
+ *
+ * @code{.cpp}
+ * #include <halx/core.hpp>
+ * #include <halx/peripheral.hpp>
+ * #include <halx/peripheral/can/cyclic_scheduler.hpp>
+ *
+ * extern FDCAN_HandleTypeDef hfdcan1;
+ * extern TIM_HandleTypeDef htim6; // 1kHz で割り込みが発生するように設定
+ *
+ * extern "C" void main_thread(void *) {
+ *   using namespace halx::core;
+ *   using namespace halx::peripheral;
+ *
+ *   Can<&hfdcan1> can1;
+ *   Tim<&htim6> tim6;
+ *   can1.start();
+ *
+ *   std::array<int16_t, 4> currents{};
+ *
+ *   CanCyclicScheduler scheduler(can1, tim6);
+ *   // モーターの指令値を 1ms 周期で送信
+ *   scheduler.add(
+ *       {.id = 0x200, .ide = false, .dlc = 8, .data = {}}, 1, std::nullopt,
+ *       [](void *context, CanMessage &msg) {
+ *         auto &currents = *static_cast<std::array<int16_t, 4> *>(context);
+ *         for (size_t i = 0; i < currents.size(); ++i) {
+ *           msg.data[i * 2] = currents[i] >> 8;
+ *           msg.data[i * 2 + 1] = currents[i];
+ *         }
+ *       },
+ *       &currents);
+ *   // 状態を 100ms 周期で送信
+ *   auto status = scheduler.add(
+ *       {.id = 0x300, .ide = false, .dlc = 1, .data = {}}, 100);
+ *   scheduler.start();
+ *
+ *   while (true) {
+ *     scheduler.update(*status,
+ *                      {.id = 0x300, .ide = false, .dlc = 1, .data = {1}});
+ *     delay(10);
+ *   }
+ * }
+ * @endcode
+ */
+class CanCyclicScheduler {
+public:
+  CanCyclicScheduler(CanBase &can, TimBase &tim) : can_{can}, tim_{tim} {}
+
+  ~CanCyclicScheduler() { stop(); }
+
+  CanCyclicScheduler(const CanCyclicScheduler &) = delete;
+  CanCyclicScheduler &operator=(const CanCyclicScheduler &) = delete;
+
+  std::optional<size_t>
+  add(const CanMessage &msg, uint32_t period,
+      std::optional<uint32_t> phase = std::nullopt,
+      void (*producer)(void *context, CanMessage &msg) = nullptr,
+      void *context = nullptr) {
+    if (started_ || period == 0 || (phase && *phase >= period)) {
+      return std::nullopt;
+    }
+    Entry entry{
+        .msg = msg,
+        .period = period,
+        .phase = phase ? *phase : find_phase(period),
+        .producer = producer,
+        .context = context,
+        .is_pending = false,
+        .is_active = true,
+        .last_cycle_count = 0,
+        .stats = {.sent_count = 0,
+                  .late_count = 0,
+                  .coalesced_count = 0,
+                  .min_interval = UINT32_MAX,
+                  .max_interval = 0},
+    };
+    auto it = std::find_if(entries_.begin(), entries_.end(),
+                           [](const Entry &entry) { return !entry.is_active; });
+    if (it == entries_.end()) {
+      entries_.push_back(entry);
+      return entries_.size() - 1;
+    }
+    *it = entry;
+    return it - entries_.begin();
+  }
+
+  bool remove(size_t index) {
+    if (started_ || index >= entries_.size() || !entries_[index].is_active) {
+      return false;
+    }
+    entries_[index].is_active = false;
+    return true;
+  }
+
+  // 次に送信するフレームの内容を差し替える。スレッドから呼び出せる
+  bool update(size_t index, const CanMessage &msg) {
+    if (index >= entries_.size() || !entries_[index].is_active) {
+      return false;
+    }
+    uint32_t primask = __get_PRIMASK();
+    __disable_irq();
+    entries_[index].msg = msg;
+    __set_PRIMASK(primask);
+    return true;
+  }
+
+  bool start() {
+    if (started_) {
+      return false;
+    }
+    core::enable_cycle_counter();
+    tick_ = 0;
+    if (!tim_.attach_callback(
+            [](void *context) {
+              static_cast<CanCyclicScheduler *>(context)->on_tick();
+            },
+            this)) {
+      return false;
+    }
+    if (!tim_.start()) {
+      tim_.detach_callback();
+      return false;
+    }
+    started_ = true;
+    return true;
+  }
+
+  bool stop() {
+    if (!started_) {
+      return false;
+    }
+    tim_.stop();
+    tim_.detach_callback();
+    started_ = false;
+    return true;
+  }
+
+  std::optional<CanCyclicStats> get_stats(size_t index) const {
+    if (index >= entries_.size() || !entries_[index].is_active) {
+      return std::nullopt;
+    }
+    uint32_t primask = __get_PRIMASK();
+    __disable_irq();
+    CanCyclicStats stats = entries_[index].stats;
+    __set_PRIMASK(primask);
+    return stats;
+  }
+
+private:
+  struct Entry {
+    CanMessage msg;
+    uint32_t period;
+    uint32_t phase;
+    void (*producer)(void *context, CanMessage &msg);
+    void *context;
+    bool is_pending;
+    bool is_active;
+    uint32_t last_cycle_count;
+    CanCyclicStats stats;
+  };
+
+  CanBase &can_;
+  TimBase &tim_;
+  std::vector<Entry> entries_;
+  uint32_t tick_ = 0;
+  bool started_ = false;
+
+  // 周期 `period`・位相 `phase` のエントリと周期 `entry.period` のエントリが
+  // 同じティックに重なるのは、位相の差が最大公約数で割り切れるとき。
+  // 重なる相手のバス占有率 (ビット数 / 周期) の合計が最小の位相を選ぶ
+  uint32_t find_phase(uint32_t period) const {
+    uint32_t best_phase = 0;
+    float best_cost = 0.0f;
+    for (uint32_t phase = 0; phase < period; ++phase) {
+      float cost = 0.0f;
+      for (const auto &entry : entries_) {
+        if (!entry.is_active) {
+          continue;
+        }
+        uint32_t gcd = std::gcd(period, entry.period);
+        if (phase % gcd == entry.phase % gcd) {
+          cost += static_cast<float>(
+                      get_can_frame_bits(entry.msg.ide, entry.msg.dlc)) /
+                  static_cast<float>(entry.period);
+        }
+      }
+      if (phase == 0 || cost < best_cost) {
+        best_phase = phase;
+        best_cost = cost;
+      }
+    }
+    return best_phase;
+  }
+
+  void on_tick() {
+    uint32_t tick = tick_++;
+    for (auto &entry : entries_) {
+      if (!entry.is_active) {
+        continue;
+      }
+      bool is_due = tick >= entry.phase &&
+                    (tick - entry.phase) % entry.period == 0;
+      if (is_due && entry.is_pending) {
+        ++entry.stats.coalesced_count;
+      }
+      if (!is_due && !entry.is_pending) {
+        continue;
+      }
+      if (entry.producer) {
+        entry.producer(entry.context, entry.msg);
+      }
+      if (!can_.transmit(entry.msg, 0)) {
+        if (!entry.is_pending) {
+          ++entry.stats.late_count;
+        }
+        entry.is_pending = true;
+        continue;
+      }
+      entry.is_pending = false;
+      record_interval(entry);
+    }
+  }
+
+  static void record_interval(Entry &entry) {
+    uint32_t cycle_count = core::get_cycle_count();
+    if (entry.stats.sent_count > 0) {
+      uint32_t interval = cycle_count - entry.last_cycle_count;
+      entry.stats.min_interval = std::min(entry.stats.min_interval, interval);
+      entry.stats.max_interval = std::max(entry.stats.max_interval, interval);
+    }
+    entry.last_cycle_count = cycle_count;
+    ++entry.stats.sent_count;
+  }
+};
+
+} // namespace halx::peripheral
@@ -0,0 +1,162 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+#include "filter_planner.hpp"
+
+namespace halx::peripheral {
+
+/**
+ * ID ごとのコールバック表です。`build()` で標準 ID は 2048 要素の直接参照表、
+ * 拡張 ID は ID 順に並べた表(二分探索)を作り、`dispatch()` は登録数に
+ * よらずほぼ一定の時間でコールバックを呼び出します。
+ *
+ * `build()` から `release()` までの間 (CAN の通信中) は、割り込みから
+ * `dispatch()` が呼ばれるので表を作り直せません。この間の `subscribe()` は
+ * false を返し、`unsubscribe()` はコールバックを無効にするだけで、表からは
+ * 次の `build()` で取り除きます。遅延ディスパッチでは `dispatch()` が
+ * スレッドから呼ばれるので、`unsubscribe()` は同じスレッドか、
+ * `dispatch()` を呼ぶスレッドより優先度の高いスレッドから呼んでください。
+ */
+template <class Message> class CanDispatchTable {
+public:
+  using Callback = void (*)(void *context, const Message &msg);
+
+  bool subscribe(uint32_t id, bool ide, Callback callback, void *context) {
+    if (is_built_ || !callback || id > (ide ? 0x1FFFFFFF : 0x7FF) ||
+        find_entry(id, ide) != entries_.end()) {
+      return false;
+    }
+    entries_.push_back({id, ide, callback, context});
+    return true;
+  }
+
+  bool unsubscribe(uint32_t id, bool ide) {
+    auto it = find_entry(id, ide);
+    if (it == entries_.end() || !it->load_callback()) {
+      return false;
+    }
+    if (is_built_) {
+      std::atomic_ref(it->callback).store(nullptr, std::memory_order_release);
+    } else {
+      entries_.erase(it);
+    }
+    return true;
+  }
+
+  void build() {
+    erase_disabled_entries();
+    std::sort(entries_.begin(), entries_.end(),
+              [](const Entry &lhs, const Entry &rhs) {
+                if (lhs.ide != rhs.ide) {
+                  return !lhs.ide;
+                }
+                return lhs.id < rhs.id;
+              });
+    ext_begin_ = std::find_if(entries_.begin(), entries_.end(),
+                              [](const Entry &entry) { return entry.ide; }) -
+                 entries_.begin();
+    std_indices_.clear();
+    if (ext_begin_ > 0) {
+      std_indices_.resize(STD_ID_SIZE, NO_ENTRY);
+    }
+    for (size_t i = 0; i < ext_begin_; ++i) {
+      std_indices_[entries_[i].id] = i;
+    }
+    is_built_ = true;
+  }
+
+  // `build()` で作った表を破棄し、再び変更できるようにする。`dispatch()`
+  // が呼ばれなくなってから (CAN の停止後に) 呼ぶ
+  void release() {
+    erase_disabled_entries();
+    std_indices_.clear();
+    ext_begin_ = entries_.size();
+    is_built_ = false;
+  }
+
+  bool dispatch(const Message &msg) const {
+    const Entry *entry = find_built_entry(msg.id, msg.ide);
+    if (!entry) {
+      return false;
+    }
+    Callback callback = entry->load_callback();
+    if (!callback) {
+      return false;
+    }
+    callback(entry->context, msg);
+    return true;
+  }
+
+  bool contains(uint32_t id, bool ide) const {
+    const Entry *entry = find_built_entry(id, ide);
+    return entry && entry->load_callback();
+  }
+
+  std::vector<CanId> get_ids() const {
+    std::vector<CanId> ids;
+    ids.reserve(entries_.size());
+    for (const auto &entry : entries_) {
+      ids.push_back({entry.id, entry.ide});
+    }
+    return ids;
+  }
+
+  bool empty() const { return entries_.empty(); }
+
+private:
+  static constexpr size_t STD_ID_SIZE = 0x800;
+  static constexpr uint16_t NO_ENTRY = UINT16_MAX;
+
+  struct Entry {
+    uint32_t id;
+    bool ide;
+    // 通信中の unsubscribe() で割り込みと並行して書き換える
+    mutable Callback callback;
+    void *context;
+
+    Callback load_callback() const {
+      return std::atomic_ref(callback).load(std::memory_order_acquire);
+    }
+  };
+
+  std::vector<Entry> entries_;
+  std::vector<uint16_t> std_indices_;
+  size_t ext_begin_ = 0;
+  bool is_built_ = false;
+
+  void erase_disabled_entries() {
+    std::erase_if(entries_,
+                  [](const Entry &entry) { return !entry.callback; });
+  }
+
+  const Entry *find_built_entry(uint32_t id, bool ide) const {
+    if (!ide) {
+      if (id >= std_indices_.size() || std_indices_[id] == NO_ENTRY) {
+        return nullptr;
+      }
+      return &entries_[std_indices_[id]];
+    }
+    auto first = entries_.begin() + ext_begin_;
+    auto it = std::lower_bound(
+        first, entries_.end(), id,
+        [](const Entry &entry, uint32_t id) { return entry.id < id; });
+    if (it == entries_.end() || it->id != id) {
+      return nullptr;
+    }
+    return &*it;
+  }
+
+  typename std::vector<Entry>::iterator find_entry(uint32_t id, bool ide) {
+    return std::find_if(entries_.begin(), entries_.end(),
+                        [id, ide](const Entry &entry) {
+                          return entry.id == id && entry.ide == ide;
+                        });
+  }
+};
+
+} // namespace halx::peripheral
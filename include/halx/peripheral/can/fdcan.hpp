@@ -1,72 +1,267 @@
 #pragma once
 
 #include <algorithm>
+#include <array>
+#include <atomic>
 #include <cstdint>
-#include <iterator>
 #include <memory>
 #include <optional>
+#include <span>
 #include <vector>
 
 #include "halx/core.hpp"
 
+#include "bus_load.hpp"
+#include "common.hpp"
+#include "dispatch_table.hpp"
+#include "filter_planner.hpp"
+
 namespace halx::peripheral {
 
 template <FDCAN_HandleTypeDef *Handle> class FdCan {
 private:
   struct State {
+    struct PendingMessage {
+      size_t filter_index;
+      CanFdMessage msg;
+    };
+
     std::vector<void (*)(void *context, const CanMessage &msg)> rx_callbacks;
+    std::vector<void (*)(void *context, const CanFdMessage &msg)>
+        rx_fd_callbacks;
     std::vector<void *> rx_callback_contexts;
+    std::array<std::atomic<uint32_t>, 2> rx_overrun_counts{};
+    std::vector<std::atomic<uint32_t>> rx_counts;
+    std::atomic<uint32_t> rx_count{};
+    std::atomic<uint32_t> tx_count{};
+    std::atomic<uint32_t> tx_retry_count{};
+    std::atomic<uint32_t> bus_off_count{};
+    std::atomic<uint32_t> rx_drop_count{};
+    CanBusLoad bus_load;
+    uint32_t bitrate = 0;
+    uint32_t data_bit_ratio_q16 = 0x10000;
+    bool bus_off_recovery = false;
+    CanDispatchTable<CanMessage> dispatch_table;
+    CanDispatchTable<CanFdMessage> fd_dispatch_table;
+    std::vector<size_t> dispatch_filter_indices;
+    CanTxCallbackList tx_callbacks;
+    uint32_t cycles_per_tick_q16 = 0;
+    // FIFO ごとに別の割り込みから積むので、キューも FIFO ごとに分ける
+    std::array<std::unique_ptr<core::RingBuffer<PendingMessage>>, 2>
+        pending_queues;
+    core::Notifier notifier;
+    std::optional<IRQn_Type> dispatch_irqn;
 
     State()
         : rx_callbacks(Handle->Init.StdFiltersNbr + Handle->Init.ExtFiltersNbr,
                        nullptr),
+          rx_fd_callbacks(Handle->Init.StdFiltersNbr +
+                              Handle->Init.ExtFiltersNbr,
+                          nullptr),
           rx_callback_contexts(Handle->Init.StdFiltersNbr +
                                    Handle->Init.ExtFiltersNbr,
-                               nullptr) {
+                               nullptr),
+          rx_counts(Handle->Init.StdFiltersNbr + Handle->Init.ExtFiltersNbr) {
       stm32cubemx_helper::set_context<Handle, State>(this);
       HAL_FDCAN_RegisterRxFifo0Callback(
+          Handle, [](FDCAN_HandleTypeDef *hfdcan, uint32_t rx_fifo0_its) {
+            if ((rx_fifo0_its & FDCAN_IT_RX_FIFO0_MESSAGE_LOST) != 0) {
+              auto state = stm32cubemx_helper::get_context<Handle, State>();
+              state->rx_overrun_counts[0].fetch_add(1,
+                                                    std::memory_order_relaxed);
+            }
+            receive(hfdcan, FDCAN_RX_FIFO0);
+          });
+      HAL_FDCAN_RegisterRxFifo1Callback(
+          Handle, [](FDCAN_HandleTypeDef *hfdcan, uint32_t rx_fifo1_its) {
+            if ((rx_fifo1_its & FDCAN_IT_RX_FIFO1_MESSAGE_LOST) != 0) {
+              auto state = stm32cubemx_helper::get_context<Handle, State>();
+              state->rx_overrun_counts[1].fetch_add(1,
+                                                    std::memory_order_relaxed);
+            }
+            receive(hfdcan, FDCAN_RX_FIFO1);
+          });
+      HAL_FDCAN_RegisterTxEventFifoCallback(
           Handle, [](FDCAN_HandleTypeDef *hfdcan, uint32_t) {
-            FDCAN_RxHeaderTypeDef rx_header;
-            CanMessage msg;
-
             auto state = stm32cubemx_helper::get_context<Handle, State>();
-
-            while (HAL_FDCAN_GetRxMessage(hfdcan, FDCAN_RX_FIFO0, &rx_header,
-                                          msg.data.data()) == HAL_OK) {
-              if (rx_header.IsFilterMatchingFrame == 1 ||
-                  rx_header.FilterIndex >= state->rx_callbacks.size()) {
-                continue;
-              }
-              size_t filter_index = rx_header.FilterIndex;
-              if (rx_header.IdType == FDCAN_EXTENDED_ID) {
-                filter_index += Handle->Init.StdFiltersNbr;
-              }
-              auto rx_callback = state->rx_callbacks[filter_index];
-              if (rx_callback) {
-                update_rx_message(msg, rx_header);
-                rx_callback(state->rx_callback_contexts[filter_index], msg);
-              }
+            FDCAN_TxEventFifoTypeDef tx_event;
+            while (HAL_FDCAN_GetTxEvent(hfdcan, &tx_event) == HAL_OK) {
+              CanTxEvent event{
+                  .id = tx_event.Identifier,
+                  .ide = tx_event.IdType == FDCAN_EXTENDED_ID,
+                  .timestamp = state->get_timestamp(tx_event.TxTimestamp),
+              };
+              state->tx_callbacks.invoke(event);
             }
           });
+      HAL_FDCAN_RegisterErrorStatusCallback(
+          Handle, [](FDCAN_HandleTypeDef *hfdcan, uint32_t error_status_its) {
+            auto state = stm32cubemx_helper::get_context<Handle, State>();
+            if ((error_status_its & FDCAN_IT_BUS_OFF) == 0) {
+              return;
+            }
+            state->bus_off_count.fetch_add(1, std::memory_order_relaxed);
+            // バスオフで INIT が立つので、クリアすると 128 回の 11 ビット
+            // リセッシブを待ってから自動で復帰する
+            if (state->bus_off_recovery) {
+              hfdcan->Instance->CCCR =
+                  hfdcan->Instance->CCCR & ~FDCAN_CCCR_INIT;
+            }
+          });
+      core::enable_cycle_counter();
     }
 
     ~State() {
       HAL_FDCAN_UnRegisterRxFifo0Callback(Handle);
+      HAL_FDCAN_UnRegisterRxFifo1Callback(Handle);
+      HAL_FDCAN_UnRegisterTxEventFifoCallback(Handle);
+      HAL_FDCAN_UnRegisterErrorStatusCallback(Handle);
       stm32cubemx_helper::set_context<Handle, State>(nullptr);
     }
+
+    static inline void receive(FDCAN_HandleTypeDef *hfdcan, uint32_t fifo) {
+      FDCAN_RxHeaderTypeDef rx_header;
+      CanFdMessage msg;
+      bool is_pending = false;
+
+      auto state = stm32cubemx_helper::get_context<Handle, State>();
+
+      while (HAL_FDCAN_GetRxMessage(hfdcan, fifo, &rx_header,
+                                    msg.data.data()) == HAL_OK) {
+        state->rx_count.fetch_add(1, std::memory_order_relaxed);
+        state->bus_load.add_frame(state->get_frame_bits(rx_header),
+                                  core::get_tick());
+        if (rx_header.IsFilterMatchingFrame == 1 ||
+            rx_header.FilterIndex >= state->rx_callbacks.size()) {
+          continue;
+        }
+        size_t filter_index = rx_header.FilterIndex;
+        if (rx_header.IdType == FDCAN_EXTENDED_ID) {
+          filter_index += Handle->Init.StdFiltersNbr;
+        }
+        update_rx_message(msg, rx_header);
+        msg.timestamp = state->get_timestamp(rx_header.RxTimestamp);
+        state->rx_counts[filter_index].fetch_add(1, std::memory_order_relaxed);
+        auto &pending_queue = state->pending_queues[fifo == FDCAN_RX_FIFO1];
+        if (pending_queue) {
+          if (pending_queue->push({filter_index, msg})) {
+            is_pending = true;
+          } else {
+            state->rx_drop_count.fetch_add(1, std::memory_order_relaxed);
+          }
+        } else {
+          state->dispatch(filter_index, msg);
+        }
+      }
+      if (is_pending) {
+        state->notifier.set(0x1);
+        if (state->dispatch_irqn) {
+          HAL_NVIC_SetPendingIRQ(*state->dispatch_irqn);
+        }
+      }
+    }
+
+    // タイムスタンプカウンタ(ビットタイム単位)の経過分だけ現在時刻から戻す
+    uint64_t get_timestamp(uint32_t hardware_timestamp) const {
+      uint64_t timestamp = core::get_cycle_count64();
+      if (cycles_per_tick_q16 != 0) {
+        uint16_t age = HAL_FDCAN_GetTimestampCounter(Handle) -
+                       static_cast<uint16_t>(hardware_timestamp);
+        timestamp -= (static_cast<uint64_t>(age) * cycles_per_tick_q16) >> 16;
+      }
+      return timestamp;
+    }
+
+    template <class Header>
+    uint32_t get_frame_bits(const Header &header) const {
+      bool ide = header.IdType == FDCAN_EXTENDED_ID;
+      uint8_t size =
+          CAN_DLC_TO_SIZE[(header.DataLength / FDCAN_DLC_BYTES_1) & 0xF];
+      if (header.FDFormat != FDCAN_FD_CAN) {
+        return get_can_frame_bits(ide, size);
+      }
+      return get_can_fd_frame_bits(ide, size,
+                                   header.BitRateSwitch == FDCAN_BRS_ON
+                                       ? data_bit_ratio_q16
+                                       : 0x10000);
+    }
+
+    void dispatch(size_t filter_index, const CanFdMessage &msg) {
+      if (auto rx_fd_callback = rx_fd_callbacks[filter_index]) {
+        rx_fd_callback(rx_callback_contexts[filter_index], msg);
+      } else if (auto rx_callback = rx_callbacks[filter_index]) {
+        if (auto classic_msg = to_can_message(msg)) {
+          rx_callback(rx_callback_contexts[filter_index], *classic_msg);
+        }
+      }
+    }
+
+    void dispatch(const CanFdMessage &msg) {
+      if (fd_dispatch_table.dispatch(msg)) {
+        return;
+      }
+      if (auto classic_msg = to_can_message(msg)) {
+        dispatch_table.dispatch(*classic_msg);
+      }
+    }
+
+    static inline std::optional<CanMessage>
+    to_can_message(const CanFdMessage &msg) {
+      if (msg.dlc > 8) {
+        return std::nullopt;
+      }
+      CanMessage classic_msg{
+          .id = msg.id,
+          .ide = msg.ide,
+          .dlc = msg.dlc,
+          .data = {},
+          .timestamp = msg.timestamp,
+      };
+      std::copy_n(msg.data.begin(), msg.dlc, classic_msg.data.begin());
+      return classic_msg;
+    }
   };
 
 public:
   FdCan() : state_{std::make_unique<State>()} {}
 
   bool start() {
+    if (Handle->Init.FrameFormat == FDCAN_FRAME_FD_BRS) {
+      if (HAL_FDCAN_ConfigTxDelayCompensation(
+              Handle, Handle->Init.DataPrescaler * Handle->Init.DataTimeSeg1,
+              0) != HAL_OK) {
+        return false;
+      }
+      if (HAL_FDCAN_EnableTxDelayCompensation(Handle) != HAL_OK) {
+        return false;
+      }
+    }
     if (HAL_FDCAN_ConfigGlobalFilter(Handle, FDCAN_REJECT, FDCAN_REJECT,
                                      FDCAN_REJECT_REMOTE,
                                      FDCAN_REJECT_REMOTE) != HAL_OK) {
       return false;
     }
-    if (HAL_FDCAN_ActivateNotification(Handle, FDCAN_IT_RX_FIFO0_NEW_MESSAGE,
-                                       0) != HAL_OK) {
+#ifdef FDCAN_IT_GROUP_RX_FIFO1
+    if (HAL_FDCAN_ConfigInterruptLines(Handle, FDCAN_IT_GROUP_RX_FIFO1,
+                                       FDCAN_INTERRUPT_LINE1) != HAL_OK) {
+      return false;
+    }
+#else
+    if (HAL_FDCAN_ConfigInterruptLines(Handle,
+                                       FDCAN_IT_RX_FIFO1_NEW_MESSAGE |
+                                           FDCAN_IT_RX_FIFO1_MESSAGE_LOST,
+                                       FDCAN_INTERRUPT_LINE1) != HAL_OK) {
+      return false;
+    }
+#endif
+    if (!enable_timestamp_counter()) {
+      return false;
+    }
+    if (!attach_dispatch_filters()) {
+      return false;
+    }
+    if (HAL_FDCAN_ActivateNotification(Handle, NOTIFICATIONS, 0) !=
+        HAL_OK) {
       return false;
     }
     return HAL_FDCAN_Start(Handle) == HAL_OK;
@@ -76,21 +271,30 @@ public:
     if (HAL_FDCAN_Stop(Handle) != HAL_OK) {
       return false;
     }
-    return HAL_FDCAN_DeactivateNotification(
-               Handle, FDCAN_IT_RX_FIFO0_NEW_MESSAGE) == HAL_OK;
+    if (HAL_FDCAN_DeactivateNotification(Handle, NOTIFICATIONS) !=
+        HAL_OK) {
+      return false;
+    }
+    detach_dispatch_filters();
+    return true;
   }
 
   bool transmit(const CanMessage &msg, uint32_t timeout) {
     FDCAN_TxHeaderTypeDef tx_header = create_tx_header(msg);
-    core::Timeout is_timeout{timeout};
-    while (HAL_FDCAN_AddMessageToTxFifoQ(Handle, &tx_header, msg.data.data()) !=
-           HAL_OK) {
-      if (is_timeout) {
-        return false;
-      }
-      core::yield();
-    }
-    return true;
+    return add_tx_message(tx_header, msg.data.data(), timeout);
+  }
+
+  bool transmit(const CanFdMessage &msg, uint32_t timeout) {
+    FDCAN_TxHeaderTypeDef tx_header = create_tx_header(msg);
+    return add_tx_message(tx_header, msg.data.data(), timeout);
+  }
+
+  size_t transmit_burst(std::span<const CanMessage> msgs, uint32_t timeout) {
+    return add_tx_messages(msgs, timeout);
+  }
+
+  size_t transmit_burst(std::span<const CanFdMessage> msgs, uint32_t timeout) {
+    return add_tx_messages(msgs, timeout);
   }
 
   std::optional<size_t>
@@ -109,51 +313,478 @@ public:
     return filter_index;
   }
 
+  std::optional<size_t>
+  attach_rx_filter(const CanFilter &filter,
+                   void (*callback)(void *context, const CanFdMessage &msg),
+                   void *context) {
+    auto filter_index = find_rx_filter_index(filter);
+    if (!filter_index) {
+      return std::nullopt;
+    }
+    if (!enable_rx_filter(filter, *filter_index)) {
+      return std::nullopt;
+    }
+    state_->rx_fd_callbacks[*filter_index] = callback;
+    state_->rx_callback_contexts[*filter_index] = context;
+    return filter_index;
+  }
+
+  std::optional<std::vector<size_t>> attach_rx_filter_plan(
+      const FdCanFilterPlan &plan, uint32_t fifo,
+      void (*callback)(void *context, const CanMessage &msg), void *context) {
+    if (!callback) {
+      return std::nullopt;
+    }
+    auto filter_indices = enable_rx_filter_plan(plan, fifo);
+    if (filter_indices) {
+      for (size_t filter_index : *filter_indices) {
+        state_->rx_callbacks[filter_index] = callback;
+        state_->rx_callback_contexts[filter_index] = context;
+      }
+    }
+    return filter_indices;
+  }
+
+  std::optional<std::vector<size_t>> attach_rx_filter_plan(
+      const FdCanFilterPlan &plan, uint32_t fifo,
+      void (*callback)(void *context, const CanFdMessage &msg),
+      void *context) {
+    if (!callback) {
+      return std::nullopt;
+    }
+    auto filter_indices = enable_rx_filter_plan(plan, fifo);
+    if (filter_indices) {
+      for (size_t filter_index : *filter_indices) {
+        state_->rx_fd_callbacks[filter_index] = callback;
+        state_->rx_callback_contexts[filter_index] = context;
+      }
+    }
+    return filter_indices;
+  }
+
   bool detach_rx_filter(size_t filter_index) {
     if (!disable_rx_filter(filter_index)) {
       return false;
     }
     state_->rx_callbacks[filter_index] = nullptr;
+    state_->rx_fd_callbacks[filter_index] = nullptr;
     return true;
   }
 
+  bool subscribe(uint32_t id, bool ide,
+                 void (*callback)(void *context, const CanMessage &msg),
+                 void *context) {
+    return state_->dispatch_table.subscribe(id, ide, callback, context);
+  }
+
+  bool subscribe(uint32_t id, bool ide,
+                 void (*callback)(void *context, const CanFdMessage &msg),
+                 void *context) {
+    return state_->fd_dispatch_table.subscribe(id, ide, callback, context);
+  }
+
+  bool unsubscribe(uint32_t id, bool ide) {
+    bool unsubscribed = state_->dispatch_table.unsubscribe(id, ide);
+    unsubscribed |= state_->fd_dispatch_table.unsubscribe(id, ide);
+    return unsubscribed;
+  }
+
+  // クラシック CAN の設定 (FDCAN_FRAME_CLASSIC) では CAN FD を送信できない
+  bool supports_fd() const {
+    return Handle->Init.FrameFormat != FDCAN_FRAME_CLASSIC;
+  }
+
+  size_t get_free_rx_filter_count(bool ide) const {
+    size_t first = ide ? Handle->Init.StdFiltersNbr : 0;
+    size_t last =
+        ide ? state_->rx_callbacks.size() : Handle->Init.StdFiltersNbr;
+    size_t count = 0;
+    for (size_t filter_index = first; filter_index < last; ++filter_index) {
+      if (!state_->rx_callbacks[filter_index] &&
+          !state_->rx_fd_callbacks[filter_index]) {
+        ++count;
+      }
+    }
+    return count;
+  }
+
+  std::optional<size_t>
+  attach_tx_callback(void (*callback)(void *context, const CanTxEvent &event),
+                     void *context) {
+    uint32_t primask = __get_PRIMASK();
+    __disable_irq();
+    auto index = state_->tx_callbacks.attach(callback, context);
+    __set_PRIMASK(primask);
+    if (!index) {
+      return std::nullopt;
+    }
+    if (HAL_FDCAN_ActivateNotification(
+            Handle, FDCAN_IT_TX_EVT_FIFO_NEW_DATA, 0) != HAL_OK) {
+      detach_tx_callback(*index);
+      return std::nullopt;
+    }
+    return index;
+  }
+
+  bool detach_tx_callback(size_t index) {
+    uint32_t primask = __get_PRIMASK();
+    __disable_irq();
+    bool detached = state_->tx_callbacks.detach(index);
+    bool is_empty = state_->tx_callbacks.empty();
+    __set_PRIMASK(primask);
+    if (detached && is_empty) {
+      // 送信イベントは、コールバックがなくなったら止める
+      HAL_FDCAN_DeactivateNotification(Handle,
+                                       FDCAN_IT_TX_EVT_FIFO_NEW_DATA);
+    }
+    return detached;
+  }
+
+  // 範囲外の FIFO やフィルター番号には 0 を返す
+  uint32_t get_rx_overrun_count(uint32_t fifo) const {
+    if (fifo >= state_->rx_overrun_counts.size()) {
+      return 0;
+    }
+    return state_->rx_overrun_counts[fifo].load(std::memory_order_relaxed);
+  }
+
+  uint32_t get_rx_count(size_t filter_index) const {
+    if (filter_index >= state_->rx_counts.size()) {
+      return 0;
+    }
+    return state_->rx_counts[filter_index].load(std::memory_order_relaxed);
+  }
+
+  CanStats get_stats() const {
+    FDCAN_ErrorCountersTypeDef error_counters{};
+    FDCAN_ProtocolStatusTypeDef protocol_status{};
+    HAL_FDCAN_GetErrorCounters(Handle, &error_counters);
+    HAL_FDCAN_GetProtocolStatus(Handle, &protocol_status);
+    CanStats stats{};
+    stats.tx_count = state_->tx_count.load(std::memory_order_relaxed);
+    stats.tx_retry_count =
+        state_->tx_retry_count.load(std::memory_order_relaxed);
+    stats.rx_count = state_->rx_count.load(std::memory_order_relaxed);
+    stats.rx_overrun_counts = {get_rx_overrun_count(0),
+                               get_rx_overrun_count(1)};
+    stats.tec = error_counters.TxErrorCnt;
+    stats.rec = error_counters.RxErrorCnt;
+    stats.last_error_code = protocol_status.LastErrorCode;
+    stats.error_passive = protocol_status.ErrorPassive != 0;
+    stats.bus_off = protocol_status.BusOff != 0;
+    stats.bus_off_count = state_->bus_off_count.load(std::memory_order_relaxed);
+    stats.rx_drop_count = state_->rx_drop_count.load(std::memory_order_relaxed);
+    stats.bus_load =
+        state_->bus_load.get_load(core::get_tick(), state_->bitrate);
+    return stats;
+  }
+
+  // 受信コールバックを割り込みから dispatch_pending() に移す。start() 前に呼ぶ
+  bool enable_deferred_dispatch(size_t capacity) {
+    for (auto &pending_queue : state_->pending_queues) {
+      pending_queue =
+          std::make_unique<core::RingBuffer<typename State::PendingMessage>>(
+              capacity);
+    }
+    return true;
+  }
+
+  // RTOS がない場合に、受信時に保留にする割り込みを指定する。
+  // 空いている割り込みを低い優先度で有効にし、そのハンドラから
+  // dispatch_pending(0) を呼ぶ
+  bool enable_deferred_dispatch(size_t capacity, IRQn_Type irqn) {
+    state_->dispatch_irqn = irqn;
+    return enable_deferred_dispatch(capacity);
+  }
+
+  size_t dispatch_pending(uint32_t timeout) {
+    auto &pending_queues = state_->pending_queues;
+    if (!pending_queues[0]) {
+      return 0;
+    }
+    state_->notifier.reset();
+    if (pending_queues[0]->size() == 0 && pending_queues[1]->size() == 0) {
+      state_->notifier.wait(0x1, timeout);
+    }
+    size_t count = 0;
+    for (auto &pending_queue : pending_queues) {
+      while (auto pending = pending_queue->pop()) {
+        state_->dispatch(pending->filter_index, pending->msg);
+        ++count;
+      }
+    }
+    return count;
+  }
+
+  // true にすると、バスオフになったときに自動で復帰する
+  void set_bus_off_recovery(bool enable) { state_->bus_off_recovery = enable; }
+
 private:
+  static constexpr uint32_t NOTIFICATIONS =
+      FDCAN_IT_RX_FIFO0_NEW_MESSAGE | FDCAN_IT_RX_FIFO0_MESSAGE_LOST |
+      FDCAN_IT_RX_FIFO1_NEW_MESSAGE | FDCAN_IT_RX_FIFO1_MESSAGE_LOST |
+      FDCAN_IT_BUS_OFF;
+
+  static constexpr std::array<uint32_t, 16> DATA_LENGTHS{
+      FDCAN_DLC_BYTES_0,  FDCAN_DLC_BYTES_1,  FDCAN_DLC_BYTES_2,
+      FDCAN_DLC_BYTES_3,  FDCAN_DLC_BYTES_4,  FDCAN_DLC_BYTES_5,
+      FDCAN_DLC_BYTES_6,  FDCAN_DLC_BYTES_7,  FDCAN_DLC_BYTES_8,
+      FDCAN_DLC_BYTES_12, FDCAN_DLC_BYTES_16, FDCAN_DLC_BYTES_20,
+      FDCAN_DLC_BYTES_24, FDCAN_DLC_BYTES_32, FDCAN_DLC_BYTES_48,
+      FDCAN_DLC_BYTES_64};
+
   std::unique_ptr<State> state_;
 
+  bool enable_timestamp_counter() {
+    if (HAL_FDCAN_ConfigTimestampCounter(Handle, FDCAN_TIMESTAMP_PRESC_1) !=
+        HAL_OK) {
+      return false;
+    }
+    if (HAL_FDCAN_EnableTimestampCounter(Handle, FDCAN_TIMESTAMP_INTERNAL) !=
+        HAL_OK) {
+      return false;
+    }
+    update_bit_timing();
+    return true;
+  }
+
+  // ビットレート、1ビットタイムあたりの CPU サイクル数 (16.16 固定小数点)、
+  // データ / ノミナルのビットタイム比を求める。カーネルクロックが取得できな
+  // ければタイムスタンプは割り込み時の時刻を使い、バス負荷は 0 になる
+  void update_bit_timing() {
+    const auto &init = Handle->Init;
+    uint64_t kernel_clock = get_kernel_clock(init);
+    uint64_t nominal_bit_clocks =
+        init.NominalPrescaler *
+        (1 + init.NominalTimeSeg1 + init.NominalTimeSeg2);
+    uint64_t data_bit_clocks =
+        init.DataPrescaler * (1 + init.DataTimeSeg1 + init.DataTimeSeg2);
+    state_->bitrate = kernel_clock / nominal_bit_clocks;
+    state_->data_bit_ratio_q16 = (data_bit_clocks << 16) / nominal_bit_clocks;
+    state_->cycles_per_tick_q16 = 0;
+    if (kernel_clock != 0) {
+      state_->cycles_per_tick_q16 =
+          ((static_cast<uint64_t>(SystemCoreClock) * nominal_bit_clocks)
+           << 16) /
+          kernel_clock;
+    }
+  }
+
+  template <class Init>
+  static inline uint32_t get_kernel_clock(const Init &init) {
+#ifdef RCC_PERIPHCLK_FDCAN
+    uint32_t kernel_clock = HAL_RCCEx_GetPeriphCLKFreq(RCC_PERIPHCLK_FDCAN);
+    // G4 は Init.ClockDivider で分周される (DIV1 = 0, DIVn = n / 2)
+    if constexpr (requires { init.ClockDivider; }) {
+      if (init.ClockDivider != 0) {
+        kernel_clock /= init.ClockDivider * 2;
+      }
+    }
+    return kernel_clock;
+#else
+    (void)init;
+    return 0;
+#endif
+  }
+
+  static inline void count_tx_message(const FDCAN_TxHeaderTypeDef &tx_header) {
+    auto state = stm32cubemx_helper::get_context<Handle, State>();
+    state->tx_count.fetch_add(1, std::memory_order_relaxed);
+    state->bus_load.add_frame(state->get_frame_bits(tx_header),
+                              core::get_tick());
+  }
+
+  static inline void count_tx_retry() {
+    auto state = stm32cubemx_helper::get_context<Handle, State>();
+    state->tx_retry_count.fetch_add(1, std::memory_order_relaxed);
+  }
+
+  // 周期送信や送信完了コールバックの割り込みからも送信するので、HAL が
+  // TXFQS.PI の位置を読んでから書き込むまでを割り込み禁止にする
+  static inline bool
+  try_add_tx_message(const FDCAN_TxHeaderTypeDef &tx_header,
+                     const uint8_t *data) {
+    uint32_t primask = __get_PRIMASK();
+    __disable_irq();
+    HAL_StatusTypeDef status =
+        HAL_FDCAN_AddMessageToTxFifoQ(Handle, &tx_header, data);
+    __set_PRIMASK(primask);
+    return status == HAL_OK;
+  }
+
+  static inline bool add_tx_message(const FDCAN_TxHeaderTypeDef &tx_header,
+                                    const uint8_t *data, uint32_t timeout) {
+    core::Timeout is_timeout{timeout};
+    while (!try_add_tx_message(tx_header, data)) {
+      if (is_timeout) {
+        return false;
+      }
+      count_tx_retry();
+      core::yield();
+    }
+    count_tx_message(tx_header);
+    return true;
+  }
+
+  template <class Message>
+  static inline size_t add_tx_messages(std::span<const Message> msgs,
+                                       uint32_t timeout) {
+    core::Timeout is_timeout{timeout};
+    size_t count = 0;
+    while (count < msgs.size()) {
+      while (count < msgs.size() && HAL_FDCAN_GetTxFifoFreeLevel(Handle) > 0) {
+        FDCAN_TxHeaderTypeDef tx_header = create_tx_header(msgs[count]);
+        if (!try_add_tx_message(tx_header, msgs[count].data.data())) {
+          break;
+        }
+        count_tx_message(tx_header);
+        ++count;
+      }
+      if (count == msgs.size() || is_timeout) {
+        break;
+      }
+      count_tx_retry();
+      core::yield();
+    }
+    return count;
+  }
+
   std::optional<size_t> find_rx_filter_index(const CanFilter &filter) {
-    if (filter.ide) {
-      auto it =
-          std::find(state_->rx_callbacks.begin() + Handle->Init.StdFiltersNbr,
-                    state_->rx_callbacks.end(), nullptr);
-      if (it == state_->rx_callbacks.end()) {
-        return std::nullopt;
+    auto is_free = [this](size_t filter_index) {
+      return !state_->rx_callbacks[filter_index] &&
+             !state_->rx_fd_callbacks[filter_index];
+    };
+    size_t first = filter.ide ? Handle->Init.StdFiltersNbr : 0;
+    size_t last = filter.ide ? state_->rx_callbacks.size()
+                             : Handle->Init.StdFiltersNbr;
+    for (size_t filter_index = first; filter_index < last; ++filter_index) {
+      if (is_free(filter_index)) {
+        return filter_index;
       }
-      return std::distance(state_->rx_callbacks.begin(), it);
-    } else {
-      auto it = std::find(
-          state_->rx_callbacks.begin(),
-          state_->rx_callbacks.begin() + Handle->Init.StdFiltersNbr, nullptr);
-      if (it == state_->rx_callbacks.begin() + Handle->Init.StdFiltersNbr) {
-        return std::nullopt;
+    }
+    return std::nullopt;
+  }
+
+  // subscribe() された ID をまとめてフィルターに割り当て、受信したフレームを
+  // ID ごとの表で振り分ける。フィルターを通過した余分な ID はここで捨てる
+  bool attach_dispatch_filters() {
+    if (!state_->dispatch_filter_indices.empty()) {
+      return true;
+    }
+    // 通信中は subscribe() できないように、ID がなくても表を確定する
+    state_->dispatch_table.build();
+    state_->fd_dispatch_table.build();
+    if (state_->dispatch_table.empty() && state_->fd_dispatch_table.empty()) {
+      return true;
+    }
+    auto ids = state_->dispatch_table.get_ids();
+    auto fd_ids = state_->fd_dispatch_table.get_ids();
+    ids.insert(ids.end(), fd_ids.begin(), fd_ids.end());
+    auto plan = plan_fdcan_filters(ids, get_free_rx_filter_count(false),
+                                   get_free_rx_filter_count(true));
+    if (!plan) {
+      release_dispatch_tables();
+      return false;
+    }
+    auto filter_indices = attach_rx_filter_plan(
+        *plan, 0,
+        [](void *context, const CanFdMessage &msg) {
+          static_cast<State *>(context)->dispatch(msg);
+        },
+        state_.get());
+    if (!filter_indices) {
+      release_dispatch_tables();
+      return false;
+    }
+    state_->dispatch_filter_indices = std::move(*filter_indices);
+    return true;
+  }
+
+  void detach_dispatch_filters() {
+    for (size_t filter_index : state_->dispatch_filter_indices) {
+      detach_rx_filter(filter_index);
+    }
+    state_->dispatch_filter_indices.clear();
+    release_dispatch_tables();
+  }
+
+  void release_dispatch_tables() {
+    state_->dispatch_table.release();
+    state_->fd_dispatch_table.release();
+  }
+
+  // 割り当て途中で失敗した場合は、それまでに設定したフィルターを無効に戻す
+  std::optional<std::vector<size_t>>
+  enable_rx_filter_plan(const FdCanFilterPlan &plan, uint32_t fifo) {
+    if (get_free_rx_filter_count(false) < plan.std_elements.size() ||
+        get_free_rx_filter_count(true) < plan.ext_elements.size()) {
+      return std::nullopt;
+    }
+    std::vector<size_t> filter_indices;
+    auto enable = [&](const FdCanFilterElement &element, bool ide) {
+      for (size_t filter_index = ide ? Handle->Init.StdFiltersNbr : 0;;
+           ++filter_index) {
+        auto is_used = std::find(filter_indices.begin(), filter_indices.end(),
+                                 filter_index) != filter_indices.end();
+        if (!is_used && !state_->rx_callbacks[filter_index] &&
+            !state_->rx_fd_callbacks[filter_index]) {
+          if (!enable_rx_filter_element(element, ide, fifo, filter_index)) {
+            return false;
+          }
+          filter_indices.push_back(filter_index);
+          return true;
+        }
+      }
+    };
+    bool ok = true;
+    for (const auto &element : plan.std_elements) {
+      ok = ok && enable(element, false);
+    }
+    for (const auto &element : plan.ext_elements) {
+      ok = ok && enable(element, true);
+    }
+    if (!ok) {
+      for (size_t filter_index : filter_indices) {
+        disable_rx_filter(filter_index);
       }
-      return std::distance(state_->rx_callbacks.begin(), it);
+      return std::nullopt;
     }
+    return filter_indices;
   }
 
   static inline bool enable_rx_filter(const CanFilter &filter,
                                       uint32_t filter_index) {
+    return enable_rx_filter_element(
+        {FdCanFilterType::MASK, filter.id, filter.mask}, filter.ide,
+        filter.fifo, filter_index);
+  }
+
+  static inline bool
+  enable_rx_filter_element(const FdCanFilterElement &element, bool ide,
+                           uint32_t fifo, uint32_t filter_index) {
     FDCAN_FilterTypeDef filter_config{};
-    if (filter.ide) {
+    if (ide) {
       filter_config.IdType = FDCAN_EXTENDED_ID;
       filter_config.FilterIndex = filter_index - Handle->Init.StdFiltersNbr;
     } else {
       filter_config.IdType = FDCAN_STANDARD_ID;
       filter_config.FilterIndex = filter_index;
     }
-    filter_config.FilterType = FDCAN_FILTER_MASK;
-    filter_config.FilterConfig = FDCAN_FILTER_TO_RXFIFO0;
-    filter_config.FilterID1 = filter.id;
-    filter_config.FilterID2 = filter.mask;
+    switch (element.type) {
+    case FdCanFilterType::RANGE:
+      filter_config.FilterType = FDCAN_FILTER_RANGE;
+      break;
+    case FdCanFilterType::DUAL:
+      filter_config.FilterType = FDCAN_FILTER_DUAL;
+      break;
+    case FdCanFilterType::MASK:
+      filter_config.FilterType = FDCAN_FILTER_MASK;
+      break;
+    }
+    filter_config.FilterConfig =
+        fifo == 1 ? FDCAN_FILTER_TO_RXFIFO1 : FDCAN_FILTER_TO_RXFIFO0;
+    filter_config.FilterID1 = element.id1;
+    filter_config.FilterID2 = element.id2;
 
     return HAL_FDCAN_ConfigFilter(Handle, &filter_config) == HAL_OK;
   }
@@ -181,44 +812,42 @@ private:
       tx_header.IdType = FDCAN_STANDARD_ID;
     }
     tx_header.TxFrameType = FDCAN_DATA_FRAME;
-    switch (msg.dlc) {
-    case 0:
-      tx_header.DataLength = FDCAN_DLC_BYTES_0;
-      break;
-    case 1:
-      tx_header.DataLength = FDCAN_DLC_BYTES_1;
-      break;
-    case 2:
-      tx_header.DataLength = FDCAN_DLC_BYTES_2;
-      break;
-    case 3:
-      tx_header.DataLength = FDCAN_DLC_BYTES_3;
-      break;
-    case 4:
-      tx_header.DataLength = FDCAN_DLC_BYTES_4;
-      break;
-    case 5:
-      tx_header.DataLength = FDCAN_DLC_BYTES_5;
-      break;
-    case 6:
-      tx_header.DataLength = FDCAN_DLC_BYTES_6;
-      break;
-    case 7:
-      tx_header.DataLength = FDCAN_DLC_BYTES_7;
-      break;
-    case 8:
-      tx_header.DataLength = FDCAN_DLC_BYTES_8;
-      break;
-    }
+    tx_header.DataLength = DATA_LENGTHS[std::min<uint8_t>(msg.dlc, 8)];
     tx_header.ErrorStateIndicator = FDCAN_ESI_ACTIVE;
     tx_header.BitRateSwitch = FDCAN_BRS_OFF;
     tx_header.FDFormat = FDCAN_CLASSIC_CAN;
-    tx_header.TxEventFifoControl = FDCAN_NO_TX_EVENTS;
+    tx_header.TxEventFifoControl = get_tx_event_fifo_control();
     tx_header.MessageMarker = 0;
     return tx_header;
   }
 
-  static inline void update_rx_message(CanMessage &msg,
+  static inline FDCAN_TxHeaderTypeDef
+  create_tx_header(const CanFdMessage &msg) {
+    FDCAN_TxHeaderTypeDef tx_header{};
+    tx_header.Identifier = msg.id;
+    if (msg.ide) {
+      tx_header.IdType = FDCAN_EXTENDED_ID;
+    } else {
+      tx_header.IdType = FDCAN_STANDARD_ID;
+    }
+    tx_header.TxFrameType = FDCAN_DATA_FRAME;
+    tx_header.DataLength =
+        DATA_LENGTHS[CAN_SIZE_TO_DLC[std::min<uint8_t>(msg.dlc, 64)]];
+    tx_header.ErrorStateIndicator = FDCAN_ESI_ACTIVE;
+    tx_header.BitRateSwitch = msg.brs ? FDCAN_BRS_ON : FDCAN_BRS_OFF;
+    tx_header.FDFormat = FDCAN_FD_CAN;
+    tx_header.TxEventFifoControl = get_tx_event_fifo_control();
+    tx_header.MessageMarker = 0;
+    return tx_header;
+  }
+
+  static inline uint32_t get_tx_event_fifo_control() {
+    auto state = stm32cubemx_helper::get_context<Handle, State>();
+    return state->tx_callbacks.empty() ? FDCAN_NO_TX_EVENTS
+                                       : FDCAN_STORE_TX_EVENTS;
+  }
+
+  static inline void update_rx_message(CanFdMessage &msg,
                                        const FDCAN_RxHeaderTypeDef &rx_header) {
     msg.id = rx_header.Identifier;
     if (rx_header.IdType == FDCAN_STANDARD_ID) {
@@ -226,35 +855,11 @@ private:
     } else if (rx_header.IdType == FDCAN_EXTENDED_ID) {
       msg.ide = true;
     }
-    switch (rx_header.DataLength) {
-    case FDCAN_DLC_BYTES_0:
-      msg.dlc = 0;
-      break;
-    case FDCAN_DLC_BYTES_1:
-      msg.dlc = 1;
-      break;
-    case FDCAN_DLC_BYTES_2:
-      msg.dlc = 2;
-      break;
-    case FDCAN_DLC_BYTES_3:
-      msg.dlc = 3;
-      break;
-    case FDCAN_DLC_BYTES_4:
-      msg.dlc = 4;
-      break;
-    case FDCAN_DLC_BYTES_5:
-      msg.dlc = 5;
-      break;
-    case FDCAN_DLC_BYTES_6:
-      msg.dlc = 6;
-      break;
-    case FDCAN_DLC_BYTES_7:
-      msg.dlc = 7;
-      break;
-    case FDCAN_DLC_BYTES_8:
-      msg.dlc = 8;
-      break;
-    }
+    msg.brs = rx_header.BitRateSwitch == FDCAN_BRS_ON;
+    // HAL のバージョンによって DLC コードがシフトされているため、
+    // FDCAN_DLC_BYTES_1 で割ってコードに戻す
+    msg.dlc =
+        CAN_DLC_TO_SIZE[(rx_header.DataLength / FDCAN_DLC_BYTES_1) & 0xF];
   }
 };
 
@@ -0,0 +1,409 @@
+#pragma once
+
+#include <algorithm>
+#include <bit>
+#include <cstddef>
+#include <cstdint>
+#include <optional>
+#include <span>
+#include <vector>
+
+namespace halx::peripheral {
+
+struct CanId {
+  uint32_t id;
+  bool ide;
+};
+
+/**
+ * bxCAN のフィルターバンク1つ分の設定です。各フィールドは
+ * `CAN_FilterTypeDef` の同名のフィールドにそのまま設定します。
+ */
+struct BxCanFilterBank {
+  uint32_t filter_id_high;
+  uint32_t filter_id_low;
+  uint32_t filter_mask_id_high;
+  uint32_t filter_mask_id_low;
+  bool list_mode;
+  bool scale_32bit;
+
+  size_t filter_count() const {
+    return (list_mode ? 2 : 1) * (scale_32bit ? 1 : 2);
+  }
+};
+
+/**
+ * `extra_ids` はハードウェアフィルターを通過するが、要求されていない ID
+ * の数(の上限)です。0 でなければソフトウェアでのフィルタリングが必要です。
+ */
+struct BxCanFilterPlan {
+  std::vector<BxCanFilterBank> banks;
+  uint64_t extra_ids;
+};
+
+enum class FdCanFilterType : uint8_t {
+  RANGE,
+  DUAL,
+  MASK,
+};
+
+struct FdCanFilterElement {
+  FdCanFilterType type;
+  uint32_t id1;
+  uint32_t id2;
+};
+
+struct FdCanFilterPlan {
+  std::vector<FdCanFilterElement> std_elements;
+  std::vector<FdCanFilterElement> ext_elements;
+  uint64_t extra_ids;
+};
+
+namespace detail {
+
+struct CanMaskGroup {
+  uint32_t id;
+  uint32_t mask;
+};
+
+inline std::vector<uint32_t> sorted_can_ids(std::span<const CanId> ids,
+                                            bool ide) {
+  uint32_t id_mask = ide ? 0x1FFFFFFF : 0x7FF;
+  std::vector<uint32_t> result;
+  for (const auto &id : ids) {
+    if (id.ide == ide) {
+      result.push_back(id.id & id_mask);
+    }
+  }
+  std::sort(result.begin(), result.end());
+  result.erase(std::unique(result.begin(), result.end()), result.end());
+  return result;
+}
+
+inline uint64_t can_mask_coverage(const CanMaskGroup &group, bool ide) {
+  uint32_t id_mask = ide ? 0x1FFFFFFF : 0x7FF;
+  return uint64_t{1} << std::popcount(~group.mask & id_mask);
+}
+
+inline bool can_mask_covers(const CanMaskGroup &outer,
+                            const CanMaskGroup &inner) {
+  return (inner.mask & outer.mask) == outer.mask &&
+         (inner.id & outer.mask) == outer.id;
+}
+
+inline bool is_exact_can_mask_group(const CanMaskGroup &group, bool ide) {
+  return group.mask == (ide ? 0x1FFFFFFFu : 0x7FFu);
+}
+
+// 完全一致とマスクのグループの数から、必要なバンク数を求める
+struct BxCanGroupCounts {
+  size_t std_exact;
+  size_t std_masks;
+  size_t ext_exact;
+  size_t ext_masks;
+
+  size_t bank_count() const {
+    size_t exact = std_exact;
+    // 16bit マスクバンクの空き1枠には完全一致の ID を1つ入れられる
+    if (std_masks % 2 == 1 && exact > 0) {
+      --exact;
+    }
+    return (std_masks + 1) / 2 + (exact + 3) / 4 + ext_masks +
+           (ext_exact + 1) / 2;
+  }
+};
+
+inline BxCanGroupCounts
+count_bxcan_groups(const std::vector<CanMaskGroup> &std_groups,
+                   const std::vector<CanMaskGroup> &ext_groups) {
+  BxCanGroupCounts counts{};
+  for (const auto &group : std_groups) {
+    counts.std_exact += is_exact_can_mask_group(group, false);
+  }
+  for (const auto &group : ext_groups) {
+    counts.ext_exact += is_exact_can_mask_group(group, true);
+  }
+  counts.std_masks = std_groups.size() - counts.std_exact;
+  counts.ext_masks = ext_groups.size() - counts.ext_exact;
+  return counts;
+}
+
+struct CanMaskMerge {
+  size_t i;
+  size_t j;
+  size_t bank_count;
+  int64_t extra_ids;
+
+  // バンク数を先に比べる。追加で通過する ID が 0 でも、完全一致の ID を
+  // マスクにするとバンクが増えることがある
+  bool operator<(const CanMaskMerge &other) const {
+    return bank_count != other.bank_count ? bank_count < other.bank_count
+                                          : extra_ids < other.extra_ids;
+  }
+};
+
+inline CanMaskGroup merged_can_mask_group(const CanMaskGroup &lhs,
+                                          const CanMaskGroup &rhs) {
+  uint32_t mask = lhs.mask & rhs.mask & ~(lhs.id ^ rhs.id);
+  return {lhs.id & mask, mask};
+}
+
+// まとめた後のバンク数が最も少なく、その中で追加で通過する ID が最も
+// 少なくなる2つのグループの組を探す。マージで包含されて消えるグループは
+// バンク数に数えたままにする
+inline std::optional<CanMaskMerge>
+find_can_mask_merge(const std::vector<CanMaskGroup> &groups, bool ide,
+                    const BxCanGroupCounts &counts) {
+  std::optional<CanMaskMerge> best;
+  for (size_t i = 0; i < groups.size(); ++i) {
+    for (size_t j = i + 1; j < groups.size(); ++j) {
+      size_t exact = is_exact_can_mask_group(groups[i], ide) +
+                     is_exact_can_mask_group(groups[j], ide);
+      auto merged = counts;
+      auto &exact_count = ide ? merged.ext_exact : merged.std_exact;
+      auto &mask_count = ide ? merged.ext_masks : merged.std_masks;
+      exact_count -= exact;
+      mask_count = mask_count - (2 - exact) + 1;
+      int64_t extra_ids =
+          can_mask_coverage(merged_can_mask_group(groups[i], groups[j]), ide) -
+          can_mask_coverage(groups[i], ide) - can_mask_coverage(groups[j], ide);
+      CanMaskMerge merge{i, j, merged.bank_count(), extra_ids};
+      if (!best || merge < *best) {
+        best = merge;
+      }
+    }
+  }
+  return best;
+}
+
+// マージ後のグループに包含されるグループは取り除く
+inline void apply_can_mask_merge(std::vector<CanMaskGroup> &groups,
+                                 const CanMaskMerge &merge) {
+  CanMaskGroup merged = merged_can_mask_group(groups[merge.i], groups[merge.j]);
+  std::erase_if(groups, [&merged](const CanMaskGroup &group) {
+    return can_mask_covers(merged, group);
+  });
+  groups.push_back(merged);
+}
+
+struct CanIdRun {
+  uint32_t first;
+  uint32_t last;
+};
+
+inline size_t fdcan_element_count(const std::vector<CanIdRun> &runs) {
+  size_t ranges = 0;
+  size_t singles = 0;
+  for (const auto &run : runs) {
+    if (run.last - run.first >= 2) {
+      ++ranges;
+    } else {
+      singles += run.last - run.first + 1;
+    }
+  }
+  return ranges + (singles + 1) / 2;
+}
+
+inline std::optional<std::vector<FdCanFilterElement>>
+plan_fdcan_elements(const std::vector<uint32_t> &ids, size_t element_count,
+                    uint64_t &extra_ids) {
+  std::vector<CanIdRun> runs;
+  for (uint32_t id : ids) {
+    if (!runs.empty() && runs.back().last + 1 == id) {
+      runs.back().last = id;
+    } else {
+      runs.push_back({id, id});
+    }
+  }
+  while (fdcan_element_count(runs) > element_count) {
+    if (runs.size() < 2) {
+      return std::nullopt;
+    }
+    size_t best = 0;
+    for (size_t i = 1; i + 1 < runs.size(); ++i) {
+      if (runs[i + 1].first - runs[i].last <
+          runs[best + 1].first - runs[best].last) {
+        best = i;
+      }
+    }
+    extra_ids += runs[best + 1].first - runs[best].last - 1;
+    runs[best].last = runs[best + 1].last;
+    runs.erase(runs.begin() + best + 1);
+  }
+
+  std::vector<FdCanFilterElement> elements;
+  // デュアル ID フィルターの相手を待っている ID
+  uint32_t single = 0;
+  bool has_single = false;
+  for (const auto &run : runs) {
+    if (run.last - run.first >= 2) {
+      elements.push_back({FdCanFilterType::RANGE, run.first, run.last});
+      continue;
+    }
+    for (uint32_t id = run.first; id <= run.last; ++id) {
+      if (has_single) {
+        elements.push_back({FdCanFilterType::DUAL, single, id});
+      } else {
+        single = id;
+      }
+      has_single = !has_single;
+    }
+  }
+  if (has_single) {
+    elements.push_back({FdCanFilterType::DUAL, single, single});
+  }
+  return elements;
+}
+
+} // namespace detail
+
+/**
+ * 受信したい ID の集合を bxCAN のフィルターバンクに詰め込みます。
+ *
+ * 標準 ID は 16bit リストモード(1バンク4個)、拡張 ID は 32bit リストモード
+ * (1バンク2個)で完全一致させ、`bank_count` に収まらない場合は余分に通過する
+ * ID が最小になるようにマスクへまとめます。収まらなければ `std::nullopt`
+ * を返します。ハードウェアに依存しないのでホスト上でテストできます。
+ */
+inline std::optional<BxCanFilterPlan>
+plan_bxcan_filters(std::span<const CanId> ids, size_t bank_count) {
+  std::vector<detail::CanMaskGroup> std_groups;
+  std::vector<detail::CanMaskGroup> ext_groups;
+  for (uint32_t id : detail::sorted_can_ids(ids, false)) {
+    std_groups.push_back({id, 0x7FF});
+  }
+  for (uint32_t id : detail::sorted_can_ids(ids, true)) {
+    ext_groups.push_back({id, 0x1FFFFFFF});
+  }
+  size_t id_count = std_groups.size() + ext_groups.size();
+
+  while (true) {
+    auto counts = detail::count_bxcan_groups(std_groups, ext_groups);
+    if (counts.bank_count() <= bank_count) {
+      break;
+    }
+    auto std_merge = detail::find_can_mask_merge(std_groups, false, counts);
+    auto ext_merge = detail::find_can_mask_merge(ext_groups, true, counts);
+    if (std_merge && (!ext_merge || !(*ext_merge < *std_merge))) {
+      detail::apply_can_mask_merge(std_groups, *std_merge);
+    } else if (ext_merge) {
+      detail::apply_can_mask_merge(ext_groups, *ext_merge);
+    } else {
+      return std::nullopt;
+    }
+  }
+
+  BxCanFilterPlan plan{};
+  uint64_t coverage = 0;
+
+  std::vector<uint32_t> std_exact;
+  std::vector<detail::CanMaskGroup> std_masks;
+  for (const auto &group : std_groups) {
+    coverage += detail::can_mask_coverage(group, false);
+    if (group.mask == 0x7FF) {
+      std_exact.push_back(group.id);
+    } else {
+      std_masks.push_back(group);
+    }
+  }
+  if (std_masks.size() % 2 == 1) {
+    if (!std_exact.empty()) {
+      std_masks.push_back({std_exact.back(), 0x7FF});
+      std_exact.pop_back();
+    } else {
+      std_masks.push_back(std_masks.back());
+    }
+  }
+  // 16bit: STDID[10:0] | RTR | IDE | EXID[17:15]
+  for (size_t i = 0; i < std_masks.size(); i += 2) {
+    plan.banks.push_back({
+        .filter_id_high = std_masks[i + 1].id << 5,
+        .filter_id_low = std_masks[i].id << 5,
+        .filter_mask_id_high = (std_masks[i + 1].mask << 5) | 0x18,
+        .filter_mask_id_low = (std_masks[i].mask << 5) | 0x18,
+        .list_mode = false,
+        .scale_32bit = false,
+    });
+  }
+  while (std_exact.size() % 4 != 0) {
+    std_exact.push_back(std_exact.back());
+  }
+  for (size_t i = 0; i < std_exact.size(); i += 4) {
+    plan.banks.push_back({
+        .filter_id_high = std_exact[i + 2] << 5,
+        .filter_id_low = std_exact[i] << 5,
+        .filter_mask_id_high = std_exact[i + 3] << 5,
+        .filter_mask_id_low = std_exact[i + 1] << 5,
+        .list_mode = true,
+        .scale_32bit = false,
+    });
+  }
+
+  // 32bit: EXID[28:0] | IDE | RTR | 0
+  std::vector<uint32_t> ext_exact;
+  for (const auto &group : ext_groups) {
+    coverage += detail::can_mask_coverage(group, true);
+    if (group.mask == 0x1FFFFFFF) {
+      ext_exact.push_back(group.id);
+      continue;
+    }
+    uint32_t id = (group.id << 3) | 0x4;
+    uint32_t mask = (group.mask << 3) | 0x6;
+    plan.banks.push_back({
+        .filter_id_high = id >> 16,
+        .filter_id_low = id & 0xFFFF,
+        .filter_mask_id_high = mask >> 16,
+        .filter_mask_id_low = mask & 0xFFFF,
+        .list_mode = false,
+        .scale_32bit = true,
+    });
+  }
+  if (ext_exact.size() % 2 == 1) {
+    ext_exact.push_back(ext_exact.back());
+  }
+  for (size_t i = 0; i < ext_exact.size(); i += 2) {
+    uint32_t id1 = (ext_exact[i] << 3) | 0x4;
+    uint32_t id2 = (ext_exact[i + 1] << 3) | 0x4;
+    plan.banks.push_back({
+        .filter_id_high = id1 >> 16,
+        .filter_id_low = id1 & 0xFFFF,
+        .filter_mask_id_high = id2 >> 16,
+        .filter_mask_id_low = id2 & 0xFFFF,
+        .list_mode = true,
+        .scale_32bit = true,
+    });
+  }
+
+  plan.extra_ids = coverage - id_count;
+  return plan;
+}
+
+/**
+ * 受信したい ID の集合を FDCAN の標準/拡張フィルターエレメントに詰め込みます。
+ *
+ * 連続した ID はレンジフィルター、それ以外はデュアル ID フィルター(1要素2個)
+ * で完全一致させ、要素数に収まらない場合は隙間の小さい ID 同士をレンジで
+ * まとめます。
+ */
+inline std::optional<FdCanFilterPlan>
+plan_fdcan_filters(std::span<const CanId> ids, size_t std_element_count,
+                   size_t ext_element_count) {
+  FdCanFilterPlan plan{};
+  auto std_elements =
+      detail::plan_fdcan_elements(detail::sorted_can_ids(ids, false),
+                                  std_element_count, plan.extra_ids);
+  if (!std_elements) {
+    return std::nullopt;
+  }
+  auto ext_elements =
+      detail::plan_fdcan_elements(detail::sorted_can_ids(ids, true),
+                                  ext_element_count, plan.extra_ids);
+  if (!ext_elements) {
+    return std::nullopt;
+  }
+  plan.std_elements = std::move(*std_elements);
+  plan.ext_elements = std::move(*ext_elements);
+  return plan;
+}
+
+} // namespace halx::peripheral
@@ -0,0 +1,153 @@
+#pragma once
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <optional>
+#include <vector>
+
+#include "halx/core.hpp"
+
+#include "common.hpp"
+
+namespace halx::peripheral {
+
+/**
+ * ID ごとに1つの送信スロットを持ち、送信待ちの ID に新しいフレームが来たら
+ * 送信キューに積まずにスロットの内容を置き換えます。制御ループの周期が
+ * バスより速くても、キューのメモリは ID 数で抑えられ、バスには常に最新の
+ * 指令値が流れます。
+ *
+ * 送信キューに空きがあれば `transmit()` がそのまま送信し、空きがなければ
+ * 送信完了の割り込みで待っているスロットを順番に送信します。そのため
+ * `CanBase::attach_tx_callback()` を使用します。登録できなかった場合は
+ * `is_attached()` が false になり、`transmit()` は失敗します。
+ *
+ * 指令値以外のフレームは同じ CAN にスレッドから直接 `CanBase::transmit()`
+ * してかまいません。送信完了の割り込みとの送信メールボックスの取り合いは、
+ * bxCAN / FDCAN のドライバが送信キューに積む間だけ割り込みを禁止して
+ * 防ぎます。ここで割り込みを禁止するのはスロットを守るためです。
+ *
+ * @code{.cpp}
+ * #include <halx/core.hpp>
+ * #include <halx/peripheral.hpp>
+ *
+ * extern CAN_HandleTypeDef hcan1;
+ *
+ * extern "C" void main_thread(void *) {
+ *   using namespace halx::core;
+ *   using namespace halx::peripheral;
+ *
+ *   Can<&hcan1> can1;
+ *   can1.start();
+ *
+ *   CanTxCoalescer coalescer(can1, 8);
+ *
+ *   while (true) {
+ *     CanMessage msg{.id = 0x200, .ide = false, .dlc = 8, .data = {}};
+ *     // バスが混んでいても 0x200 のフレームは最新の1つだけが待つ
+ *     coalescer.transmit(msg);
+ *     delay(1);
+ *   }
+ * }
+ * @endcode
+ */
+class CanTxCoalescer {
+public:
+  // `capacity` はスロット数(送信する ID の種類の上限)
+  CanTxCoalescer(CanBase &can, size_t capacity) : can_{can} {
+    slots_.reserve(capacity);
+    tx_callback_index_ = can_.attach_tx_callback(
+        [](void *context, const CanTxEvent &) {
+          static_cast<CanTxCoalescer *>(context)->flush_slots();
+        },
+        this);
+  }
+
+  ~CanTxCoalescer() {
+    if (tx_callback_index_) {
+      can_.detach_tx_callback(*tx_callback_index_);
+    }
+  }
+
+  CanTxCoalescer(const CanTxCoalescer &) = delete;
+  CanTxCoalescer &operator=(const CanTxCoalescer &) = delete;
+
+  bool is_attached() const { return tx_callback_index_.has_value(); }
+
+  // 新しい ID でスロットが足りなければ false を返す
+  bool transmit(const CanMessage &msg) {
+    if (!tx_callback_index_) {
+      return false;
+    }
+    uint32_t primask = __get_PRIMASK();
+    __disable_irq();
+    auto it = std::find_if(slots_.begin(), slots_.end(),
+                           [&msg](const Slot &slot) {
+                             return slot.msg.id == msg.id &&
+                                    slot.msg.ide == msg.ide;
+                           });
+    if (it == slots_.end()) {
+      if (slots_.size() == slots_.capacity()) {
+        __set_PRIMASK(primask);
+        return false;
+      }
+      it = slots_.insert(slots_.end(), {msg, false});
+    } else if (it->is_pending) {
+      ++coalesced_count_;
+    }
+    it->msg = msg;
+    it->is_pending = true;
+    flush_slots();
+    __set_PRIMASK(primask);
+    return true;
+  }
+
+  // 送信を待っているスロットを送信する。バスオフからの復帰後などに呼ぶ
+  void flush() {
+    uint32_t primask = __get_PRIMASK();
+    __disable_irq();
+    flush_slots();
+    __set_PRIMASK(primask);
+  }
+
+  size_t get_pending_count() const {
+    return std::count_if(slots_.begin(), slots_.end(),
+                         [](const Slot &slot) { return slot.is_pending; });
+  }
+
+  // 送信前に新しいフレームで置き換えた回数
+  uint32_t get_coalesced_count() const { return coalesced_count_; }
+
+private:
+  struct Slot {
+    CanMessage msg;
+    bool is_pending;
+  };
+
+  CanBase &can_;
+  std::optional<size_t> tx_callback_index_;
+  std::vector<Slot> slots_;
+  size_t next_index_ = 0;
+  uint32_t coalesced_count_ = 0;
+
+  // 割り込み禁止中か送信完了の割り込みから呼ぶ。特定の ID が送信を
+  // 独占しないように、前回送信したスロットの次から順に送信する。
+  // `can_.transmit()` は割り込みから呼べる (`CanBase::transmit()` を参照)
+  void flush_slots() {
+    for (size_t i = 0; i < slots_.size(); ++i) {
+      size_t index = (next_index_ + i) % slots_.size();
+      auto &slot = slots_[index];
+      if (!slot.is_pending) {
+        continue;
+      }
+      if (!can_.transmit(slot.msg, 0)) {
+        return;
+      }
+      slot.is_pending = false;
+      next_index_ = index + 1;
+    }
+  }
+};
+
+} // namespace halx::peripheral
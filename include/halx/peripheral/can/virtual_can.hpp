@@ -0,0 +1,658 @@
+#pragma once
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <optional>
+#include <random>
+#include <span>
+#include <vector>
+
+#include "bus_load.hpp"
+#include "common.hpp"
+#include "dispatch_table.hpp"
+
+namespace halx::peripheral {
+
+class VirtualCan;
+
+/**
+ * 複数の `VirtualCan` をつなぐ、プロセス内の仮想 CAN バスです。HAL に
+ * 依存しないので、ホスト PC でフィルターやディスパッチ、プロトコルの
+ * テスト・ベンチマークに使えます。`<random>` や `<deque>` を使うので
+ * `halx/peripheral/can.hpp` には含まれません。このヘッダーを直接インクルード
+ * してください。
+ *
+ * バスはシングルスレッドで、`step()` を呼ぶたびに1フレーム分進みます。
+ * 送信待ちのフレームから実機と同じ調停(ID の小さい方、ベース ID が同じなら
+ * 標準 ID)で1つを選び、フレームのビット数とビットレートから求めた時間だけ
+ * バスの時刻を進めて、ほかのノードの受信コールバックを呼び出します。
+ * `CanMessage::timestamp` と `CanTxEvent::timestamp` は各ノードの時計
+ * (`VirtualCan::get_time()`、ナノ秒)の時刻です。実機のドライバーと違って
+ * `core::get_cycle_count64()` の時刻ではないので、両者を比べないでください。
+ *
+ * @code{.cpp}
+ * #include <chrono>
+ * #include <cstdio>
+ * #include <halx/peripheral/can/virtual_can.hpp>
+ *
+ * int main() {
+ *   using namespace halx::peripheral;
+ *
+ *   VirtualCanBus bus(1000000);
+ *   VirtualCan node1(bus);
+ *   VirtualCan node2(bus);
+ *
+ *   uint32_t rx_count = 0;
+ *   node2.subscribe(
+ *       0x201, false,
+ *       [](void *context, const CanMessage &) {
+ *         ++*static_cast<uint32_t *>(context);
+ *       },
+ *       &rx_count);
+ *   node1.start();
+ *   node2.start();
+ *
+ *   // 1% のフレームでエラーを発生させる
+ *   bus.set_error_rate(0.01f);
+ *
+ *   CanMessage msg{.id = 0x201, .ide = false, .dlc = 8, .data = {}};
+ *   auto begin = std::chrono::steady_clock::now();
+ *   for (int i = 0; i < 100000; ++i) {
+ *     // 送信キューが満杯なら、空くまでバスを進める
+ *     node1.transmit(msg, 10);
+ *   }
+ *   bus.run();
+ *   std::chrono::duration<double> elapsed =
+ *       std::chrono::steady_clock::now() - begin;
+ *
+ *   printf("rx: %u, bus time: %f s, %f frames/s (host)\n", rx_count,
+ *          bus.get_time() * 1e-9, bus.get_frame_count() / elapsed.count());
+ * }
+ * @endcode
+ */
+class VirtualCanBus {
+public:
+  // `data_bitrate` は BRS 付きの CAN FD フレームのデータビットレート。
+  // 0 ならノミナルビットレートと同じ
+  explicit VirtualCanBus(uint32_t bitrate, uint32_t data_bitrate = 0)
+      : bitrate_{bitrate},
+        data_bit_ratio_q16_{static_cast<uint32_t>(
+            (static_cast<uint64_t>(bitrate) << 16) /
+            (data_bitrate != 0 ? data_bitrate : bitrate))} {}
+
+  VirtualCanBus(const VirtualCanBus &) = delete;
+  VirtualCanBus &operator=(const VirtualCanBus &) = delete;
+
+  // 1フレーム(またはエラーフレーム)分バスを進める。送信待ちのフレームも
+  // バスオフからの復帰待ちのノードもなければ false を返す
+  bool step();
+
+  // バスがアイドルになるか `max_frames` フレーム進むまで step() を繰り返す
+  size_t run(size_t max_frames = SIZE_MAX) {
+    size_t count = 0;
+    while (count < max_frames && step()) {
+      ++count;
+    }
+    return count;
+  }
+
+  // アイドル時間を進める
+  void advance(uint64_t ns) { time_ += ns; }
+
+  uint64_t get_time() const { return time_; }
+  uint32_t get_tick() const { return static_cast<uint32_t>(time_ / 1000000); }
+  uint32_t get_bitrate() const { return bitrate_; }
+  uint64_t get_frame_count() const { return frame_count_; }
+  uint64_t get_error_count() const { return error_count_; }
+
+  // 各フレームが `rate` の確率でエラーになる。乱数は `seed` で再現できる
+  void set_error_rate(float rate, uint32_t seed = 1) {
+    error_rate_ = rate;
+    random_.seed(seed);
+  }
+
+  // 次の `count` フレームを必ずエラーにする
+  void inject_errors(uint32_t count) { injected_error_count_ += count; }
+
+private:
+  friend class VirtualCan;
+
+  // エラーフラグ 6 + エラーデリミタ 8 + フレーム間スペース 3
+  static constexpr uint32_t ERROR_FRAME_BITS = 17;
+  // バスオフからの復帰に必要な 11 ビットの連続したリセッシブの数
+  static constexpr uint32_t BUS_OFF_RECOVERY_BITS = 128 * 11;
+
+  uint32_t bitrate_;
+  uint32_t data_bit_ratio_q16_;
+  uint64_t time_ = 0;
+  uint64_t frame_count_ = 0;
+  uint64_t error_count_ = 0;
+  float error_rate_ = 0.0f;
+  uint32_t injected_error_count_ = 0;
+  std::minstd_rand random_{1};
+  std::vector<VirtualCan *> nodes_;
+
+  uint64_t get_bits_time(uint32_t bits) const {
+    return static_cast<uint64_t>(bits) * 1000000000 / bitrate_;
+  }
+
+  bool is_error() {
+    if (injected_error_count_ > 0) {
+      --injected_error_count_;
+      return true;
+    }
+    return error_rate_ > 0.0f &&
+           std::uniform_real_distribution<float>{}(random_) < error_rate_;
+  }
+};
+
+/**
+ * `VirtualCanBus` につながる `CanBase` の実装です。実機の `Can<Handle>` と
+ * 同じように使えます。
+ *
+ * - 送信キューは `tx_queue_size` 段(bxCAN の送信メールボックスと同じ 3 が
+ *   既定)で、ID の小さいフレームから送信します。キューが満杯のときの
+ *   `transmit` は、`timeout` [ms] のバス時間を上限にバスを進めて空きを待ちます
+ * - 受信フレームはフィルターを登録順に、次に `subscribe` した ID を照合し、
+ *   最初に一致したコールバックを呼び出します
+ * - エラーカウンタ、エラーパッシブ、バスオフは CAN の規則どおりに増減します。
+ *   バスオフからは `set_bus_off_recovery(true)` なら 128 * 11 ビット後に、
+ *   そうでなければ `stop()` / `start()` で復帰します
+ * - 遅延ディスパッチでは、`dispatch_pending` は保留中のフレームがなければ
+ *   `timeout` [ms] のバス時間を上限にバスを進めて受信を待ちます
+ */
+class VirtualCan : public CanBase {
+public:
+  using CanBase::attach_rx_filter;
+  using CanBase::subscribe;
+  using CanBase::transmit;
+  using CanBase::transmit_burst;
+
+  explicit VirtualCan(VirtualCanBus &bus, size_t tx_queue_size = 3)
+      : bus_{bus}, tx_queue_size_{tx_queue_size} {
+    bus_.nodes_.push_back(this);
+  }
+
+  ~VirtualCan() override {
+    std::erase(bus_.nodes_, this);
+  }
+
+  VirtualCan(const VirtualCan &) = delete;
+  VirtualCan &operator=(const VirtualCan &) = delete;
+
+  bool start() override {
+    if (started_) {
+      return false;
+    }
+    dispatch_table_.build();
+    fd_dispatch_table_.build();
+    if (bus_off_) {
+      leave_bus_off();
+    }
+    started_ = true;
+    return true;
+  }
+
+  bool stop() override {
+    if (!started_) {
+      return false;
+    }
+    started_ = false;
+    tx_queue_.clear();
+    dispatch_table_.release();
+    fd_dispatch_table_.release();
+    return true;
+  }
+
+  bool transmit(const CanMessage &msg, uint32_t timeout) override {
+    return transmit_burst({&msg, 1}, timeout) == 1;
+  }
+
+  size_t transmit_burst(std::span<const CanMessage> msgs,
+                        uint32_t timeout) override {
+    return transmit_frames(msgs.size(), timeout, [&](size_t i) {
+      if (msgs[i].dlc > 8) {
+        return false;
+      }
+      Frame frame{.msg = {.id = msgs[i].id,
+                          .ide = msgs[i].ide,
+                          .brs = false,
+                          .dlc = msgs[i].dlc,
+                          .data = {},
+                          .timestamp = 0},
+                  .fd = false};
+      std::copy_n(msgs[i].data.begin(), msgs[i].dlc, frame.msg.data.begin());
+      return push_frame(frame);
+    });
+  }
+
+  bool supports_fd() const override { return true; }
+
+  bool transmit(const CanFdMessage &msg, uint32_t timeout) override {
+    return transmit_burst({&msg, 1}, timeout) == 1;
+  }
+
+  size_t transmit_burst(std::span<const CanFdMessage> msgs,
+                        uint32_t timeout) override {
+    return transmit_frames(msgs.size(), timeout, [&](size_t i) {
+      if (msgs[i].dlc > 64) {
+        return false;
+      }
+      Frame frame{.msg = msgs[i], .fd = true};
+      frame.msg.dlc = CAN_DLC_TO_SIZE[CAN_SIZE_TO_DLC[msgs[i].dlc]];
+      std::fill(frame.msg.data.begin() + msgs[i].dlc, frame.msg.data.end(), 0);
+      return push_frame(frame);
+    });
+  }
+
+  std::optional<size_t>
+  attach_rx_filter(const CanFilter &filter,
+                   void (*callback)(void *context, const CanMessage &msg),
+                   void *context) override {
+    return add_rx_filter({.filter = filter,
+                          .callback = callback,
+                          .fd_callback = nullptr,
+                          .context = context,
+                          .rx_count = 0});
+  }
+
+  std::optional<size_t>
+  attach_rx_filter(const CanFilter &filter,
+                   void (*callback)(void *context, const CanFdMessage &msg),
+                   void *context) override {
+    return add_rx_filter({.filter = filter,
+                          .callback = nullptr,
+                          .fd_callback = callback,
+                          .context = context,
+                          .rx_count = 0});
+  }
+
+  bool detach_rx_filter(size_t filter_index) override {
+    if (filter_index >= rx_filters_.size() || !rx_filters_[filter_index]) {
+      return false;
+    }
+    rx_filters_[filter_index].reset();
+    return true;
+  }
+
+  bool subscribe(uint32_t id, bool ide,
+                 void (*callback)(void *context, const CanMessage &msg),
+                 void *context) override {
+    return dispatch_table_.subscribe(id, ide, callback, context);
+  }
+
+  bool subscribe(uint32_t id, bool ide,
+                 void (*callback)(void *context, const CanFdMessage &msg),
+                 void *context) override {
+    return fd_dispatch_table_.subscribe(id, ide, callback, context);
+  }
+
+  bool unsubscribe(uint32_t id, bool ide) override {
+    bool unsubscribed = dispatch_table_.unsubscribe(id, ide);
+    unsubscribed |= fd_dispatch_table_.unsubscribe(id, ide);
+    return unsubscribed;
+  }
+
+  std::optional<size_t>
+  attach_tx_callback(void (*callback)(void *context, const CanTxEvent &event),
+                     void *context) override {
+    return tx_callbacks_.attach(callback, context);
+  }
+
+  bool detach_tx_callback(size_t index) override {
+    return tx_callbacks_.detach(index);
+  }
+
+  uint32_t get_rx_overrun_count(uint32_t) const override { return 0; }
+
+  uint32_t get_rx_count(size_t filter_index) const override {
+    if (filter_index >= rx_filters_.size() || !rx_filters_[filter_index]) {
+      return 0;
+    }
+    return rx_filters_[filter_index]->rx_count;
+  }
+
+  CanStats get_stats() const override {
+    CanStats stats{};
+    stats.tx_count = tx_count_;
+    stats.tx_retry_count = tx_retry_count_;
+    stats.rx_count = rx_count_;
+    stats.tec = tec_;
+    stats.rec = rec_;
+    stats.last_error_code = last_error_code_;
+    stats.error_passive = tec_ >= 128 || rec_ >= 128;
+    stats.bus_off = bus_off_;
+    stats.bus_off_count = bus_off_count_;
+    stats.rx_drop_count = rx_drop_count_;
+    stats.bus_load = bus_load_.get_load(bus_.get_tick(), bus_.get_bitrate());
+    return stats;
+  }
+
+  void set_bus_off_recovery(bool enable) override {
+    bus_off_recovery_ = enable;
+  }
+
+  // ノードの時計をバスの時刻からずらす。`drift_ppm` は進み具合 [ppm]、
+  // `offset` はバスの時刻 0 のときの時計の値 [ns]
+  void set_clock(int32_t drift_ppm, uint64_t offset) {
+    drift_ppm_ = drift_ppm;
+    clock_offset_ = offset;
+  }
+
+  // ノードの時計の現在時刻 [ns]
+  uint64_t get_time() const {
+    uint64_t time = bus_.get_time();
+    return clock_offset_ + time +
+           static_cast<uint64_t>(static_cast<int64_t>(time) * drift_ppm_ /
+                                 1000000);
+  }
+
+  bool enable_deferred_dispatch(size_t capacity) override {
+    pending_capacity_ = capacity;
+    return true;
+  }
+
+  size_t dispatch_pending(uint32_t timeout) override {
+    if (pending_capacity_ == 0) {
+      return 0;
+    }
+    uint64_t deadline = get_deadline(timeout);
+    while (pending_frames_.empty() && bus_.get_time() < deadline &&
+           bus_.step()) {
+    }
+    size_t count = 0;
+    while (!pending_frames_.empty()) {
+      // コールバック内で受信したフレームは次の呼び出しで処理する
+      Frame frame = pending_frames_.front();
+      pending_frames_.pop_front();
+      dispatch(frame);
+      ++count;
+    }
+    return count;
+  }
+
+private:
+  friend class VirtualCanBus;
+
+  struct Frame {
+    CanFdMessage msg;
+    bool fd;
+  };
+
+  struct RxFilter {
+    CanFilter filter;
+    void (*callback)(void *context, const CanMessage &msg);
+    void (*fd_callback)(void *context, const CanFdMessage &msg);
+    void *context;
+    uint32_t rx_count;
+  };
+
+  VirtualCanBus &bus_;
+  size_t tx_queue_size_;
+  bool started_ = false;
+  std::vector<Frame> tx_queue_;
+  std::vector<std::optional<RxFilter>> rx_filters_;
+  CanDispatchTable<CanMessage> dispatch_table_;
+  CanDispatchTable<CanFdMessage> fd_dispatch_table_;
+  CanTxCallbackList tx_callbacks_;
+  size_t pending_capacity_ = 0;
+  std::deque<Frame> pending_frames_;
+  uint32_t tx_count_ = 0;
+  uint32_t tx_retry_count_ = 0;
+  uint32_t rx_count_ = 0;
+  uint32_t rx_drop_count_ = 0;
+  uint32_t tec_ = 0;
+  uint32_t rec_ = 0;
+  uint32_t last_error_code_ = 0;
+  bool bus_off_ = false;
+  bool bus_off_recovery_ = false;
+  uint64_t bus_off_time_ = 0;
+  uint32_t bus_off_count_ = 0;
+  CanBusLoad bus_load_;
+  int32_t drift_ppm_ = 0;
+  uint64_t clock_offset_ = 0;
+
+  uint64_t get_deadline(uint32_t timeout) const {
+    return bus_.get_time() + static_cast<uint64_t>(timeout) * 1000000;
+  }
+
+  template <class Push>
+  size_t transmit_frames(size_t size, uint32_t timeout, Push push) {
+    if (!started_) {
+      return 0;
+    }
+    uint64_t deadline = get_deadline(timeout);
+    size_t count = 0;
+    while (count < size) {
+      while (count < size && tx_queue_.size() < tx_queue_size_) {
+        if (!push(count)) {
+          return count;
+        }
+        ++count;
+      }
+      if (count == size || bus_.get_time() >= deadline || !bus_.step()) {
+        break;
+      }
+      ++tx_retry_count_;
+    }
+    return count;
+  }
+
+  bool push_frame(const Frame &frame) {
+    if (frame.msg.id > (frame.msg.ide ? 0x1FFFFFFF : 0x7FF)) {
+      return false;
+    }
+    tx_queue_.push_back(frame);
+    ++tx_count_;
+    return true;
+  }
+
+  std::optional<size_t> add_rx_filter(const RxFilter &rx_filter) {
+    auto it = std::find(rx_filters_.begin(), rx_filters_.end(), std::nullopt);
+    if (it == rx_filters_.end()) {
+      rx_filters_.push_back(rx_filter);
+      return rx_filters_.size() - 1;
+    }
+    *it = rx_filter;
+    return it - rx_filters_.begin();
+  }
+
+  // 調停の優先順位。小さいほど優先で、ベース ID、IDE、拡張部の順に比べる
+  static uint64_t get_arbitration_key(const CanFdMessage &msg) {
+    uint32_t base_id = msg.ide ? msg.id >> 18 : msg.id;
+    uint32_t extended_id = msg.ide ? msg.id & 0x3FFFF : 0;
+    return (static_cast<uint64_t>(base_id) << 19) |
+           (static_cast<uint64_t>(msg.ide) << 18) | extended_id;
+  }
+
+  bool is_active() const { return started_ && !bus_off_; }
+
+  std::vector<Frame>::iterator get_next_frame() {
+    return std::min_element(tx_queue_.begin(), tx_queue_.end(),
+                            [](const Frame &lhs, const Frame &rhs) {
+                              return get_arbitration_key(lhs.msg) <
+                                     get_arbitration_key(rhs.msg);
+                            });
+  }
+
+  void on_transmitted(std::vector<Frame>::iterator frame, uint32_t bits) {
+    CanTxEvent event{
+        .id = frame->msg.id,
+        .ide = frame->msg.ide,
+        .timestamp = get_time(),
+    };
+    tx_queue_.erase(frame);
+    tec_ = tec_ > 0 ? tec_ - 1 : 0;
+    bus_load_.add_frame(bits, bus_.get_tick());
+    tx_callbacks_.invoke(event);
+  }
+
+  void on_transmit_error() {
+    last_error_code_ = 1;
+    tec_ += 8;
+    if (tec_ > 255) {
+      bus_off_ = true;
+      bus_off_time_ = bus_.get_time();
+      ++bus_off_count_;
+    }
+  }
+
+  void on_receive_error() {
+    last_error_code_ = 1;
+    rec_ = std::min<uint32_t>(rec_ + 1, 255);
+  }
+
+  void leave_bus_off() {
+    bus_off_ = false;
+    tec_ = 0;
+    rec_ = 0;
+  }
+
+  void on_received(Frame frame, uint32_t bits) {
+    frame.msg.timestamp = get_time();
+    rec_ = rec_ > 127 ? 127 : (rec_ > 0 ? rec_ - 1 : 0);
+    bus_load_.add_frame(bits, bus_.get_tick());
+    if (!accept(frame)) {
+      return;
+    }
+    ++rx_count_;
+    if (pending_capacity_ == 0) {
+      dispatch(frame);
+    } else if (pending_frames_.size() < pending_capacity_) {
+      pending_frames_.push_back(frame);
+    } else {
+      ++rx_drop_count_;
+    }
+  }
+
+  static bool is_match(const CanFilter &filter, const CanFdMessage &msg) {
+    return filter.ide == msg.ide &&
+           ((msg.id ^ filter.id) & filter.mask) == 0;
+  }
+
+  RxFilter *find_rx_filter(const CanFdMessage &msg) {
+    for (auto &rx_filter : rx_filters_) {
+      if (rx_filter && is_match(rx_filter->filter, msg)) {
+        return &*rx_filter;
+      }
+    }
+    return nullptr;
+  }
+
+  bool accept(const Frame &frame) {
+    if (auto *rx_filter = find_rx_filter(frame.msg)) {
+      ++rx_filter->rx_count;
+      return true;
+    }
+    return fd_dispatch_table_.contains(frame.msg.id, frame.msg.ide) ||
+           (frame.msg.dlc <= 8 &&
+            dispatch_table_.contains(frame.msg.id, frame.msg.ide));
+  }
+
+  void dispatch(const Frame &frame) {
+    auto classic_msg = to_can_message(frame.msg);
+    if (auto *rx_filter = find_rx_filter(frame.msg)) {
+      if (rx_filter->fd_callback) {
+        rx_filter->fd_callback(rx_filter->context, frame.msg);
+      } else if (classic_msg) {
+        rx_filter->callback(rx_filter->context, *classic_msg);
+      }
+      return;
+    }
+    if (fd_dispatch_table_.dispatch(frame.msg)) {
+      return;
+    }
+    if (classic_msg) {
+      dispatch_table_.dispatch(*classic_msg);
+    }
+  }
+
+  static std::optional<CanMessage> to_can_message(const CanFdMessage &msg) {
+    if (msg.dlc > 8) {
+      return std::nullopt;
+    }
+    CanMessage classic_msg{
+        .id = msg.id,
+        .ide = msg.ide,
+        .dlc = msg.dlc,
+        .data = {},
+        .timestamp = msg.timestamp,
+    };
+    std::copy_n(msg.data.begin(), msg.dlc, classic_msg.data.begin());
+    return classic_msg;
+  }
+};
+
+inline bool VirtualCanBus::step() {
+  VirtualCan *sender = nullptr;
+  std::vector<VirtualCan::Frame>::iterator frame;
+  for (auto *node : nodes_) {
+    if (!node->is_active() || node->tx_queue_.empty()) {
+      continue;
+    }
+    auto next_frame = node->get_next_frame();
+    if (!sender || VirtualCan::get_arbitration_key(next_frame->msg) <
+                       VirtualCan::get_arbitration_key(frame->msg)) {
+      sender = node;
+      frame = next_frame;
+    }
+  }
+
+  if (!sender) {
+    // 送信するフレームがなければ、バスオフからの復帰を待つ
+    std::optional<uint64_t> recovery_time;
+    for (auto *node : nodes_) {
+      if (node->started_ && node->bus_off_ && node->bus_off_recovery_) {
+        uint64_t time =
+            node->bus_off_time_ + get_bits_time(BUS_OFF_RECOVERY_BITS);
+        recovery_time = std::min(recovery_time.value_or(time), time);
+      }
+    }
+    if (!recovery_time) {
+      return false;
+    }
+    time_ = std::max(time_, *recovery_time);
+  } else {
+    const auto &msg = frame->msg;
+    uint32_t bits =
+        frame->fd ? get_can_fd_frame_bits(msg.ide, msg.dlc,
+                                          msg.brs ? data_bit_ratio_q16_
+                                                  : 0x10000)
+                  : get_can_frame_bits(msg.ide, msg.dlc);
+    if (is_error()) {
+      // 送信側は再送するので、フレームは送信キューに残る
+      time_ += get_bits_time(bits + ERROR_FRAME_BITS);
+      ++error_count_;
+      for (auto *node : nodes_) {
+        if (node == sender) {
+          node->on_transmit_error();
+        } else if (node->is_active()) {
+          node->on_receive_error();
+        }
+      }
+    } else {
+      time_ += get_bits_time(bits);
+      ++frame_count_;
+      VirtualCan::Frame received = *frame;
+      sender->on_transmitted(frame, bits);
+      for (auto *node : nodes_) {
+        if (node != sender && node->is_active()) {
+          node->on_received(received, bits);
+        }
+      }
+    }
+  }
+
+  // バスを流れたビット(またはアイドル時間)でバスオフから復帰する
+  for (auto *node : nodes_) {
+    if (node->bus_off_ && node->bus_off_recovery_ &&
+        time_ >= node->bus_off_time_ + get_bits_time(BUS_OFF_RECOVERY_BITS)) {
+      node->leave_bus_off();
+    }
+  }
+  return true;
+}
+
+} // namespace halx::peripheral
@@ -0,0 +1,183 @@
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <memory>
+
+#include "halx/core.hpp"
+
+namespace halx::peripheral {
+
+#ifdef HAL_TIM_MODULE_ENABLED
+
+/**
+ * エンコーダーモードのタイマーのカウントを、更新割り込み(桁あふれ)で
+ * 64bit に拡張します。CubeMX で TIM の `Combined Channels` を
+ * `Encoder Mode` にし、`NVIC Settings` で更新割り込みを有効にしてください。
+ *
+ * `get_position()` は割り込みを禁止して、まだ処理されていない桁あふれも
+ * 含めて読むので、どこから呼んでも数えこぼしません。ただし
+ * `get_position()` を呼ぶ割り込みの優先度は、TIM の更新割り込み以下に
+ * してください。
+ *
+ * 速度は M/T 法で推定します。`update()` を制御周期ごとに呼ぶと、カウントが
+ * 変化した時刻(サイクルカウンタ)を記録し、`min_window` [us] 以上
+ * 離れた2つの変化の間のカウント数と時間から速度を求めます。高速では
+ * `min_window` の間のカウント数 (M 法)、低速ではカウント1つにかかった
+ * 時間 (T 法) に相当します。カウントが止まると、最後の変化からの経過時間
+ * に応じて 0 に近づきます。
+ *
+ * @code{.cpp}
+ * #include <cstdio>
+ * #include <halx/core.hpp>
+ * #include <halx/peripheral.hpp>
+ *
+ * extern TIM_HandleTypeDef htim3;
+ *
+ * extern "C" void main_thread(void *) {
+ *   using namespace halx::core;
+ *   using namespace halx::peripheral;
+ *
+ *   enable_cycle_counter();
+ *   Encoder<&htim3> encoder;
+ *   encoder.start();
+ *
+ *   while (true) {
+ *     encoder.update();
+ *     printf("%lld %f\r\n", encoder.get_position(), encoder.get_velocity());
+ *     delay(10);
+ *   }
+ * }
+ * @endcode
+ */
+template <TIM_HandleTypeDef *Handle> class Encoder {
+private:
+  struct State {
+    int64_t base = 0;
+    uint64_t period = 0;
+
+    State() {
+      stm32cubemx_helper::set_context<Handle, State>(this);
+      HAL_TIM_RegisterCallback(
+          Handle, HAL_TIM_PERIOD_ELAPSED_CB_ID, [](TIM_HandleTypeDef *) {
+            auto state = stm32cubemx_helper::get_context<Handle, State>();
+            state->base += state->get_wrap(__HAL_TIM_GET_COUNTER(Handle));
+          });
+    }
+
+    ~State() {
+      HAL_TIM_UnRegisterCallback(Handle, HAL_TIM_PERIOD_ELAPSED_CB_ID);
+      stm32cubemx_helper::set_context<Handle, State>(nullptr);
+    }
+
+    // 桁あふれ直後のカウントが下半分ならアップカウントで 0 に戻った、
+    // 上半分ならダウンカウントで ARR に戻ったとみなす
+    int64_t get_wrap(uint32_t count) const {
+      return count < period / 2 ? static_cast<int64_t>(period)
+                                : -static_cast<int64_t>(period);
+    }
+  };
+
+public:
+  explicit Encoder(uint32_t min_window = 1000)
+      : state_{std::make_unique<State>()}, min_window_us_{min_window} {}
+
+  bool start() {
+    // クロックの設定前に構築されてもよいように、ここでサイクルに換算する
+    min_window_ =
+        static_cast<uint64_t>(SystemCoreClock / 1000000) * min_window_us_;
+    state_->period =
+        static_cast<uint64_t>(__HAL_TIM_GET_AUTORELOAD(Handle)) + 1;
+    __HAL_TIM_CLEAR_FLAG(Handle, TIM_FLAG_UPDATE);
+    __HAL_TIM_ENABLE_IT(Handle, TIM_IT_UPDATE);
+    if (HAL_TIM_Encoder_Start(Handle, TIM_CHANNEL_ALL) != HAL_OK) {
+      __HAL_TIM_DISABLE_IT(Handle, TIM_IT_UPDATE);
+      return false;
+    }
+    reset_velocity(get_position());
+    return true;
+  }
+
+  bool stop() {
+    __HAL_TIM_DISABLE_IT(Handle, TIM_IT_UPDATE);
+    return HAL_TIM_Encoder_Stop(Handle, TIM_CHANNEL_ALL) == HAL_OK;
+  }
+
+  // 64bit に拡張したカウント
+  int64_t get_position() const {
+    uint32_t primask = __get_PRIMASK();
+    __disable_irq();
+    int64_t base = state_->base;
+    uint32_t count = __HAL_TIM_GET_COUNTER(Handle);
+    if (__HAL_TIM_GET_FLAG(Handle, TIM_FLAG_UPDATE)) {
+      // 割り込みでまだ処理されていない桁あふれ
+      count = __HAL_TIM_GET_COUNTER(Handle);
+      base += state_->get_wrap(count);
+    }
+    __set_PRIMASK(primask);
+    return base + count;
+  }
+
+  void set_position(int64_t position) {
+    uint32_t primask = __get_PRIMASK();
+    __disable_irq();
+    __HAL_TIM_SET_COUNTER(Handle, 0);
+    __HAL_TIM_CLEAR_FLAG(Handle, TIM_FLAG_UPDATE);
+    state_->base = position;
+    __set_PRIMASK(primask);
+    reset_velocity(position);
+  }
+
+  // 速度の推定を更新する。制御周期ごとに呼ぶ
+  void update() {
+    uint64_t now = core::get_cycle_count64();
+    int64_t position = get_position();
+    if (position == last_position_) {
+      // 最後の変化から経過した時間で、1カウント進む速さを上限にする
+      float limit =
+          static_cast<float>(SystemCoreClock) /
+          static_cast<float>(std::max<uint64_t>(now - last_edge_time_, 1));
+      velocity_ = std::clamp(velocity_, -limit, limit);
+      return;
+    }
+    last_position_ = position;
+    last_edge_time_ = now;
+    uint64_t elapsed = now - reference_time_;
+    if (elapsed < min_window_) {
+      return;
+    }
+    velocity_ = static_cast<float>(position - reference_position_) *
+                static_cast<float>(SystemCoreClock) /
+                static_cast<float>(elapsed);
+    reference_position_ = position;
+    reference_time_ = now;
+  }
+
+  // 推定した速度 [count/s]
+  float get_velocity() const { return velocity_; }
+
+private:
+  std::unique_ptr<State> state_;
+  uint32_t min_window_us_;
+  // `min_window_us_` をサイクルに換算したもの。start() で求める
+  uint64_t min_window_ = 0;
+  // 以下は update() からのみ使う
+  int64_t last_position_ = 0;
+  uint64_t last_edge_time_ = 0;
+  int64_t reference_position_ = 0;
+  uint64_t reference_time_ = 0;
+  float velocity_ = 0.0f;
+
+  void reset_velocity(int64_t position) {
+    uint64_t now = core::get_cycle_count64();
+    last_position_ = position;
+    last_edge_time_ = now;
+    reference_position_ = position;
+    reference_time_ = now;
+    velocity_ = 0.0f;
+  }
+};
+
+#endif
+
+} // namespace halx::peripheral
@@ -1,5 +1,6 @@
 #pragma once
 
+#include <bit>
 #include <cstdint>
 
 #include "halx/core.hpp"
@@ -8,16 +9,65 @@ namespace halx::peripheral {
 
 #ifdef HAL_GPIO_MODULE_ENABLED
 
-class Gpio {
+/**
+ * ポートとピンをテンプレート引数で指定すると、`read()` は IDR の読み出し
+ * 1回、`write()` は BSRR への書き込み1回になります。`Port` は
+ * `GPIOx_BASE`、`Pin` は `GPIO_PIN_x` です。
+ *
+ * ポートとピンを実行時に決める場合はコンストラクタに渡します (`Gpio<>`)。
+ *
+ * @code{.cpp}
+ * #include <halx/core.hpp>
+ * #include <halx/peripheral.hpp>
+ *
+ * extern "C" void main_thread(void *) {
+ *   using namespace halx::core;
+ *   using namespace halx::peripheral;
+ *
+ *   Gpio<GPIOA_BASE, GPIO_PIN_5> led;
+ *   Gpio button(GPIOC, GPIO_PIN_13); // Gpio<>
+ *
+ *   while (true) {
+ *     led.write(button.read());
+ *     delay(10);
+ *   }
+ * }
+ * @endcode
+ */
+template <uintptr_t Port = 0, uint16_t Pin = 0> class Gpio {
+  static_assert(std::has_single_bit(Pin));
+
 public:
-  Gpio(GPIO_TypeDef *port, uint16_t pin) : port_{port}, pin_{pin} {}
+  uint8_t read() const { return (get_port()->IDR & Pin) != 0 ? 1 : 0; }
+
+  void write(uint8_t state) {
+    get_port()->BSRR = state == 1 ? Pin : static_cast<uint32_t>(Pin) << 16;
+  }
 
-  uint8_t read() const {
-    return HAL_GPIO_ReadPin(port_, pin_) == GPIO_PIN_SET ? 1 : 0;
+  void toggle() {
+    uint32_t odr = get_port()->ODR;
+    get_port()->BSRR = ((odr & Pin) << 16) | (~odr & Pin);
   }
 
+private:
+  static GPIO_TypeDef *get_port() {
+    return reinterpret_cast<GPIO_TypeDef *>(Port);
+  }
+};
+
+template <> class Gpio<0, 0> {
+public:
+  Gpio(GPIO_TypeDef *port, uint16_t pin) : port_{port}, pin_{pin} {}
+
+  uint8_t read() const { return (port_->IDR & pin_) != 0 ? 1 : 0; }
+
   void write(uint8_t state) {
-    HAL_GPIO_WritePin(port_, pin_, state == 1 ? GPIO_PIN_SET : GPIO_PIN_RESET);
+    port_->BSRR = state == 1 ? pin_ : static_cast<uint32_t>(pin_) << 16;
+  }
+
+  void toggle() {
+    uint32_t odr = port_->ODR;
+    port_->BSRR = ((odr & pin_) << 16) | (~odr & pin_);
   }
 
 private:
@@ -25,6 +75,54 @@ private:
   uint16_t pin_;
 };
 
+Gpio(GPIO_TypeDef *, uint16_t) -> Gpio<>;
+
+/**
+ * 同じポートの複数のピンをまとめて扱います。`Mask` は `GPIO_PIN_x` の
+ * 論理和です。書き込みは BSRR への書き込み1回なので、複数のピンが同時に
+ * 変わります。読み出しは IDR の読み出し1回で、`Mask` のピンの状態を
+ * ピン番号のビット位置のまま返します。
+ *
+ * @code{.cpp}
+ * // PB0-PB3 の LED
+ * GpioGroup<GPIOB_BASE, GPIO_PIN_0 | GPIO_PIN_1 | GPIO_PIN_2 | GPIO_PIN_3>
+ *     leds;
+ * leds.write(0b0101);      // PB0, PB2 を点灯、PB1, PB3 を消灯
+ * leds.set(GPIO_PIN_1);    // PB1 を点灯
+ * uint16_t state = leds.read();
+ * @endcode
+ */
+template <uintptr_t Port, uint16_t Mask> class GpioGroup {
+  static_assert(Mask != 0);
+
+public:
+  // `Mask` のピンのうち、`values` のビットが 1 のピンをセット、0 のピンを
+  // リセットする
+  void write(uint16_t values) {
+    get_port()->BSRR = (values & Mask) |
+                       (static_cast<uint32_t>(~values & Mask) << 16);
+  }
+
+  void set(uint16_t pins) { get_port()->BSRR = pins & Mask; }
+
+  void reset(uint16_t pins) {
+    get_port()->BSRR = static_cast<uint32_t>(pins & Mask) << 16;
+  }
+
+  void toggle(uint16_t pins) {
+    uint32_t odr = get_port()->ODR;
+    uint32_t toggle_pins = pins & Mask;
+    get_port()->BSRR = ((odr & toggle_pins) << 16) | (~odr & toggle_pins);
+  }
+
+  uint16_t read() const { return get_port()->IDR & Mask; }
+
+private:
+  static GPIO_TypeDef *get_port() {
+    return reinterpret_cast<GPIO_TypeDef *>(Port);
+  }
+};
+
 #endif
 
-} // namespace halx::peripheral
\ No newline at end of file
+} // namespace halx::peripheral
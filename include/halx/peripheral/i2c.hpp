@@ -0,0 +1,496 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <optional>
+
+#include "halx/core.hpp"
+
+namespace halx::peripheral {
+
+#ifdef HAL_I2C_MODULE_ENABLED
+
+/**
+ * I2C のデバイスです。`address` は 7bit のアドレスです。統計は
+ * `I2c::get_stats()` で読み出します。
+ */
+struct I2cDevice {
+  uint16_t address;
+  // 以下はドライバが使う
+  uint32_t transaction_count = 0;
+  uint32_t error_count = 0;
+  uint64_t max_latency = 0;
+  uint64_t latency_sum = 0;
+};
+
+/**
+ * デバイスごとの統計です。遅延はキューに積んでから完了するまでの時間で、
+ * `core::get_cycle_count64()` と同じ CPU サイクル単位です。サイクル
+ * カウンタは `I2c` のコンストラクタで有効にします。
+ */
+struct I2cDeviceStats {
+  uint32_t transaction_count;
+  uint32_t error_count;
+  uint64_t max_latency;
+  uint64_t average_latency;
+};
+
+/**
+ * キューに積む I2C の転送です。`mem_address` を指定すると、そのレジスタ
+ * (`mem_address_size` は `I2C_MEMADD_SIZE_8BIT` / `I2C_MEMADD_SIZE_16BIT`)
+ * から読み書きします。完了するまで呼び出し側で保持してください。
+ *
+ * `callback` は完了時に I2C の割り込みから呼ばれます。開始に失敗したときや
+ * 取り消したときはスレッドから呼ばれます。
+ */
+struct I2cTransaction {
+  I2cDevice *device;
+  bool is_read;
+  uint8_t *data;
+  size_t size;
+  std::optional<uint16_t> mem_address = std::nullopt;
+  uint16_t mem_address_size = I2C_MEMADD_SIZE_8BIT;
+  void (*callback)(void *context, bool success) = nullptr;
+  void *context = nullptr;
+  // 以下はドライバが使う
+  I2cTransaction *next = nullptr;
+  uint64_t submit_cycle = 0;
+  core::Notifier *waiter = nullptr;
+};
+
+/**
+ * I2C の転送をキューに積み、1つずつ実行します。複数のスレッドから呼び出して
+ * もミューテックスなしで順番に実行されます。CubeMX で DMA を設定していれば
+ * DMA、なければ割り込みで転送します。
+ *
+ * 転送は割り込みを禁止せずにスレッドから始めます。I2C v1 の HAL は開始時に
+ * `HAL_GetTick()` でフラグを待つので、割り込み禁止中や割り込みから始めると
+ * バスが固まったときに戻ってきません。完了割り込みは次の転送を待つ
+ * `transfer()` のスレッドを起こすだけです。`submit()` だけで転送する場合は、
+ * `process()` を呼び続けるスレッドを用意してください。
+ *
+ * バスエラーやアービトレーションロスト、タイムアウトで転送を中断した
+ * ときは、次の転送を始める前にスレッドで `HAL_I2C_DeInit()` /
+ * `HAL_I2C_Init()` を呼んで I2C を初期化し直します。
+ *
+ * CubeMX で I2C の `event` と `error` の割り込みを有効にしてください。
+ *
+ * @code{.cpp}
+ * #include <cstdio>
+ * #include <halx/core.hpp>
+ * #include <halx/peripheral.hpp>
+ *
+ * extern I2C_HandleTypeDef hi2c1;
+ *
+ * extern "C" void main_thread(void *) {
+ *   using namespace halx::core;
+ *   using namespace halx::peripheral;
+ *
+ *   I2c<&hi2c1> i2c1;
+ *   I2cDevice magnetometer{.address = 0x1E};
+ *
+ *   while (true) {
+ *     std::array<uint8_t, 6> data;
+ *     if (i2c1.read_register(magnetometer, 0x68, data.data(), data.size(),
+ *                            10)) {
+ *       int16_t x = data[0] | (data[1] << 8);
+ *       printf("%d\r\n", x);
+ *     }
+ *     delay(10);
+ *   }
+ * }
+ * @endcode
+ */
+template <I2C_HandleTypeDef *Handle> class I2c {
+private:
+  struct State {
+    static constexpr uint32_t WAKE_FLAG = 0x1;
+
+    // 割り込み禁止中に更新する
+    I2cTransaction *head = nullptr;
+    I2cTransaction *tail = nullptr;
+    I2cTransaction *current = nullptr;
+    // スレッドが転送を開始中か実行中、または初期化し直している
+    bool is_busy = false;
+    bool is_starting = false;
+    bool needs_recovery = false;
+    // `process()` のスレッド
+    core::Notifier worker;
+
+    State() {
+      // 遅延を測るので、DWT のサイクルカウンタを動かす
+      core::enable_cycle_counter();
+      stm32cubemx_helper::set_context<Handle, State>(this);
+      register_callbacks();
+    }
+
+    ~State() {
+      for (auto id :
+           {HAL_I2C_MASTER_TX_COMPLETE_CB_ID, HAL_I2C_MASTER_RX_COMPLETE_CB_ID,
+            HAL_I2C_MEM_TX_COMPLETE_CB_ID, HAL_I2C_MEM_RX_COMPLETE_CB_ID,
+            HAL_I2C_ERROR_CB_ID}) {
+        HAL_I2C_UnRegisterCallback(Handle, id);
+      }
+      stm32cubemx_helper::set_context<Handle, State>(nullptr);
+    }
+
+    // HAL_I2C_Init() はリセット状態からの初期化でコールバックを既定に戻す
+    // ので、初期化し直した後にも呼ぶ
+    void register_callbacks() {
+      for (auto id :
+           {HAL_I2C_MASTER_TX_COMPLETE_CB_ID, HAL_I2C_MASTER_RX_COMPLETE_CB_ID,
+            HAL_I2C_MEM_TX_COMPLETE_CB_ID, HAL_I2C_MEM_RX_COMPLETE_CB_ID}) {
+        HAL_I2C_RegisterCallback(Handle, id, [](I2C_HandleTypeDef *) {
+          auto state = stm32cubemx_helper::get_context<Handle, State>();
+          state->complete(true);
+        });
+      }
+      HAL_I2C_RegisterCallback(
+          Handle, HAL_I2C_ERROR_CB_ID, [](I2C_HandleTypeDef *hi2c) {
+            auto state = stm32cubemx_helper::get_context<Handle, State>();
+            // NACK (AF) 以外はバスかペリフェラルの異常。DeInit は DMA や
+            // NVIC を止めるので、初期化し直すのは次に始めるスレッドに任せる
+            if (state->current &&
+                (HAL_I2C_GetError(hi2c) &
+                 (HAL_I2C_ERROR_BERR | HAL_I2C_ERROR_ARLO |
+                  HAL_I2C_ERROR_TIMEOUT)) != 0) {
+              state->needs_recovery = true;
+            }
+            state->complete(false);
+          });
+    }
+
+    void recover() {
+      HAL_I2C_DeInit(Handle);
+      HAL_I2C_Init(Handle);
+      register_callbacks();
+    }
+
+    // 割り込みから呼ばれる
+    void complete(bool success) {
+      I2cTransaction *transaction = current;
+      if (!transaction) {
+        return;
+      }
+      current = nullptr;
+      is_busy = false;
+      finish(*transaction, success);
+      wake();
+    }
+
+    // 割り込み禁止中か割り込みから呼ぶ。次の転送はスレッドで始める
+    void wake() {
+      if (!head && !needs_recovery) {
+        return;
+      }
+      if (head && head->waiter) {
+        head->waiter->set(WAKE_FLAG);
+      }
+      worker.set(WAKE_FLAG);
+    }
+
+    void finish(I2cTransaction &transaction, bool success) {
+      auto &device = *transaction.device;
+      uint64_t latency = core::get_cycle_count64() - transaction.submit_cycle;
+      ++device.transaction_count;
+      if (!success) {
+        ++device.error_count;
+      }
+      device.max_latency = std::max(device.max_latency, latency);
+      device.latency_sum += latency;
+      if (transaction.callback) {
+        transaction.callback(transaction.context, success);
+      }
+    }
+
+    // スレッドから呼ぶ。キューから取り出すところだけ割り込みを禁止し、
+    // 初期化し直すのと HAL で転送を始めるのは割り込みを許可したまま行う
+    void start_next() {
+      while (true) {
+        uint32_t primask = __get_PRIMASK();
+        __disable_irq();
+        if (is_busy) {
+          __set_PRIMASK(primask);
+          return;
+        }
+        if (needs_recovery) {
+          needs_recovery = false;
+          is_busy = true;
+          __set_PRIMASK(primask);
+          recover();
+          primask = __get_PRIMASK();
+          __disable_irq();
+          is_busy = false;
+          __set_PRIMASK(primask);
+          continue;
+        }
+        I2cTransaction *transaction = head;
+        if (!transaction) {
+          __set_PRIMASK(primask);
+          return;
+        }
+        head = transaction->next;
+        if (!head) {
+          tail = nullptr;
+        }
+        current = transaction;
+        is_busy = true;
+        is_starting = true;
+        __set_PRIMASK(primask);
+
+        bool started = start(*transaction);
+
+        primask = __get_PRIMASK();
+        __disable_irq();
+        is_starting = false;
+        if (!started) {
+          current = nullptr;
+          is_busy = false;
+          finish(*transaction, false);
+        }
+        __set_PRIMASK(primask);
+        if (started) {
+          return;
+        }
+      }
+    }
+
+    static bool start(I2cTransaction &transaction) {
+      uint16_t address = transaction.device->address << 1;
+      uint16_t size = static_cast<uint16_t>(transaction.size);
+      uint8_t *data = transaction.data;
+      HAL_StatusTypeDef status;
+      if (transaction.is_read) {
+        bool use_dma = Handle->hdmarx != nullptr;
+        if (transaction.mem_address) {
+          status =
+              use_dma ? HAL_I2C_Mem_Read_DMA(Handle, address,
+                                             *transaction.mem_address,
+                                             transaction.mem_address_size,
+                                             data, size)
+                      : HAL_I2C_Mem_Read_IT(Handle, address,
+                                            *transaction.mem_address,
+                                            transaction.mem_address_size,
+                                            data, size);
+        } else {
+          status =
+              use_dma
+                  ? HAL_I2C_Master_Receive_DMA(Handle, address, data, size)
+                  : HAL_I2C_Master_Receive_IT(Handle, address, data, size);
+        }
+      } else {
+        bool use_dma = Handle->hdmatx != nullptr;
+        if (transaction.mem_address) {
+          status =
+              use_dma ? HAL_I2C_Mem_Write_DMA(Handle, address,
+                                              *transaction.mem_address,
+                                              transaction.mem_address_size,
+                                              data, size)
+                      : HAL_I2C_Mem_Write_IT(Handle, address,
+                                             *transaction.mem_address,
+                                             transaction.mem_address_size,
+                                             data, size);
+        } else {
+          status =
+              use_dma
+                  ? HAL_I2C_Master_Transmit_DMA(Handle, address, data, size)
+                  : HAL_I2C_Master_Transmit_IT(Handle, address, data, size);
+        }
+      }
+      return status == HAL_OK;
+    }
+  };
+
+public:
+  I2c() : state_{std::make_unique<State>()} {}
+
+  // 転送をキューに積む。完了は `transaction.callback` で通知される。
+  // 割り込みから積んだ転送は `process()` のスレッドで始まる
+  bool submit(I2cTransaction &transaction) {
+    if (!transaction.device || !transaction.data || transaction.size == 0 ||
+        transaction.size > UINT16_MAX) {
+      return false;
+    }
+    transaction.next = nullptr;
+    transaction.submit_cycle = core::get_cycle_count64();
+    uint32_t primask = __get_PRIMASK();
+    __disable_irq();
+    if (state_->tail) {
+      state_->tail->next = &transaction;
+    } else {
+      state_->head = &transaction;
+    }
+    state_->tail = &transaction;
+    if (__get_IPSR() != 0) {
+      state_->wake();
+    }
+    __set_PRIMASK(primask);
+    if (__get_IPSR() == 0) {
+      state_->start_next();
+    }
+    return true;
+  }
+
+  // `submit()` で積んだ転送を始め、次に始められるようになるまで待つ。
+  // 呼んだスレッドのスレッドフラグを使うので、専用のスレッドで呼び続ける
+  void process(uint32_t timeout) {
+    state_->worker.reset();
+    state_->start_next();
+    state_->worker.wait(State::WAKE_FLAG, timeout);
+  }
+
+  // 転送して完了まで待つ。タイムアウトしたら転送を取り消す
+  bool transfer(I2cTransaction &transaction, uint32_t timeout) {
+    struct Waiter {
+      core::Notifier notifier;
+      // 0: 実行中、1: 成功、2: 失敗
+      std::atomic<uint8_t> result{0};
+    } waiter;
+    waiter.notifier.reset();
+    transaction.callback = [](void *context, bool success) {
+      auto waiter = static_cast<Waiter *>(context);
+      waiter->result = success ? 1 : 2;
+      waiter->notifier.set(State::WAKE_FLAG);
+    };
+    transaction.context = &waiter;
+    transaction.waiter = &waiter.notifier;
+    if (!submit(transaction)) {
+      transaction.waiter = nullptr;
+      return false;
+    }
+    uint32_t start_tick = core::get_tick();
+    while (true) {
+      // 前の転送が完了して起こされたら、このスレッドで次の転送を始める
+      waiter.notifier.reset();
+      state_->start_next();
+      if (waiter.result != 0) {
+        break;
+      }
+      uint32_t remaining = timeout;
+      if (timeout != core::MAX_DELAY) {
+        uint32_t elapsed = core::get_tick() - start_tick;
+        if (elapsed >= timeout) {
+          if (cancel(transaction)) {
+            transaction.waiter = nullptr;
+            return false;
+          }
+          // 取り消す前に完了していた
+          break;
+        }
+        remaining = timeout - elapsed;
+      }
+      waiter.notifier.wait(State::WAKE_FLAG, remaining);
+    }
+    transaction.waiter = nullptr;
+    return waiter.result == 1;
+  }
+
+  bool read(I2cDevice &device, uint8_t *data, size_t size, uint32_t timeout) {
+    I2cTransaction transaction{
+        .device = &device, .is_read = true, .data = data, .size = size};
+    return transfer(transaction, timeout);
+  }
+
+  bool write(I2cDevice &device, const uint8_t *data, size_t size,
+             uint32_t timeout) {
+    I2cTransaction transaction{.device = &device,
+                               .is_read = false,
+                               .data = const_cast<uint8_t *>(data),
+                               .size = size};
+    return transfer(transaction, timeout);
+  }
+
+  bool read_register(I2cDevice &device, uint8_t reg, uint8_t *data,
+                     size_t size, uint32_t timeout) {
+    I2cTransaction transaction{.device = &device,
+                               .is_read = true,
+                               .data = data,
+                               .size = size,
+                               .mem_address = reg};
+    return transfer(transaction, timeout);
+  }
+
+  bool write_register(I2cDevice &device, uint8_t reg, const uint8_t *data,
+                      size_t size, uint32_t timeout) {
+    I2cTransaction transaction{.device = &device,
+                               .is_read = false,
+                               .data = const_cast<uint8_t *>(data),
+                               .size = size,
+                               .mem_address = reg};
+    return transfer(transaction, timeout);
+  }
+
+  I2cDeviceStats get_stats(const I2cDevice &device) const {
+    uint32_t primask = __get_PRIMASK();
+    __disable_irq();
+    I2cDeviceStats stats{
+        .transaction_count = device.transaction_count,
+        .error_count = device.error_count,
+        .max_latency = device.max_latency,
+        .average_latency = device.transaction_count > 0
+                               ? device.latency_sum / device.transaction_count
+                               : 0,
+    };
+    __set_PRIMASK(primask);
+    return stats;
+  }
+
+private:
+  std::unique_ptr<State> state_;
+
+  // キューから取り除くか、実行中なら I2C を初期化し直して中断する。
+  // もう完了していれば false
+  bool cancel(I2cTransaction &transaction) {
+    uint32_t primask = __get_PRIMASK();
+    __disable_irq();
+    // 別のスレッドが HAL で開始している途中なら、戻るまで待つ
+    while (state_->is_starting) {
+      __set_PRIMASK(primask);
+      core::delay(1);
+      primask = __get_PRIMASK();
+      __disable_irq();
+    }
+    I2cTransaction **link = &state_->head;
+    I2cTransaction *previous = nullptr;
+    while (*link && *link != &transaction) {
+      previous = *link;
+      link = &(*link)->next;
+    }
+    if (*link) {
+      *link = transaction.next;
+      if (state_->tail == &transaction) {
+        state_->tail = previous;
+      }
+      transaction.callback = nullptr;
+      state_->finish(transaction, false);
+      __set_PRIMASK(primask);
+      return true;
+    }
+    if (state_->current != &transaction) {
+      __set_PRIMASK(primask);
+      return false;
+    }
+    // `is_busy` のまま初期化し直し、他のスレッドに始めさせない
+    state_->current = nullptr;
+    __set_PRIMASK(primask);
+
+    state_->recover();
+
+    primask = __get_PRIMASK();
+    __disable_irq();
+    transaction.callback = nullptr;
+    state_->finish(transaction, false);
+    state_->needs_recovery = false;
+    state_->is_busy = false;
+    __set_PRIMASK(primask);
+    state_->start_next();
+    return true;
+  }
+};
+
+#endif
+
+} // namespace halx::peripheral
@@ -0,0 +1,188 @@
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <optional>
+#include <span>
+
+#include "halx/core.hpp"
+
+namespace halx::peripheral {
+
+#ifdef HAL_TIM_MODULE_ENABLED
+
+/**
+ * 入力キャプチャの値(エッジの時刻、タイマーのカウント)を、循環モードの
+ * DMA でバッファに書き込みます。エッジごとの割り込みはなく、読み出しは
+ * DMA の残り転送数から最新の位置を求めるだけです。
+ *
+ * CubeMX で `Channel` を `Input Capture direct mode` にし、`DMA Settings`
+ * で `TIMx_CHy` の DMA を `Circular`、データ幅を `Word` にしてください。
+ * カウンタはフリーランにしてください (スレーブのリセットモードは不可)。
+ *
+ * - `get_period()`: 同じ向きの直近2つのエッジの間隔。`Channel` の極性が
+ *   `Both Edges` なら2つ前のエッジとの間隔
+ * - `get_width()`: `WidthChannel` に `Channel` と逆の極性の
+ *   `Input Capture indirect mode` を設定すると、パルス幅も測れます
+ *   (CubeMX の `PWM Input on CHx` の設定で、スレーブモードなし)。
+ *   入力の周期は `(ARR + 1) / 2` カウント以下にしてください。長いと
+ *   直近の立ち下がりがどちらのエッジの後か区別できないので、
+ *   `std::nullopt` を返します
+ *
+ * 値はすべてタイマーのカウント数です。
+ *
+ * @code{.cpp}
+ * #include <cstdio>
+ * #include <halx/core.hpp>
+ * #include <halx/peripheral.hpp>
+ *
+ * extern TIM_HandleTypeDef htim2;
+ *
+ * extern "C" void main_thread(void *) {
+ *   using namespace halx::core;
+ *   using namespace halx::peripheral;
+ *
+ *   // プロポの PWM (CH1: 立ち上がり、CH2: 立ち下がり)
+ *   static uint32_t buf[16];
+ *   InputCapture<&htim2, TIM_CHANNEL_1, TIM_CHANNEL_2> capture(buf);
+ *   capture.start();
+ *
+ *   while (true) {
+ *     if (auto width = capture.get_width()) {
+ *       printf("%lu\r\n", *width);
+ *     }
+ *     delay(20);
+ *   }
+ * }
+ * @endcode
+ */
+template <TIM_HandleTypeDef *Handle, uint32_t Channel,
+          uint32_t WidthChannel = Channel>
+class InputCapture {
+public:
+  explicit InputCapture(std::span<uint32_t> buf) : buf_{buf} {}
+
+  ~InputCapture() { stop(); }
+
+  InputCapture(const InputCapture &) = delete;
+  InputCapture &operator=(const InputCapture &) = delete;
+
+  bool start() {
+    if (buf_.size() < 4) {
+      return false;
+    }
+    period_ = static_cast<uint64_t>(__HAL_TIM_GET_AUTORELOAD(Handle)) + 1;
+    // まだキャプチャしていない位置の印。32bit タイマーで ARR が最大の
+    // とき以外はキャプチャ値と区別できる
+    std::fill(buf_.begin(), buf_.end(), EMPTY);
+    if constexpr (HAS_WIDTH_CHANNEL) {
+      if (HAL_TIM_IC_Start(Handle, WidthChannel) != HAL_OK) {
+        return false;
+      }
+    }
+    if (HAL_TIM_IC_Start_DMA(Handle, Channel, buf_.data(), buf_.size()) !=
+        HAL_OK) {
+      stop();
+      return false;
+    }
+    return true;
+  }
+
+  bool stop() {
+    bool result = HAL_TIM_IC_Stop_DMA(Handle, Channel) == HAL_OK;
+    if constexpr (HAS_WIDTH_CHANNEL) {
+      result = HAL_TIM_IC_Stop(Handle, WidthChannel) == HAL_OK && result;
+    }
+    return result;
+  }
+
+  std::optional<uint32_t> get_period() const {
+    std::array<uint32_t, 3> edges;
+    size_t count = is_both_edges() ? 3 : 2;
+    if (load_edges(std::span{edges}.first(count)) != count) {
+      return std::nullopt;
+    }
+    return get_interval(edges[0], edges[count - 1]);
+  }
+
+  std::optional<uint32_t> get_width() const
+    requires HAS_WIDTH_CHANNEL
+  {
+    for (size_t retry = 0; retry < MAX_RETRY; ++retry) {
+      uint32_t end = __HAL_TIM_GET_COMPARE(Handle, WidthChannel);
+      std::array<uint32_t, 2> edges;
+      if (load_edges(edges) != edges.size()) {
+        return std::nullopt;
+      }
+      if (__HAL_TIM_GET_COMPARE(Handle, WidthChannel) != end) {
+        continue;
+      }
+      // 最新のエッジが `end` より後なら、その前のエッジと組にする。
+      // 後のとき `get_interval(edges[1], end)` は `ARR + 1 - (周期 - 幅)`
+      // になるので、周期が `(ARR + 1) / 2` 以下なら周期以上になる
+      uint32_t period = get_interval(edges[0], edges[1]);
+      if (2 * static_cast<uint64_t>(period) > period_) {
+        return std::nullopt;
+      }
+      uint32_t width = get_interval(edges[1], end);
+      return width < period ? width : get_interval(edges[0], end);
+    }
+    return std::nullopt;
+  }
+
+  // 直近のエッジの時刻を古い順に `edges` に書き込み、書き込んだ数を返す
+  size_t get_edges(std::span<uint32_t> edges) const {
+    return load_edges(edges.first(std::min(edges.size(), buf_.size() - 1)));
+  }
+
+private:
+  static constexpr bool HAS_WIDTH_CHANNEL = WidthChannel != Channel;
+  static constexpr uint32_t EMPTY = 0xFFFFFFFF;
+  static constexpr size_t MAX_RETRY = 4;
+
+  std::span<uint32_t> buf_;
+  uint64_t period_ = 0;
+
+  uint32_t get_interval(uint32_t from, uint32_t to) const {
+    return to >= from ? to - from : static_cast<uint32_t>(to + period_ - from);
+  }
+
+  bool is_both_edges() const {
+    uint32_t mask = (TIM_CCER_CC1P | TIM_CCER_CC1NP) << Channel;
+    return (Handle->Instance->CCER & mask) == mask;
+  }
+
+  // DMA の次の書き込み位置
+  size_t get_write_index() const {
+    auto *hdma = Handle->hdma[TIM_DMA_ID_CC1 + Channel / 4];
+    return (buf_.size() - __HAL_DMA_GET_COUNTER(hdma)) % buf_.size();
+  }
+
+  // 直近のエッジを `edges.size()` 個まで読む。読んでいる間に DMA が
+  // 読んだ位置まで書き込んだら読み直す
+  size_t load_edges(std::span<uint32_t> edges) const {
+    size_t size = buf_.size();
+    for (size_t retry = 0; retry < MAX_RETRY; ++retry) {
+      size_t index = get_write_index();
+      size_t count = 0;
+      while (count < edges.size()) {
+        uint32_t edge = buf_[(index + size - 1 - count) % size];
+        if (edge == EMPTY) {
+          break;
+        }
+        edges[count++] = edge;
+      }
+      if ((get_write_index() + size - index) % size < size - count) {
+        std::reverse(edges.begin(), edges.begin() + count);
+        return count;
+      }
+    }
+    return 0;
+  }
+};
+
+#endif
+
+} // namespace halx::peripheral
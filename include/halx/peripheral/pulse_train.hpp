@@ -0,0 +1,301 @@
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <span>
+
+#include "halx/core.hpp"
+
+namespace halx::peripheral {
+
+#ifdef HAL_TIM_MODULE_ENABLED
+
+/**
+ * 1ビットを1周期のパルスで表すときの、ビット 0 / 1 のコンペア値です。
+ */
+struct PulseCode {
+  uint32_t zero;
+  uint32_t one;
+};
+
+// DShot: 0 は 37.5%、1 は 75% の幅
+inline constexpr PulseCode make_dshot_code(uint32_t period) {
+  return {.zero = period * 3 / 8, .one = period * 3 / 4};
+}
+
+// WS2812: タイマーの周期を 1.25us (800kHz) にしたとき、0 は 0.4us、1 は
+// 0.8us の幅
+inline constexpr PulseCode make_ws2812_code(uint32_t period) {
+  return {.zero = period * 8 / 25, .one = period * 16 / 25};
+}
+
+// DShot のパケット (値 11bit、テレメトリ要求 1bit、CRC 4bit)。`value` は
+// 0 が停止、1-47 がコマンド、48-2047 がスロットル
+inline constexpr uint16_t make_dshot_packet(uint16_t value, bool telemetry) {
+  uint16_t packet = ((value & 0x7FF) << 1) | (telemetry ? 1 : 0);
+  uint16_t crc = (packet ^ (packet >> 4) ^ (packet >> 8)) & 0xF;
+  return (packet << 4) | crc;
+}
+
+/**
+ * `bits` の上位ビットから `bit_count` ビットを、`buf` の `offset` 番目から
+ * `stride` 個おきにコンペア値として書き込みます。
+ */
+inline void encode_pulse_bits(std::span<uint32_t> buf, size_t stride,
+                              size_t offset, uint32_t bits, size_t bit_count,
+                              const PulseCode &code) {
+  for (size_t i = 0; i < bit_count; ++i) {
+    bool bit = (bits >> (bit_count - 1 - i)) & 1;
+    buf[i * stride + offset] = bit ? code.one : code.zero;
+  }
+}
+
+/**
+ * タイマーの更新イベントごとに DMA でコンペア値を書き換え、パルス列を
+ * 出力します。`Channels` は CH1-CH4 の連続した範囲で、複数なら同じ更新
+ * イベントで全チャンネルを書き換えます (DMA バースト)。
+ *
+ * CubeMX で各チャンネルを `PWM Generation` にし、TIM の `UP` の DMA を
+ * `Normal`、データ幅を `Word` で設定してください。タイマーの周期は1ビット
+ * の長さにします (DShot600 なら 600kHz、WS2812 なら 800kHz)。
+ *
+ * バッファは2面に分けて使います。再生中のフレームの裏で次のフレームを
+ * 作れて、`submit()` したフレームは再生中のフレームの直後に DMA の完了
+ * 割り込みから再生を始めます。バッファには、1周期ごとにチャンネルの数だけ
+ * コンペア値を並べます。
+ *
+ * @code{.cpp}
+ * #include <halx/core.hpp>
+ * #include <halx/peripheral.hpp>
+ *
+ * extern TIM_HandleTypeDef htim1;
+ * extern TIM_HandleTypeDef htim3;
+ *
+ * extern "C" void main_thread(void *) {
+ *   using namespace halx::core;
+ *   using namespace halx::peripheral;
+ *
+ *   // DShot600 で ESC 4つ
+ *   static uint32_t dshot_buf[2 * 4 * 18];
+ *   PulseTrain<&htim1, TIM_CHANNEL_1, TIM_CHANNEL_2, TIM_CHANNEL_3,
+ *              TIM_CHANNEL_4>
+ *       dshot(dshot_buf);
+ *   dshot.start();
+ *
+ *   // WS2812 を 8個
+ *   static uint32_t led_buf[2 * (8 * 24 + 48)];
+ *   PulseTrain<&htim3, TIM_CHANNEL_1> leds(led_buf);
+ *   leds.start();
+ *   std::array<uint32_t, 8> colors{0xFF0000, 0x00FF00, 0x0000FF};
+ *   leds.transmit_ws2812(colors, 10);
+ *
+ *   uint32_t tick = get_tick();
+ *   while (true) {
+ *     dshot.transmit_dshot({48, 48, 48, 48}, false, 1);
+ *     delay_until(++tick);
+ *   }
+ * }
+ * @endcode
+ */
+template <TIM_HandleTypeDef *Handle, uint32_t... Channels> class PulseTrain {
+public:
+  static constexpr size_t SIZE = sizeof...(Channels);
+
+  // DShot のフレームの後に入れる Low の周期数
+  static constexpr size_t DSHOT_GAP = 2;
+  // WS2812 のラッチ (50us 以上の Low) の周期数
+  static constexpr size_t WS2812_RESET = 48;
+
+private:
+  static constexpr std::array<uint32_t, SIZE> CHANNELS{Channels...};
+  static_assert(SIZE > 0 && [] {
+    for (size_t i = 0; i < SIZE; ++i) {
+      if (CHANNELS[i] != CHANNELS[0] + 4 * i || CHANNELS[i] > TIM_CHANNEL_4) {
+        return false;
+      }
+    }
+    return true;
+  }());
+
+  enum class BufferState : uint8_t {
+    FREE,
+    QUEUED,
+    PLAYING,
+  };
+
+  struct State {
+    std::array<std::span<uint32_t>, 2> buffers;
+    std::array<std::atomic<BufferState>, 2> buffer_states{};
+    std::array<size_t, 2> lengths{};
+    core::Notifier notifier;
+
+    State(std::span<uint32_t> buf)
+        : buffers{buf.first(buf.size() / 2),
+                  buf.subspan(buf.size() / 2, buf.size() / 2)} {
+      stm32cubemx_helper::set_context<Handle, State>(this);
+      // DMA バーストの転送完了は更新イベントのコールバックで通知される
+      HAL_TIM_RegisterCallback(
+          Handle, HAL_TIM_PERIOD_ELAPSED_CB_ID, [](TIM_HandleTypeDef *) {
+            auto state = stm32cubemx_helper::get_context<Handle, State>();
+            state->on_complete();
+          });
+    }
+
+    ~State() {
+      HAL_TIM_DMABurst_WriteStop(Handle, TIM_DMA_UPDATE);
+      HAL_TIM_UnRegisterCallback(Handle, HAL_TIM_PERIOD_ELAPSED_CB_ID);
+      stm32cubemx_helper::set_context<Handle, State>(nullptr);
+    }
+
+    // 割り込み禁止中か DMA の完了割り込みから呼ぶ
+    bool play(size_t index) {
+      HAL_TIM_DMABurst_WriteStop(Handle, TIM_DMA_UPDATE);
+      if (HAL_TIM_DMABurst_MultiWriteStart(
+              Handle, TIM_DMABASE_CCR1 + CHANNELS[0] / 4, TIM_DMA_UPDATE,
+              buffers[index].data(),
+              TIM_DMABURSTLENGTH_1TRANSFER + ((SIZE - 1) << 8),
+              lengths[index] * SIZE) != HAL_OK) {
+        buffer_states[index].store(BufferState::FREE,
+                                   std::memory_order_relaxed);
+        return false;
+      }
+      buffer_states[index].store(BufferState::PLAYING,
+                                 std::memory_order_relaxed);
+      return true;
+    }
+
+    void on_complete() {
+      for (size_t i = 0; i < buffer_states.size(); ++i) {
+        if (buffer_states[i].load(std::memory_order_relaxed) ==
+            BufferState::PLAYING) {
+          buffer_states[i].store(BufferState::FREE, std::memory_order_release);
+          if (buffer_states[1 - i].load(std::memory_order_relaxed) ==
+              BufferState::QUEUED) {
+            play(1 - i);
+          }
+          break;
+        }
+      }
+      notifier.set(0x1);
+    }
+  };
+
+public:
+  // `buf` の半分ずつを2面のバッファとして使う
+  explicit PulseTrain(std::span<uint32_t> buf)
+      : state_{std::make_unique<State>(buf)} {}
+
+  // `MX_TIMx_Init()` の前に構築してもよいように、レジスタは `start()` で
+  // 設定する
+  bool start() {
+    (__HAL_TIM_ENABLE_OCxPRELOAD(Handle, Channels), ...);
+    period_ = __HAL_TIM_GET_AUTORELOAD(Handle) + 1;
+    (__HAL_TIM_SET_COMPARE(Handle, Channels, 0), ...);
+    return ((HAL_TIM_PWM_Start(Handle, Channels) == HAL_OK) && ...);
+  }
+
+  bool stop() {
+    HAL_TIM_DMABurst_WriteStop(Handle, TIM_DMA_UPDATE);
+    for (auto &buffer_state : state_->buffer_states) {
+      buffer_state.store(BufferState::FREE, std::memory_order_relaxed);
+    }
+    return ((HAL_TIM_PWM_Stop(Handle, Channels) == HAL_OK) && ...);
+  }
+
+  // 1周期のカウント数 (ARR + 1)。`start()` で読み出す
+  uint32_t get_period() const { return period_; }
+
+  /**
+   * 次のフレームを書き込むバッファを返します。2面とも再生中か再生待ちなら
+   * `timeout` まで待ち、空かなければ空の span を返します。
+   */
+  std::span<uint32_t> acquire(uint32_t timeout) {
+    state_->notifier.reset();
+    if (!is_free(write_index_)) {
+      state_->notifier.wait(0x1, timeout);
+      if (!is_free(write_index_)) {
+        return {};
+      }
+    }
+    return state_->buffers[write_index_];
+  }
+
+  /**
+   * `acquire()` で得たバッファの先頭 `length` 周期分を再生します。
+   * 再生中のフレームがあれば、その直後に再生します。
+   */
+  bool submit(size_t length) {
+    size_t index = write_index_;
+    if (length == 0 || length * SIZE > state_->buffers[index].size() ||
+        !is_free(index)) {
+      return false;
+    }
+    uint32_t primask = __get_PRIMASK();
+    __disable_irq();
+    state_->lengths[index] = length;
+    state_->buffer_states[index].store(BufferState::QUEUED,
+                                       std::memory_order_relaxed);
+    bool result = true;
+    if (state_->buffer_states[1 - index].load(std::memory_order_relaxed) !=
+        BufferState::PLAYING) {
+      result = state_->play(index);
+    }
+    __set_PRIMASK(primask);
+    write_index_ = 1 - index;
+    return result;
+  }
+
+  // チャンネルごとに DShot のフレームを送信する
+  bool transmit_dshot(const std::array<uint16_t, SIZE> &values,
+                      bool telemetry, uint32_t timeout) {
+    auto buf = acquire(timeout);
+    if (buf.size() < (16 + DSHOT_GAP) * SIZE) {
+      return false;
+    }
+    PulseCode code = make_dshot_code(period_);
+    for (size_t i = 0; i < SIZE; ++i) {
+      encode_pulse_bits(buf, SIZE, i, make_dshot_packet(values[i], telemetry),
+                        16, code);
+    }
+    std::fill_n(buf.begin() + 16 * SIZE, DSHOT_GAP * SIZE, 0);
+    return submit(16 + DSHOT_GAP);
+  }
+
+  // WS2812 に色 (0xRRGGBB) を送信する
+  bool transmit_ws2812(std::span<const uint32_t> colors, uint32_t timeout)
+    requires(SIZE == 1)
+  {
+    auto buf = acquire(timeout);
+    size_t length = colors.size() * 24 + WS2812_RESET;
+    if (buf.size() < length) {
+      return false;
+    }
+    PulseCode code = make_ws2812_code(period_);
+    for (size_t i = 0; i < colors.size(); ++i) {
+      // WS2812 は G, R, B の順
+      uint32_t grb = ((colors[i] & 0x00FF00) << 8) |
+                     ((colors[i] & 0xFF0000) >> 8) | (colors[i] & 0x0000FF);
+      encode_pulse_bits(buf.subspan(i * 24), 1, 0, grb, 24, code);
+    }
+    std::fill_n(buf.begin() + colors.size() * 24, WS2812_RESET, 0);
+    return submit(length);
+  }
+
+private:
+  std::unique_ptr<State> state_;
+  uint32_t period_ = 0;
+  size_t write_index_ = 0;
+
+  bool is_free(size_t index) const {
+    return state_->buffer_states[index].load(std::memory_order_acquire) ==
+           BufferState::FREE;
+  }
+};
+
+#endif
+
+} // namespace halx::peripheral
@@ -1,5 +1,7 @@
 #pragma once
 
+#include <array>
+#include <cstddef>
 #include <cstdint>
 
 #include "halx/core.hpp"
@@ -8,12 +10,105 @@ namespace halx::peripheral {
 
 #ifdef HAL_TIM_MODULE_ENABLED
 
+namespace detail {
+
+// `duty` (0.0-1.0) を、1周期のカウント数 `period` (ARR + 1) を掛けた
+// コンペア値にする
+inline uint32_t get_pwm_compare(float duty, float period) {
+  if (duty <= 0.0f) {
+    return 0;
+  }
+  if (duty >= 1.0f) {
+    return static_cast<uint32_t>(period);
+  }
+  return static_cast<uint32_t>(duty * period);
+}
+
+// `duty` は 16.16 固定小数点 (0x10000 で 100%)
+inline uint32_t get_pwm_compare_q16(uint32_t duty, uint32_t period) {
+  if (duty >= 0x10000) {
+    return period;
+  }
+  return static_cast<uint32_t>((static_cast<uint64_t>(duty) * period) >> 16);
+}
+
+} // namespace detail
+
+/**
+ * チャンネルをテンプレート引数で指定すると、`set_compare()` は CCR への
+ * 書き込み1回になります。チャンネルを実行時に決める場合はコンストラクタに
+ * 渡します (`Pwm<>`)。
+ *
+ * `set_duty()` はデューティ比 (0.0-1.0、または 16.16 固定小数点) で指定
+ * します。1周期のカウント数 (ARR + 1) は `start()` で読み出すので、
+ * `set_duty()` は `start()` の後に呼び、ARR を変更したら `update_period()`
+ * を呼んでください。コンストラクタはレジスタに触れないので、`MX_TIMx_Init()`
+ * より前にグローバル変数として構築できます。
+ *
+ * @code{.cpp}
+ * #include <halx/core.hpp>
+ * #include <halx/peripheral.hpp>
+ *
+ * extern TIM_HandleTypeDef htim1;
+ *
+ * extern "C" void main_thread(void *) {
+ *   using namespace halx::core;
+ *   using namespace halx::peripheral;
+ *
+ *   Pwm<&htim1, TIM_CHANNEL_1> pwm1;
+ *   Pwm pwm2(&htim1, TIM_CHANNEL_2); // Pwm<>
+ *   pwm1.start();
+ *   pwm2.start();
+ *
+ *   pwm1.set_duty(0.25f);
+ *   pwm2.set_duty_q16(0x8000); // 50%
+ * }
+ * @endcode
+ */
+template <TIM_HandleTypeDef *Handle = nullptr, uint32_t Channel = 0>
 class Pwm {
+public:
+  bool start() {
+    update_period();
+    return HAL_TIM_PWM_Start(Handle, Channel) == HAL_OK;
+  }
+
+  bool stop() { return HAL_TIM_PWM_Stop(Handle, Channel) == HAL_OK; }
+
+  uint32_t get_compare() const {
+    return __HAL_TIM_GET_COMPARE(Handle, Channel);
+  }
+
+  void set_compare(uint32_t compare) {
+    __HAL_TIM_SET_COMPARE(Handle, Channel, compare);
+  }
+
+  void set_duty(float duty) {
+    set_compare(detail::get_pwm_compare(duty, period_));
+  }
+
+  void set_duty_q16(uint32_t duty) {
+    set_compare(
+        detail::get_pwm_compare_q16(duty, static_cast<uint32_t>(period_)));
+  }
+
+  void update_period() {
+    period_ = static_cast<float>(__HAL_TIM_GET_AUTORELOAD(Handle) + 1);
+  }
+
+private:
+  float period_ = 0.0f;
+};
+
+template <> class Pwm<nullptr, 0> {
 public:
   Pwm(TIM_HandleTypeDef *handle, uint32_t channel)
       : handle_{handle}, channel_{channel} {}
 
-  bool start() { return HAL_TIM_PWM_Start(handle_, channel_) == HAL_OK; }
+  bool start() {
+    update_period();
+    return HAL_TIM_PWM_Start(handle_, channel_) == HAL_OK;
+  }
 
   bool stop() { return HAL_TIM_PWM_Stop(handle_, channel_) == HAL_OK; }
 
@@ -25,11 +120,129 @@ public:
     __HAL_TIM_SET_COMPARE(handle_, channel_, compare);
   }
 
+  void set_duty(float duty) {
+    set_compare(detail::get_pwm_compare(duty, period_));
+  }
+
+  void set_duty_q16(uint32_t duty) {
+    set_compare(
+        detail::get_pwm_compare_q16(duty, static_cast<uint32_t>(period_)));
+  }
+
+  void update_period() {
+    period_ = static_cast<float>(__HAL_TIM_GET_AUTORELOAD(handle_) + 1);
+  }
+
 private:
   TIM_HandleTypeDef *handle_;
   uint32_t channel_;
+  float period_ = 0.0f;
+};
+
+Pwm(TIM_HandleTypeDef *, uint32_t) -> Pwm<>;
+
+/**
+ * 同じタイマーの複数チャンネルのコンペア値を、次の更新イベントでまとめて
+ * 反映します。各チャンネルのプリロードを有効にし、書き込み中は更新イベント
+ * を止める (CR1.UDIS) ので、一部のチャンネルだけが先に変わることは
+ * ありません。プリロードの設定と ARR の読み出しは `Pwm` と同じく `start()`
+ * で行います。
+ *
+ * チャンネルが CH1-CH4 の連続した範囲なら、`set_compares_dma()` で更新
+ * イベントの DMA バースト転送 (`HAL_TIM_DMABurst_WriteStart`) でも書き込め
+ * ます。CubeMX で TIM の `UP` の DMA を Normal モードで設定してください。
+ *
+ * @code{.cpp}
+ * PwmGroup<&htim1, TIM_CHANNEL_1, TIM_CHANNEL_2, TIM_CHANNEL_3,
+ *          TIM_CHANNEL_4>
+ *     bridge;
+ * bridge.start();
+ * bridge.set_duties({0.5f, 0.5f, 0.2f, 0.8f});
+ * @endcode
+ */
+template <TIM_HandleTypeDef *Handle, uint32_t... Channels> class PwmGroup {
+public:
+  static constexpr size_t SIZE = sizeof...(Channels);
+
+private:
+  static constexpr std::array<uint32_t, SIZE> CHANNELS{Channels...};
+  static constexpr uint32_t FIRST_CHANNEL_INDEX = CHANNELS[0] / 4;
+  // CH1-CH4 の CCR はレジスタが連続しているので、DMA バーストで書ける
+  static constexpr bool IS_CONTIGUOUS = [] {
+    for (size_t i = 0; i < SIZE; ++i) {
+      if (CHANNELS[i] != CHANNELS[0] + 4 * i || CHANNELS[i] > TIM_CHANNEL_4) {
+        return false;
+      }
+    }
+    return true;
+  }();
+
+public:
+  bool start() {
+    (__HAL_TIM_ENABLE_OCxPRELOAD(Handle, Channels), ...);
+    update_period();
+    return ((HAL_TIM_PWM_Start(Handle, Channels) == HAL_OK) && ...);
+  }
+
+  bool stop() {
+    if constexpr (IS_CONTIGUOUS) {
+      if (Handle->hdma[TIM_DMA_ID_UPDATE]) {
+        HAL_TIM_DMABurst_WriteStop(Handle, TIM_DMA_UPDATE);
+      }
+    }
+    return ((HAL_TIM_PWM_Stop(Handle, Channels) == HAL_OK) && ...);
+  }
+
+  void set_compares(const std::array<uint32_t, SIZE> &compares) {
+    auto *instance = Handle->Instance;
+    instance->CR1 = instance->CR1 | TIM_CR1_UDIS;
+    size_t i = 0;
+    (__HAL_TIM_SET_COMPARE(Handle, Channels, compares[i++]), ...);
+    instance->CR1 = instance->CR1 & ~TIM_CR1_UDIS;
+  }
+
+  void set_duties(const std::array<float, SIZE> &duties) {
+    std::array<uint32_t, SIZE> compares;
+    for (size_t i = 0; i < SIZE; ++i) {
+      compares[i] = detail::get_pwm_compare(duties[i], period_);
+    }
+    set_compares(compares);
+  }
+
+  void set_duties_q16(const std::array<uint32_t, SIZE> &duties) {
+    std::array<uint32_t, SIZE> compares;
+    for (size_t i = 0; i < SIZE; ++i) {
+      compares[i] = detail::get_pwm_compare_q16(
+          duties[i], static_cast<uint32_t>(period_));
+    }
+    set_compares(compares);
+  }
+
+  // 次の更新イベントで DMA が CCR に書き込む。前の転送が終わっていなければ
+  // 中断して新しい値で始め直す
+  bool set_compares_dma(const std::array<uint32_t, SIZE> &compares)
+    requires IS_CONTIGUOUS
+  {
+    if (!Handle->hdma[TIM_DMA_ID_UPDATE]) {
+      return false;
+    }
+    HAL_TIM_DMABurst_WriteStop(Handle, TIM_DMA_UPDATE);
+    dma_buffer_ = compares;
+    return HAL_TIM_DMABurst_WriteStart(
+               Handle, TIM_DMABASE_CCR1 + FIRST_CHANNEL_INDEX, TIM_DMA_UPDATE,
+               dma_buffer_.data(),
+               TIM_DMABURSTLENGTH_1TRANSFER + ((SIZE - 1) << 8)) == HAL_OK;
+  }
+
+  void update_period() {
+    period_ = static_cast<float>(__HAL_TIM_GET_AUTORELOAD(Handle) + 1);
+  }
+
+private:
+  float period_ = 0.0f;
+  std::array<uint32_t, SIZE> dma_buffer_{};
 };
 
 #endif
 
-} // namespace halx::peripheral
\ No newline at end of file
+} // namespace halx::peripheral
@@ -0,0 +1,313 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <numeric>
+#include <optional>
+#include <vector>
+
+#include "halx/core.hpp"
+
+#include "tim.hpp"
+
+namespace halx::peripheral {
+
+/**
+ * タスクの実行状況です。実行時間は `core::get_cycle_count()` と同じ CPU
+ * サイクル単位です。
+ *
+ * - `overrun_count`: 割り込みで実行するタスクでは、終わったときに次の
+ *   ティックの時刻を過ぎていた回数。スレッドで実行するタスクでは、前回の
+ *   実行が終わる前に次の周期が来て、1回分を捨てた回数
+ */
+struct RateTaskStats {
+  uint32_t run_count;
+  uint32_t overrun_count;
+  uint32_t last_cycles;
+  uint32_t max_cycles;
+};
+
+/**
+ * タイマー割り込みを基本周期として、複数の周期のタスクを実行する
+ * スケジューラーです。周期は基本周期の整数倍 (`divisor`) で指定します。
+ *
+ * - 1ティックの中では周期の短いタスクから順に実行します
+ * - 位相を省略すると、既存のタスクと同じティックに重なりにくい位相を
+ *   選び、ティックごとの負荷を分散します
+ * - `deferred` を true にしたタスクは、割り込みでは実行待ちにするだけで、
+ *   `run_deferred()` を呼ぶスレッドで実行します。周期の長い重い処理を
+ *   優先度の低いスレッドに回せます
+ *
+ * `add()` / `remove()` は `start()` 前か `stop()` 後に呼んでください。
+ *
+ * @code{.cpp}
+ * #include <halx/core.hpp>
+ * #include <halx/peripheral.hpp>
+ *
+ * extern TIM_HandleTypeDef htim6; // 20kHz で割り込みが発生するように設定
+ *
+ * void control_current(void *context);  // 電流制御
+ * void control_velocity(void *context); // 速度制御
+ * void plan_trajectory(void *context);  // 軌道計画
+ *
+ * extern "C" void main_thread(void *) {
+ *   using namespace halx::core;
+ *   using namespace halx::peripheral;
+ *
+ *   Tim<&htim6> tim6;
+ *   RateScheduler scheduler(tim6, 20000);
+ *   scheduler.add(control_current, nullptr, 1);    // 20kHz
+ *   scheduler.add(control_velocity, nullptr, 20);  // 1kHz
+ *   // 100Hz、このスレッドで実行
+ *   scheduler.add(plan_trajectory, nullptr, 200, std::nullopt, true);
+ *   scheduler.start();
+ *
+ *   while (true) {
+ *     scheduler.run_deferred(MAX_DELAY);
+ *   }
+ * }
+ * @endcode
+ */
+class RateScheduler {
+public:
+  // `frequency` はタイマー割り込みの周波数 [Hz]
+  RateScheduler(TimBase &tim, uint32_t frequency)
+      : tim_{tim}, frequency_{frequency} {}
+
+  ~RateScheduler() { stop(); }
+
+  RateScheduler(const RateScheduler &) = delete;
+  RateScheduler &operator=(const RateScheduler &) = delete;
+
+  std::optional<size_t> add(void (*task)(void *context), void *context,
+                            uint32_t divisor,
+                            std::optional<uint32_t> phase = std::nullopt,
+                            bool deferred = false) {
+    if (started_ || !task || divisor == 0 || (phase && *phase >= divisor)) {
+      return std::nullopt;
+    }
+    uint32_t task_phase = phase ? *phase : find_phase(divisor, deferred);
+    auto it = std::find_if(entries_.begin(), entries_.end(),
+                           [](const Entry &entry) { return !entry.is_active; });
+    if (it == entries_.end()) {
+      entries_.emplace_back();
+      it = entries_.end() - 1;
+    }
+    it->task = task;
+    it->context = context;
+    it->divisor = divisor;
+    it->phase = task_phase;
+    it->countdown = task_phase;
+    it->deferred = deferred;
+    it->is_active = true;
+    it->is_pending.store(false, std::memory_order_relaxed);
+    it->stats = {};
+    update_order();
+    return it - entries_.begin();
+  }
+
+  bool remove(size_t index) {
+    if (started_ || index >= entries_.size() || !entries_[index].is_active) {
+      return false;
+    }
+    entries_[index].is_active = false;
+    update_order();
+    return true;
+  }
+
+  bool start() {
+    if (started_ || frequency_ == 0) {
+      return false;
+    }
+    core::enable_cycle_counter();
+    // クロックの設定前に構築されてもよいように、ここでサイクルに換算する
+    tick_cycles_ = SystemCoreClock / frequency_;
+    for (auto &entry : entries_) {
+      entry.countdown = entry.phase;
+      entry.is_pending.store(false, std::memory_order_relaxed);
+    }
+    if (!tim_.attach_callback(
+            [](void *context) {
+              static_cast<RateScheduler *>(context)->on_tick();
+            },
+            this)) {
+      return false;
+    }
+    if (!tim_.start()) {
+      tim_.detach_callback();
+      return false;
+    }
+    started_ = true;
+    return true;
+  }
+
+  bool stop() {
+    if (!started_) {
+      return false;
+    }
+    tim_.stop();
+    tim_.detach_callback();
+    started_ = false;
+    return true;
+  }
+
+  /**
+   * 実行待ちの `deferred` なタスクを実行し、実行したタスクの数を返します。
+   * 実行待ちがなければ `timeout` まで待ちます。実行時間にはより優先度の
+   * 高いスレッドや割り込みに割り込まれた時間も含まれます。
+   */
+  size_t run_deferred(uint32_t timeout) {
+    notifier_.reset();
+    if (!has_pending()) {
+      notifier_.wait(0x1, timeout);
+    }
+    size_t count = 0;
+    for (size_t index : order_) {
+      auto &entry = entries_[index];
+      if (!entry.deferred ||
+          !entry.is_pending.load(std::memory_order_acquire)) {
+        continue;
+      }
+      uint32_t start = core::get_cycle_count();
+      entry.task(entry.context);
+      uint32_t cycles = core::get_cycle_count() - start;
+      uint32_t primask = __get_PRIMASK();
+      __disable_irq();
+      record(entry.stats, cycles);
+      __set_PRIMASK(primask);
+      entry.is_pending.store(false, std::memory_order_release);
+      ++count;
+    }
+    return count;
+  }
+
+  std::optional<RateTaskStats> get_stats(size_t index) const {
+    if (index >= entries_.size() || !entries_[index].is_active) {
+      return std::nullopt;
+    }
+    uint32_t primask = __get_PRIMASK();
+    __disable_irq();
+    RateTaskStats stats = entries_[index].stats;
+    __set_PRIMASK(primask);
+    return stats;
+  }
+
+private:
+  struct Entry {
+    void (*task)(void *context) = nullptr;
+    void *context = nullptr;
+    uint32_t divisor = 1;
+    uint32_t phase = 0;
+    // 次に実行するまでのティック数。割り込みからのみ使う
+    uint32_t countdown = 0;
+    bool deferred = false;
+    bool is_active = false;
+    std::atomic<bool> is_pending{false};
+    RateTaskStats stats{};
+
+    Entry() = default;
+    Entry(const Entry &other)
+        : task{other.task}, context{other.context}, divisor{other.divisor},
+          phase{other.phase}, countdown{other.countdown},
+          deferred{other.deferred}, is_active{other.is_active},
+          is_pending{other.is_pending.load(std::memory_order_relaxed)},
+          stats{other.stats} {}
+  };
+
+  TimBase &tim_;
+  uint32_t frequency_;
+  // 基本周期 [サイクル]。start() で求める
+  uint32_t tick_cycles_ = 0;
+  std::vector<Entry> entries_;
+  // 有効なタスクの添字を周期の短い順に並べたもの
+  std::vector<size_t> order_;
+  core::Notifier notifier_;
+  bool started_ = false;
+
+  void update_order() {
+    order_.clear();
+    for (size_t i = 0; i < entries_.size(); ++i) {
+      if (entries_[i].is_active) {
+        order_.push_back(i);
+      }
+    }
+    std::stable_sort(order_.begin(), order_.end(), [&](size_t a, size_t b) {
+      return entries_[a].divisor < entries_[b].divisor;
+    });
+  }
+
+  // 周期 `divisor`・位相 `phase` のタスクと周期 `entry.divisor` のタスクが
+  // 同じティックに重なるのは、位相の差が最大公約数で割り切れるとき。
+  // 重なる相手の実行頻度 (1 / 周期) の合計が最小の位相を選ぶ
+  uint32_t find_phase(uint32_t divisor, bool deferred) const {
+    uint32_t best_phase = 0;
+    float best_cost = 0.0f;
+    for (uint32_t phase = 0; phase < divisor; ++phase) {
+      float cost = 0.0f;
+      for (const auto &entry : entries_) {
+        if (!entry.is_active || entry.deferred != deferred) {
+          continue;
+        }
+        uint32_t gcd = std::gcd(divisor, entry.divisor);
+        if (phase % gcd == entry.phase % gcd) {
+          cost += 1.0f / static_cast<float>(entry.divisor);
+        }
+      }
+      if (phase == 0 || cost < best_cost) {
+        best_phase = phase;
+        best_cost = cost;
+      }
+    }
+    return best_phase;
+  }
+
+  bool has_pending() const {
+    return std::any_of(entries_.begin(), entries_.end(),
+                       [](const Entry &entry) {
+                         return entry.is_active && entry.deferred &&
+                                entry.is_pending.load(
+                                    std::memory_order_relaxed);
+                       });
+  }
+
+  void on_tick() {
+    uint32_t tick_start = core::get_cycle_count();
+    bool has_deferred = false;
+    for (size_t index : order_) {
+      auto &entry = entries_[index];
+      if (entry.countdown > 0) {
+        --entry.countdown;
+        continue;
+      }
+      entry.countdown = entry.divisor - 1;
+      if (entry.deferred) {
+        if (entry.is_pending.exchange(true, std::memory_order_acq_rel)) {
+          ++entry.stats.overrun_count;
+        } else {
+          has_deferred = true;
+        }
+        continue;
+      }
+      uint32_t start = core::get_cycle_count();
+      entry.task(entry.context);
+      uint32_t end = core::get_cycle_count();
+      record(entry.stats, end - start);
+      if (end - tick_start > tick_cycles_) {
+        ++entry.stats.overrun_count;
+      }
+    }
+    if (has_deferred) {
+      notifier_.set(0x1);
+    }
+  }
+
+  static void record(RateTaskStats &stats, uint32_t cycles) {
+    ++stats.run_count;
+    stats.last_cycles = cycles;
+    stats.max_cycles = std::max(stats.max_cycles, cycles);
+  }
+};
+
+} // namespace halx::peripheral
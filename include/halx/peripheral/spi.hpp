@@ -0,0 +1,323 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+
+#include "halx/core.hpp"
+
+#include "gpio.hpp"
+
+namespace halx::peripheral {
+
+#if defined(HAL_SPI_MODULE_ENABLED) && defined(HAL_GPIO_MODULE_ENABLED)
+
+/**
+ * SPI のデバイスです。チップセレクトのピン (CubeMX で出力 High にして
+ * おく) と、通信モード・ボーレートのプリスケーラを指定します。
+ */
+struct SpiDevice {
+  Gpio<> cs;
+  uint32_t polarity;  // SPI_POLARITY_LOW / SPI_POLARITY_HIGH
+  uint32_t phase;     // SPI_PHASE_1EDGE / SPI_PHASE_2EDGE
+  uint32_t prescaler; // SPI_BAUDRATEPRESCALER_x
+};
+
+/**
+ * キューに積む SPI の転送です。`tx_data` / `rx_data` の片方は nullptr に
+ * できます。完了するまで呼び出し側で保持してください。
+ *
+ * `callback` は完了時に SPI の割り込みから呼ばれます。
+ */
+struct SpiTransaction {
+  SpiDevice *device;
+  const uint8_t *tx_data;
+  uint8_t *rx_data;
+  size_t size;
+  void (*callback)(void *context, bool success) = nullptr;
+  void *context = nullptr;
+  // 以下はドライバが使う
+  SpiTransaction *next = nullptr;
+};
+
+/**
+ * SPI の使用状況です。時間は `core::get_cycle_count64()` と同じ CPU
+ * サイクル単位で、`busy_cycles / elapsed_cycles` がバスの使用率です。
+ * サイクルカウンタは `Spi` のコンストラクタで有効にします。
+ */
+struct SpiStats {
+  uint32_t transaction_count;
+  uint32_t error_count;
+  uint64_t busy_cycles;
+  uint64_t elapsed_cycles;
+};
+
+/**
+ * SPI の転送をキューに積み、DMA で1つずつ実行します。転送が終わると
+ * DMA の完了割り込みから次の転送を始めるので、キューに積んだ転送は
+ * 間を空けずに続けて実行されます。デバイスごとにチップセレクトを切り替え、
+ * 通信モードが前の転送と違えば `HAL_SPI_Init()` で設定し直します。
+ *
+ * `transfer()` は完了まで待ち、`submit()` は待たずに戻って完了を
+ * `SpiTransaction::callback` で通知します。どちらも複数のスレッドから
+ * 呼び出せます。
+ *
+ * CubeMX で SPI の `TX` / `RX` の DMA を `Normal` で設定し、SPI の割り込み
+ * も有効にしてください。
+ *
+ * @code{.cpp}
+ * #include <cstdio>
+ * #include <halx/core.hpp>
+ * #include <halx/peripheral.hpp>
+ *
+ * extern SPI_HandleTypeDef hspi1;
+ *
+ * extern "C" void main_thread(void *) {
+ *   using namespace halx::core;
+ *   using namespace halx::peripheral;
+ *
+ *   Spi<&hspi1> spi1;
+ *   SpiDevice imu{
+ *       .cs = Gpio(GPIOA, GPIO_PIN_4),
+ *       .polarity = SPI_POLARITY_HIGH,
+ *       .phase = SPI_PHASE_2EDGE,
+ *       .prescaler = SPI_BAUDRATEPRESCALER_8,
+ *   };
+ *
+ *   while (true) {
+ *     // WHO_AM_I (0x75) の読み出し
+ *     std::array<uint8_t, 2> tx{0x75 | 0x80, 0x00};
+ *     std::array<uint8_t, 2> rx{};
+ *     if (spi1.transfer(imu, tx.data(), rx.data(), tx.size(), 1)) {
+ *       printf("%02X\r\n", rx[1]);
+ *     }
+ *     delay(100);
+ *   }
+ * }
+ * @endcode
+ */
+template <SPI_HandleTypeDef *Handle> class Spi {
+private:
+  struct State {
+    // 割り込み禁止中に更新する
+    SpiTransaction *head = nullptr;
+    SpiTransaction *tail = nullptr;
+    SpiTransaction *current = nullptr;
+    SpiDevice *last_device = nullptr;
+    bool is_aborting = false;
+    uint64_t start_cycle = 0;
+    SpiStats stats{};
+    uint64_t stats_start_cycle = 0;
+
+    State() {
+      // 統計の時間を測るので、DWT のサイクルカウンタを動かす
+      core::enable_cycle_counter();
+      stats_start_cycle = core::get_cycle_count64();
+      stm32cubemx_helper::set_context<Handle, State>(this);
+      for (auto id : {HAL_SPI_TX_COMPLETE_CB_ID, HAL_SPI_RX_COMPLETE_CB_ID,
+                      HAL_SPI_TX_RX_COMPLETE_CB_ID}) {
+        HAL_SPI_RegisterCallback(Handle, id, [](SPI_HandleTypeDef *) {
+          auto state = stm32cubemx_helper::get_context<Handle, State>();
+          state->complete(true);
+        });
+      }
+      HAL_SPI_RegisterCallback(
+          Handle, HAL_SPI_ERROR_CB_ID, [](SPI_HandleTypeDef *) {
+            auto state = stm32cubemx_helper::get_context<Handle, State>();
+            state->complete(false);
+          });
+    }
+
+    ~State() {
+      HAL_SPI_Abort(Handle);
+      for (auto id : {HAL_SPI_TX_COMPLETE_CB_ID, HAL_SPI_RX_COMPLETE_CB_ID,
+                      HAL_SPI_TX_RX_COMPLETE_CB_ID, HAL_SPI_ERROR_CB_ID}) {
+        HAL_SPI_UnRegisterCallback(Handle, id);
+      }
+      stm32cubemx_helper::set_context<Handle, State>(nullptr);
+    }
+
+    // 割り込みから呼ばれる
+    void complete(bool success) {
+      SpiTransaction *transaction = current;
+      if (!transaction) {
+        return;
+      }
+      finish(*transaction, success);
+      start_next();
+    }
+
+    void finish(SpiTransaction &transaction, bool success) {
+      transaction.device->cs.write(1);
+      current = nullptr;
+      ++stats.transaction_count;
+      if (!success) {
+        ++stats.error_count;
+      }
+      stats.busy_cycles += core::get_cycle_count64() - start_cycle;
+      if (transaction.callback) {
+        transaction.callback(transaction.context, success);
+      }
+    }
+
+    // 割り込み禁止中か割り込みから呼ぶ
+    void start_next() {
+      while (!current && !is_aborting && head) {
+        SpiTransaction *transaction = head;
+        head = transaction->next;
+        if (!head) {
+          tail = nullptr;
+        }
+        current = transaction;
+        start_cycle = core::get_cycle_count64();
+        if (!start(*transaction)) {
+          finish(*transaction, false);
+        }
+      }
+    }
+
+    bool start(SpiTransaction &transaction) {
+      SpiDevice &device = *transaction.device;
+      if (&device != last_device) {
+        Handle->Init.CLKPolarity = device.polarity;
+        Handle->Init.CLKPhase = device.phase;
+        Handle->Init.BaudRatePrescaler = device.prescaler;
+        if (HAL_SPI_Init(Handle) != HAL_OK) {
+          last_device = nullptr;
+          return false;
+        }
+        last_device = &device;
+      }
+      device.cs.write(0);
+      uint16_t size = static_cast<uint16_t>(transaction.size);
+      HAL_StatusTypeDef status;
+      if (!transaction.rx_data) {
+        status = HAL_SPI_Transmit_DMA(Handle, transaction.tx_data, size);
+      } else if (!transaction.tx_data) {
+        status = HAL_SPI_Receive_DMA(Handle, transaction.rx_data, size);
+      } else {
+        status = HAL_SPI_TransmitReceive_DMA(Handle, transaction.tx_data,
+                                             transaction.rx_data, size);
+      }
+      return status == HAL_OK;
+    }
+  };
+
+public:
+  Spi() : state_{std::make_unique<State>()} {}
+
+  // 転送をキューに積む。完了は `transaction.callback` で通知される
+  bool submit(SpiTransaction &transaction) {
+    if (!transaction.device || transaction.size == 0 ||
+        transaction.size > UINT16_MAX ||
+        (!transaction.tx_data && !transaction.rx_data)) {
+      return false;
+    }
+    transaction.next = nullptr;
+    uint32_t primask = __get_PRIMASK();
+    __disable_irq();
+    if (state_->tail) {
+      state_->tail->next = &transaction;
+    } else {
+      state_->head = &transaction;
+    }
+    state_->tail = &transaction;
+    state_->start_next();
+    __set_PRIMASK(primask);
+    return true;
+  }
+
+  // 転送して完了まで待つ。タイムアウトしたら転送を取り消す
+  bool transfer(SpiDevice &device, const uint8_t *tx_data, uint8_t *rx_data,
+                size_t size, uint32_t timeout) {
+    core::Notifier notifier;
+    notifier.reset();
+    SpiTransaction transaction{
+        .device = &device,
+        .tx_data = tx_data,
+        .rx_data = rx_data,
+        .size = size,
+        .callback =
+            [](void *context, bool success) {
+              static_cast<core::Notifier *>(context)->set(success ? 0x1
+                                                                  : 0x2);
+            },
+        .context = &notifier,
+    };
+    if (!submit(transaction)) {
+      return false;
+    }
+    uint32_t flags = notifier.wait(0x1 | 0x2, timeout);
+    if (flags == 0 && cancel(transaction)) {
+      return false;
+    }
+    // 取り消す前に完了していた場合
+    return notifier.wait(0x1 | 0x2, core::MAX_DELAY) == 0x1;
+  }
+
+  SpiStats get_stats() const {
+    uint32_t primask = __get_PRIMASK();
+    __disable_irq();
+    SpiStats stats = state_->stats;
+    __set_PRIMASK(primask);
+    stats.elapsed_cycles =
+        core::get_cycle_count64() - state_->stats_start_cycle;
+    return stats;
+  }
+
+  void reset_stats() {
+    uint32_t primask = __get_PRIMASK();
+    __disable_irq();
+    state_->stats = {};
+    state_->stats_start_cycle = core::get_cycle_count64();
+    __set_PRIMASK(primask);
+  }
+
+private:
+  std::unique_ptr<State> state_;
+
+  // キューから取り除くか、実行中なら中断する。もう完了していれば false
+  bool cancel(SpiTransaction &transaction) {
+    uint32_t primask = __get_PRIMASK();
+    __disable_irq();
+    SpiTransaction **link = &state_->head;
+    SpiTransaction *previous = nullptr;
+    while (*link && *link != &transaction) {
+      previous = *link;
+      link = &(*link)->next;
+    }
+    if (*link) {
+      *link = transaction.next;
+      if (state_->tail == &transaction) {
+        state_->tail = previous;
+      }
+      __set_PRIMASK(primask);
+      return true;
+    }
+    if (state_->current != &transaction) {
+      __set_PRIMASK(primask);
+      return false;
+    }
+    state_->current = nullptr;
+    state_->is_aborting = true;
+    __set_PRIMASK(primask);
+
+    HAL_SPI_Abort(Handle);
+    transaction.device->cs.write(1);
+
+    primask = __get_PRIMASK();
+    __disable_irq();
+    ++state_->stats.transaction_count;
+    ++state_->stats.error_count;
+    state_->stats.busy_cycles +=
+        core::get_cycle_count64() - state_->start_cycle;
+    state_->is_aborting = false;
+    state_->start_next();
+    __set_PRIMASK(primask);
+    return true;
+  }
+};
+
+#endif
+
+} // namespace halx::peripheral
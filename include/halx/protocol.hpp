@@ -0,0 +1,6 @@
+#pragma once
+
+#include "protocol/can_signal.hpp"
+#include "protocol/isotp.hpp"
+#include "protocol/motor_group.hpp"
+#include "protocol/time_sync.hpp"
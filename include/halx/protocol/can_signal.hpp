@@ -0,0 +1,213 @@
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <concepts>
+#include <cstddef>
+#include <cstdint>
+#include <type_traits>
+#include <utility>
+
+namespace halx::protocol {
+
+enum class CanByteOrder : uint8_t {
+  INTEL,
+  MOTOROLA,
+};
+
+/**
+ * DBC の信号定義と同じ形式の信号レイアウトです。
+ *
+ * - `start_bit`: DBC のスタートビット。INTEL (リトルエンディアン) は LSB、
+ *   MOTOROLA (ビッグエンディアン) は MSB の位置 (バイト番号 * 8 +
+ *   バイト内のビット番号)
+ * - `length`: ビット長 (1-57)
+ * - 物理値 = 生値 * `scale` + `offset`
+ */
+struct CanSignal {
+  uint16_t start_bit;
+  uint8_t length;
+  CanByteOrder byte_order = CanByteOrder::INTEL;
+  bool is_signed = false;
+  float scale = 1.0f;
+  float offset = 0.0f;
+};
+
+namespace detail {
+
+// 信号を含む8バイトの窓の先頭バイトと、窓を整数として読んだときの
+// 信号の LSB の位置。すべてコンパイル時に決まる
+template <CanSignal Signal> struct CanSignalLayout {
+  static_assert(Signal.length >= 1 && Signal.length <= 57);
+
+  static constexpr bool IS_INTEL = Signal.byte_order == CanByteOrder::INTEL;
+  static constexpr size_t FIRST_BYTE = Signal.start_bit / 8;
+  static constexpr size_t LSB_LINEAR_BIT =
+      FIRST_BYTE * 8 + (7 - Signal.start_bit % 8) + Signal.length - 1;
+  static constexpr uint32_t SHIFT =
+      IS_INTEL ? Signal.start_bit % 8
+               : 63 - (LSB_LINEAR_BIT - FIRST_BYTE * 8);
+  static constexpr uint64_t MASK = (uint64_t{1} << Signal.length) - 1;
+  static constexpr size_t LAST_BYTE = IS_INTEL ? (Signal.start_bit +
+                                                  Signal.length - 1) / 8
+                                               : LSB_LINEAR_BIT / 8;
+
+  static constexpr size_t SIZE = LAST_BYTE - FIRST_BYTE + 1;
+
+  static_assert(IS_INTEL || LSB_LINEAR_BIT - FIRST_BYTE * 8 <= 63);
+
+  // 窓の i バイト目の位置
+  static constexpr uint32_t byte_shift(size_t i) {
+    return IS_INTEL ? 8 * i : 56 - 8 * i;
+  }
+};
+
+// 信号を含むバイトだけを展開したシフトで読み書きする
+template <CanSignal Signal, size_t N>
+constexpr uint64_t load_can_signal_window(const std::array<uint8_t, N> &data) {
+  using Layout = CanSignalLayout<Signal>;
+  static_assert(Layout::LAST_BYTE < N);
+  return [&]<size_t... I>(std::index_sequence<I...>) {
+    return ((uint64_t{data[Layout::FIRST_BYTE + I]} << Layout::byte_shift(I)) |
+            ...);
+  }(std::make_index_sequence<Layout::SIZE>{});
+}
+
+template <CanSignal Signal, size_t N>
+constexpr void store_can_signal_window(std::array<uint8_t, N> &data,
+                                       uint64_t window) {
+  using Layout = CanSignalLayout<Signal>;
+  [&]<size_t... I>(std::index_sequence<I...>) {
+    ((data[Layout::FIRST_BYTE + I] =
+          static_cast<uint8_t>(window >> Layout::byte_shift(I))),
+     ...);
+  }(std::make_index_sequence<Layout::SIZE>{});
+}
+
+} // namespace detail
+
+template <CanSignal Signal, size_t N>
+constexpr uint64_t get_can_signal_raw(const std::array<uint8_t, N> &data) {
+  using Layout = detail::CanSignalLayout<Signal>;
+  return (detail::load_can_signal_window<Signal>(data) >> Layout::SHIFT) &
+         Layout::MASK;
+}
+
+template <CanSignal Signal, size_t N>
+constexpr void set_can_signal_raw(std::array<uint8_t, N> &data, uint64_t raw) {
+  using Layout = detail::CanSignalLayout<Signal>;
+  uint64_t window = 0;
+  // バイト境界にそろった信号は、残すビットがないので読み出さない
+  if constexpr (Signal.length != Layout::SIZE * 8) {
+    window = detail::load_can_signal_window<Signal>(data);
+    window &= ~(Layout::MASK << Layout::SHIFT);
+  }
+  window |= (raw & Layout::MASK) << Layout::SHIFT;
+  detail::store_can_signal_window<Signal>(data, window);
+}
+
+/**
+ * 信号の物理値を読み出します。`T` が整数型で `scale` が 1、`offset` が 0
+ * のときは浮動小数点演算を使いません。
+ */
+template <CanSignal Signal, class T = float, size_t N>
+constexpr T get_can_signal(const std::array<uint8_t, N> &data) {
+  uint64_t raw = get_can_signal_raw<Signal>(data);
+  int64_t value = raw;
+  if constexpr (Signal.is_signed) {
+    constexpr uint32_t SIGN_SHIFT = 64 - Signal.length;
+    value = static_cast<int64_t>(raw << SIGN_SHIFT) >> SIGN_SHIFT;
+  }
+  if constexpr (std::integral<T> && Signal.scale == 1.0f &&
+                Signal.offset == 0.0f) {
+    return static_cast<T>(value);
+  } else if constexpr (Signal.offset == 0.0f) {
+    // x + 0.0f は x が -0.0f のとき x にならないので、コンパイラーは
+    // 加算を省けない
+    return static_cast<T>(static_cast<float>(value) * Signal.scale);
+  } else {
+    return static_cast<T>(static_cast<float>(value) * Signal.scale +
+                          Signal.offset);
+  }
+}
+
+template <CanSignal Signal, class T, size_t N>
+constexpr void set_can_signal(std::array<uint8_t, N> &data, T value) {
+  int64_t raw;
+  if constexpr (std::integral<T> && Signal.scale == 1.0f &&
+                Signal.offset == 0.0f) {
+    raw = static_cast<int64_t>(value);
+  } else {
+    constexpr float INV_SCALE = 1.0f / Signal.scale;
+    float scaled = (static_cast<float>(value) - Signal.offset) * INV_SCALE;
+    raw = static_cast<int64_t>(scaled + (scaled < 0.0f ? -0.5f : 0.5f));
+  }
+  set_can_signal_raw<Signal>(data, static_cast<uint64_t>(raw));
+}
+
+template <auto Member, CanSignal Signal> struct CanField {};
+
+/**
+ * 構造体のメンバーと信号を対応付け、`pack` / `unpack` を生成します。
+ *
+ * @code{.cpp}
+ * using namespace halx::protocol;
+ *
+ * struct MotorFeedback {
+ *   float angle;
+ *   int16_t rpm;
+ *   float current;
+ *   uint8_t temperature;
+ * };
+ *
+ * using MotorFeedbackCodec = CanCodec<
+ *     MotorFeedback,
+ *     CanField<&MotorFeedback::angle,
+ *              CanSignal{.start_bit = 7,
+ *                        .length = 16,
+ *                        .byte_order = CanByteOrder::MOTOROLA,
+ *                        .scale = 360.0f / 8192}>,
+ *     CanField<&MotorFeedback::rpm,
+ *              CanSignal{.start_bit = 23,
+ *                        .length = 16,
+ *                        .byte_order = CanByteOrder::MOTOROLA,
+ *                        .is_signed = true}>,
+ *     CanField<&MotorFeedback::current,
+ *              CanSignal{.start_bit = 39,
+ *                        .length = 16,
+ *                        .byte_order = CanByteOrder::MOTOROLA,
+ *                        .is_signed = true,
+ *                        .scale = 20.0f / 16384}>,
+ *     CanField<&MotorFeedback::temperature,
+ *              CanSignal{.start_bit = 48, .length = 8}>>;
+ *
+ * MotorFeedback feedback = MotorFeedbackCodec::unpack(msg.data);
+ * @endcode
+ */
+template <class Struct, class... Fields> class CanCodec;
+
+template <class Struct, auto... Members, CanSignal... Signals>
+class CanCodec<Struct, CanField<Members, Signals>...> {
+public:
+  template <size_t N>
+  static constexpr Struct unpack(const std::array<uint8_t, N> &data) {
+    Struct value{};
+    ((value.*Members =
+          get_can_signal<Signals, MemberType<Members>>(data)),
+     ...);
+    return value;
+  }
+
+  template <size_t N>
+  static constexpr void pack(const Struct &value,
+                             std::array<uint8_t, N> &data) {
+    (set_can_signal<Signals>(data, value.*Members), ...);
+  }
+
+private:
+  template <auto Member>
+  using MemberType =
+      std::remove_cvref_t<decltype(std::declval<Struct &>().*Member)>;
+};
+
+} // namespace halx::protocol
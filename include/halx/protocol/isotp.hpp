@@ -0,0 +1,477 @@
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <optional>
+#include <span>
+#include <vector>
+
+#include "halx/core.hpp"
+#include "halx/peripheral/can/common.hpp"
+
+namespace halx::protocol {
+
+/**
+ * - `tx_id` / `rx_id`: 送信 / 受信に使う CAN ID
+ * - `fd`: CAN FD フレームを使う (FDCAN のみ)。`tx_dl` は 8, 12, 16, 20, 24,
+ *   32, 48, 64 のどれか
+ * - `block_size` / `st_min`: 受信側として相手に要求するブロックサイズと
+ *   フレーム間隔 (ISO 15765-2 の BS, STmin)
+ * - `padding`: フレームの空きを埋める値
+ * - `timeout`: フロー制御フレームを待つ時間 (N_Bs) [ms]
+ */
+struct IsoTpConfig {
+  uint32_t tx_id;
+  uint32_t rx_id;
+  bool ide = false;
+  bool fd = false;
+  bool brs = false;
+  uint8_t tx_dl = 8;
+  uint8_t block_size = 0;
+  uint8_t st_min = 0;
+  uint8_t padding = 0xCC;
+  uint32_t timeout = 1000;
+};
+
+/**
+ * ISO-TP (ISO 15765-2) で最大 `max_size` バイトのデータを送受信します。
+ * 受信は `CanBase::subscribe()` で登録するので、`start()` の前に構築して
+ * ください。登録できなかった (`start()` 後に構築した、`rx_id` が登録済み、
+ * bxCAN で `fd` を指定した、`tx_dl` が不正) 場合は `is_subscribed()` が
+ * false になり、送受信は失敗します。STmin が 0 のときは連続フレームを
+ * `transmit_burst()` でまとめて送信し、送信メールボックスを埋め続けます。
+ *
+ * 受信側のフロー制御フレームは、受信割り込みではなく `receive()` で待つ
+ * スレッドから送信します。複数フレームの受信では、相手のタイムアウト
+ * (N_Bs) までに `receive()` を呼んでください。
+ *
+ * @code{.cpp}
+ * #include <halx/core.hpp>
+ * #include <halx/peripheral.hpp>
+ * #include <halx/protocol.hpp>
+ *
+ * extern FDCAN_HandleTypeDef hfdcan1;
+ *
+ * extern "C" void main_thread(void *) {
+ *   using namespace halx::core;
+ *   using namespace halx::peripheral;
+ *   using namespace halx::protocol;
+ *
+ *   Can<&hfdcan1> can1;
+ *   IsoTp isotp(can1, {.tx_id = 0x7E0, .rx_id = 0x7E8});
+ *   if (!isotp.is_subscribed()) {
+ *     printf("rx_id is already subscribed\r\n");
+ *   }
+ *   can1.start();
+ *
+ *   // 2KB のテーブルを送信
+ *   std::array<uint8_t, 2048> table{};
+ *   isotp.send(table, 1000);
+ *
+ *   // 応答を受信
+ *   std::array<uint8_t, 4095> response;
+ *   if (auto size = isotp.receive(response, 1000)) {
+ *     printf("received: %d bytes\r\n", (int)*size);
+ *   }
+ * }
+ * @endcode
+ */
+class IsoTp {
+public:
+  IsoTp(peripheral::CanBase &can, const IsoTpConfig &config,
+        size_t max_size = 4095)
+      : can_{can}, config_{config}, rx_buffer_(max_size) {
+    if (config_.fd) {
+      // パディングで長さが変わると、受信側がパディングをデータとして読む
+      if (config_.tx_dl < 8 || config_.tx_dl > 64) {
+        return;
+      }
+      uint8_t dlc = peripheral::CAN_SIZE_TO_DLC[config_.tx_dl];
+      if (peripheral::CAN_DLC_TO_SIZE[dlc] != config_.tx_dl) {
+        return;
+      }
+      is_subscribed_ = can_.subscribe(
+          config_.rx_id, config_.ide,
+          [](void *context, const peripheral::CanFdMessage &msg) {
+            static_cast<IsoTp *>(context)->receive_frame(
+                {msg.data.data(), msg.dlc});
+          },
+          this);
+    } else {
+      config_.tx_dl = 8;
+      is_subscribed_ = can_.subscribe(
+          config_.rx_id, config_.ide,
+          [](void *context, const peripheral::CanMessage &msg) {
+            static_cast<IsoTp *>(context)->receive_frame(
+                {msg.data.data(), std::min<size_t>(msg.dlc, 8)});
+          },
+          this);
+    }
+  }
+
+  ~IsoTp() {
+    if (is_subscribed_) {
+      can_.unsubscribe(config_.rx_id, config_.ide);
+    }
+  }
+
+  IsoTp(const IsoTp &) = delete;
+  IsoTp &operator=(const IsoTp &) = delete;
+
+  bool is_subscribed() const { return is_subscribed_; }
+
+  bool send(std::span<const uint8_t> data, uint32_t timeout) {
+    // SF_DL = 0 は予約されている
+    if (!is_subscribed_ || data.empty()) {
+      return false;
+    }
+    Frame frame{};
+    if (data.size() <= 7) {
+      frame.data[0] = data.size();
+      std::copy(data.begin(), data.end(), frame.data.begin() + 1);
+      frame.size = 1 + data.size();
+      return transmit_frames({&frame, 1}, timeout);
+    }
+    // 8バイトを超えるフレームの単一フレームは長さを2バイト目に置く
+    if (config_.tx_dl > 8 && data.size() <= config_.tx_dl - 2u) {
+      frame.data[0] = 0x00;
+      frame.data[1] = data.size();
+      std::copy(data.begin(), data.end(), frame.data.begin() + 2);
+      frame.size = 2 + data.size();
+      return transmit_frames({&frame, 1}, timeout);
+    }
+
+    // 最初のフレーム。4095 バイトを超える場合は32bitの長さを使う
+    size_t header_size;
+    if (data.size() <= 0xFFF) {
+      frame.data[0] = 0x10 | (data.size() >> 8);
+      frame.data[1] = data.size() & 0xFF;
+      header_size = 2;
+    } else {
+      frame.data[0] = 0x10;
+      frame.data[1] = 0x00;
+      for (size_t i = 0; i < 4; ++i) {
+        frame.data[2 + i] = (data.size() >> (24 - 8 * i)) & 0xFF;
+      }
+      header_size = 6;
+    }
+    size_t offset = config_.tx_dl - header_size;
+    std::copy_n(data.begin(), offset, frame.data.begin() + header_size);
+    frame.size = config_.tx_dl;
+
+    fc_pending_.store(false, std::memory_order_relaxed);
+    tx_notifier_.reset();
+    if (!transmit_frames({&frame, 1}, timeout)) {
+      return false;
+    }
+
+    uint8_t sequence_number = 1;
+    while (offset < data.size()) {
+      auto flow_control = wait_flow_control();
+      if (!flow_control) {
+        return false;
+      }
+      size_t block_size = flow_control->block_size == 0
+                              ? SIZE_MAX
+                              : flow_control->block_size;
+      uint8_t st_min = flow_control->st_min;
+
+      std::array<Frame, BURST_SIZE> frames;
+      while (block_size > 0 && offset < data.size()) {
+        size_t count = 0;
+        size_t burst_size = st_min == 0 ? BURST_SIZE : 1;
+        while (count < burst_size && block_size > 0 && offset < data.size()) {
+          size_t size =
+              std::min<size_t>(config_.tx_dl - 1, data.size() - offset);
+          frames[count].data[0] = 0x20 | sequence_number;
+          std::copy_n(data.begin() + offset, size,
+                      frames[count].data.begin() + 1);
+          frames[count].size = 1 + size;
+          sequence_number = (sequence_number + 1) & 0xF;
+          offset += size;
+          --block_size;
+          ++count;
+        }
+        if (!transmit_frames({frames.data(), count}, timeout)) {
+          return false;
+        }
+        if (st_min != 0 && offset < data.size()) {
+          wait_st_min(st_min);
+        }
+      }
+    }
+    return true;
+  }
+
+  std::optional<size_t> receive(std::span<uint8_t> buffer, uint32_t timeout) {
+    if (!is_subscribed_) {
+      return std::nullopt;
+    }
+    rx_notifier_.reset();
+    while (true) {
+      transmit_pending_flow_control();
+      if (rx_ready_.load(std::memory_order_acquire)) {
+        break;
+      }
+      if (rx_notifier_.wait(RX_FLAG, timeout) == 0) {
+        return std::nullopt;
+      }
+      rx_notifier_.reset();
+    }
+    size_t size = rx_size_;
+    if (size > buffer.size()) {
+      rx_ready_.store(false, std::memory_order_release);
+      return std::nullopt;
+    }
+    std::copy_n(rx_buffer_.begin(), size, buffer.begin());
+    rx_ready_.store(false, std::memory_order_release);
+    return size;
+  }
+
+private:
+  static constexpr size_t BURST_SIZE = 4;
+  // 送信と受信を同じスレッドで待つこともあるので、別のフラグを使う
+  static constexpr uint32_t TX_FLAG = 0x1;
+  static constexpr uint32_t RX_FLAG = 0x2;
+
+  enum FlowStatus : uint8_t {
+    CONTINUE_TO_SEND = 0,
+    WAIT = 1,
+    OVERFLOW = 2,
+    // 送信待ちのフロー制御がない
+    NO_FLOW_CONTROL = 0xFF,
+  };
+
+  struct Frame {
+    std::array<uint8_t, 64> data;
+    uint8_t size;
+  };
+
+  struct FlowControl {
+    uint8_t flow_status;
+    uint8_t block_size;
+    uint8_t st_min;
+  };
+
+  peripheral::CanBase &can_;
+  IsoTpConfig config_;
+  bool is_subscribed_ = false;
+
+  core::Notifier tx_notifier_;
+  std::atomic<bool> fc_pending_{false};
+  std::atomic<uint32_t> fc_{0};
+
+  core::Notifier rx_notifier_;
+  std::atomic<uint8_t> fc_request_{NO_FLOW_CONTROL};
+  std::vector<uint8_t> rx_buffer_;
+  std::atomic<bool> rx_ready_{false};
+  bool rx_active_ = false;
+  size_t rx_size_ = 0;
+  size_t rx_offset_ = 0;
+  uint8_t rx_sequence_number_ = 0;
+  uint8_t rx_block_count_ = 0;
+
+  std::optional<FlowControl> wait_flow_control() {
+    while (true) {
+      while (!fc_pending_.exchange(false, std::memory_order_acquire)) {
+        if (tx_notifier_.wait(TX_FLAG, config_.timeout) == 0) {
+          return std::nullopt;
+        }
+        tx_notifier_.reset();
+      }
+      uint32_t fc = fc_.load(std::memory_order_relaxed);
+      FlowControl flow_control{
+          .flow_status = static_cast<uint8_t>(fc & 0xF),
+          .block_size = static_cast<uint8_t>(fc >> 8),
+          .st_min = static_cast<uint8_t>(fc >> 16),
+      };
+      if (flow_control.flow_status == CONTINUE_TO_SEND) {
+        return flow_control;
+      }
+      if (flow_control.flow_status != WAIT) {
+        return std::nullopt;
+      }
+    }
+  }
+
+  // STmin: 0x00-0x7F は ms、0xF1-0xF9 は 100-900us、それ以外は 127ms
+  static inline void wait_st_min(uint8_t st_min) {
+    if (st_min >= 0xF1 && st_min <= 0xF9) {
+      uint32_t cycles = (SystemCoreClock / 10000) * (st_min - 0xF0);
+      uint32_t start = core::get_cycle_count();
+      while (core::get_cycle_count() - start < cycles) {
+      }
+      return;
+    }
+    // ティックの途中から数えても STmin を下回らないように1ティック足す
+    core::delay((st_min <= 0x7F ? st_min : 0x7F) + 1);
+  }
+
+  void receive_frame(std::span<const uint8_t> data) {
+    if (data.empty()) {
+      return;
+    }
+    switch (data[0] >> 4) {
+    case 0x0:
+      receive_single_frame(data);
+      break;
+    case 0x1:
+      receive_first_frame(data);
+      break;
+    case 0x2:
+      receive_consecutive_frame(data);
+      break;
+    case 0x3:
+      if (data.size() >= 3) {
+        fc_.store((data[0] & 0xF) | (data[1] << 8) | (data[2] << 16),
+                  std::memory_order_relaxed);
+        fc_pending_.store(true, std::memory_order_release);
+        tx_notifier_.set(TX_FLAG);
+      }
+      break;
+    }
+  }
+
+  void receive_single_frame(std::span<const uint8_t> data) {
+    if (rx_ready_.load(std::memory_order_acquire)) {
+      return;
+    }
+    size_t size = data[0] & 0xF;
+    size_t offset = 1;
+    if (size == 0 && data.size() > 8) {
+      size = data[1];
+      offset = 2;
+    }
+    if (size == 0 || size > data.size() - offset || size > rx_buffer_.size()) {
+      return;
+    }
+    std::copy_n(data.begin() + offset, size, rx_buffer_.begin());
+    rx_active_ = false;
+    complete_receive(size);
+  }
+
+  void receive_first_frame(std::span<const uint8_t> data) {
+    if (rx_ready_.load(std::memory_order_acquire) || data.size() < 8) {
+      return;
+    }
+    size_t size = ((data[0] & 0xF) << 8) | data[1];
+    size_t offset = 2;
+    if (size == 0) {
+      size = (data[2] << 24) | (data[3] << 16) | (data[4] << 8) | data[5];
+      offset = 6;
+      // 4095 バイト以下は 12bit の長さで送られる
+      if (size <= 0xFFF) {
+        return;
+      }
+    }
+    // 最初のフレームに収まる長さなら単一フレームで送られるはず
+    if (size <= data.size() - offset) {
+      return;
+    }
+    if (size > rx_buffer_.size()) {
+      transmit_flow_control(OVERFLOW);
+      return;
+    }
+    rx_offset_ = std::min(size, data.size() - offset);
+    std::copy_n(data.begin() + offset, rx_offset_, rx_buffer_.begin());
+    rx_size_ = size;
+    rx_sequence_number_ = 1;
+    rx_block_count_ = 0;
+    rx_active_ = true;
+    transmit_flow_control(CONTINUE_TO_SEND);
+  }
+
+  void receive_consecutive_frame(std::span<const uint8_t> data) {
+    if (!rx_active_) {
+      return;
+    }
+    if ((data[0] & 0xF) != rx_sequence_number_) {
+      rx_active_ = false;
+      return;
+    }
+    size_t size = std::min(rx_size_ - rx_offset_, data.size() - 1);
+    std::copy_n(data.begin() + 1, size, rx_buffer_.begin() + rx_offset_);
+    rx_offset_ += size;
+    rx_sequence_number_ = (rx_sequence_number_ + 1) & 0xF;
+    if (rx_offset_ == rx_size_) {
+      rx_active_ = false;
+      complete_receive(rx_size_);
+    } else if (config_.block_size != 0 &&
+               ++rx_block_count_ == config_.block_size) {
+      rx_block_count_ = 0;
+      transmit_flow_control(CONTINUE_TO_SEND);
+    }
+  }
+
+  void complete_receive(size_t size) {
+    rx_size_ = size;
+    rx_ready_.store(true, std::memory_order_release);
+    rx_notifier_.set(RX_FLAG);
+  }
+
+  // 受信割り込みで送信すると、スレッドからの送信と同じ送信メールボックス
+  // を取り合ってどちらかが失われるので、`receive()` のスレッドに任せる
+  void transmit_flow_control(FlowStatus flow_status) {
+    fc_request_.store(flow_status, std::memory_order_release);
+    rx_notifier_.set(RX_FLAG);
+  }
+
+  void transmit_pending_flow_control() {
+    uint8_t flow_status =
+        fc_request_.exchange(NO_FLOW_CONTROL, std::memory_order_acquire);
+    if (flow_status == NO_FLOW_CONTROL) {
+      return;
+    }
+    Frame frame{};
+    frame.data[0] = 0x30 | flow_status;
+    frame.data[1] = config_.block_size;
+    frame.data[2] = config_.st_min;
+    frame.size = 3;
+    transmit_frames({&frame, 1}, config_.timeout);
+  }
+
+  bool transmit_frames(std::span<Frame> frames, uint32_t timeout) {
+    for (auto &frame : frames) {
+      size_t size = std::max<size_t>(frame.size, 8);
+      if (config_.fd) {
+        size = peripheral::CAN_DLC_TO_SIZE[peripheral::CAN_SIZE_TO_DLC[size]];
+      }
+      std::fill(frame.data.begin() + frame.size, frame.data.begin() + size,
+                config_.padding);
+      frame.size = size;
+    }
+    if (config_.fd) {
+      std::array<peripheral::CanFdMessage, BURST_SIZE> msgs;
+      for (size_t i = 0; i < frames.size(); ++i) {
+        msgs[i] = {
+            .id = config_.tx_id,
+            .ide = config_.ide,
+            .brs = config_.brs,
+            .dlc = frames[i].size,
+            .data = frames[i].data,
+            .timestamp = 0,
+        };
+      }
+      return can_.transmit_burst({msgs.data(), frames.size()}, timeout) ==
+             frames.size();
+    }
+    std::array<peripheral::CanMessage, BURST_SIZE> msgs;
+    for (size_t i = 0; i < frames.size(); ++i) {
+      msgs[i] = {
+          .id = config_.tx_id,
+          .ide = config_.ide,
+          .dlc = frames[i].size,
+          .data = {},
+          .timestamp = 0,
+      };
+      std::copy_n(frames[i].data.begin(), 8, msgs[i].data.begin());
+    }
+    return can_.transmit_burst({msgs.data(), frames.size()}, timeout) ==
+           frames.size();
+  }
+};
+
+} // namespace halx::protocol
@@ -0,0 +1,265 @@
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <optional>
+#include <span>
+#include <vector>
+
+#include "halx/core.hpp"
+#include "halx/peripheral/can/common.hpp"
+
+namespace halx::protocol {
+
+/**
+ * モーター1つ分の CAN の割り当てです。指令値は ID `command_id` のフレームの
+ * `command_slot` 番目 (0-3) の 2 バイトにビッグエンディアンで入れ、
+ * フィードバックは ID `feedback_id` で受信します。
+ */
+struct MotorConfig {
+  uint32_t command_id;
+  uint8_t command_slot;
+  uint32_t feedback_id;
+};
+
+// C620 (M3508) / C610 (M2006) の ESC ID (1-8) の割り当て
+inline constexpr MotorConfig make_dji_c620_motor(uint8_t esc_id) {
+  return {
+      .command_id = esc_id <= 4 ? 0x200u : 0x1FFu,
+      .command_slot = static_cast<uint8_t>((esc_id - 1) % 4),
+      .feedback_id = 0x200u + esc_id,
+  };
+}
+
+// GM6020 の ID (1-7) の割り当て (電圧指令)
+inline constexpr MotorConfig make_dji_gm6020_motor(uint8_t id) {
+  return {
+      .command_id = id <= 4 ? 0x1FFu : 0x2FFu,
+      .command_slot = static_cast<uint8_t>((id - 1) % 4),
+      .feedback_id = 0x204u + id,
+  };
+}
+
+/**
+ * モーターのフィードバックです。
+ *
+ * - `angle`: 1回転内の角度 (0-8191)
+ * - `position`: `angle` の回転をまたいで積算した角度 (8192 で1回転)
+ * - `rpm`: 回転数 [rpm]
+ * - `current`: トルク電流の値
+ * - `temperature`: 温度 [℃]
+ * - `timestamp`: 受信時刻 (`CanMessage::timestamp` と同じ)
+ */
+struct MotorFeedback {
+  uint16_t angle;
+  int64_t position;
+  int16_t rpm;
+  int16_t current;
+  uint8_t temperature;
+  uint64_t timestamp;
+};
+
+/**
+ * DJI 形式の CAN モーターをまとめて扱います。指令値は同じ ID のフレーム
+ * (4台分) にまとめて送信し、フィードバックは CAN ドライバのディスパッチ表
+ * (`CanBase::subscribe()`) で受け取って、モーターごとの最新値を保持します。
+ * 16台なら1周期で送信するフレームは4つです。
+ *
+ * `start()` 前に作ってください。`start()` 後に作った場合や、フィードバックの
+ * ID が重なる (C620 の 5-8 と GM6020 の 1-4 など) 場合は受信を登録できず、
+ * そのモーターは `is_subscribed()` が false になります。同様に
+ * `command_slot` が 0-3 でないか、先のモーターと `command_id` と
+ * `command_slot` が重なる場合は `has_command_slot()` が false になり、
+ * `set_command()` が失敗します。
+ *
+ * @code{.cpp}
+ * #include <cstdio>
+ * #include <halx/core.hpp>
+ * #include <halx/peripheral.hpp>
+ * #include <halx/protocol.hpp>
+ *
+ * extern CAN_HandleTypeDef hcan1;
+ *
+ * extern "C" void main_thread(void *) {
+ *   using namespace halx::core;
+ *   using namespace halx::peripheral;
+ *   using namespace halx::protocol;
+ *
+ *   Can<&hcan1> can1;
+ *
+ *   std::array<MotorConfig, 4> motors{
+ *       make_dji_c620_motor(1), make_dji_c620_motor(2),
+ *       make_dji_c620_motor(3), make_dji_c620_motor(4)};
+ *   MotorGroup group(can1, motors);
+ *   for (size_t i = 0; i < group.size(); ++i) {
+ *     if (!group.is_subscribed(i)) {
+ *       printf("motor %d: feedback id is already used\r\n", (int)i);
+ *     }
+ *   }
+ *   can1.start();
+ *
+ *   uint32_t tick = get_tick();
+ *   while (true) {
+ *     for (size_t i = 0; i < group.size(); ++i) {
+ *       if (auto feedback = group.get_feedback(i)) {
+ *         int16_t command = -feedback->rpm * 5;
+ *         group.set_command(i, command);
+ *       }
+ *     }
+ *     group.transmit(1);
+ *     delay_until(++tick);
+ *   }
+ * }
+ * @endcode
+ */
+class MotorGroup {
+public:
+  MotorGroup(peripheral::CanBase &can, std::span<const MotorConfig> configs)
+      : can_{can}, motors_(configs.size()) {
+    for (size_t i = 0; i < configs.size(); ++i) {
+      auto &motor = motors_[i];
+      motor.config = configs[i];
+      motor.is_subscribed = can_.subscribe(
+          configs[i].feedback_id, false,
+          [](void *context, const peripheral::CanMessage &msg) {
+            static_cast<Motor *>(context)->receive(msg);
+          },
+          &motor);
+      bool is_duplicate = std::any_of(
+          motors_.begin(), motors_.begin() + i, [&](const Motor &other) {
+            return other.has_command_slot &&
+                   other.config.command_id == configs[i].command_id &&
+                   other.config.command_slot == configs[i].command_slot;
+          });
+      if (configs[i].command_slot > 3 || is_duplicate) {
+        continue;
+      }
+      auto frame = std::find_if(
+          frames_.begin(), frames_.end(),
+          [&](const peripheral::CanMessage &frame) {
+            return frame.id == configs[i].command_id;
+          });
+      if (frame == frames_.end()) {
+        frames_.push_back({
+            .id = configs[i].command_id,
+            .ide = false,
+            .dlc = 8,
+            .data = {},
+            .timestamp = 0,
+        });
+        frame = frames_.end() - 1;
+      }
+      motor.frame_index = frame - frames_.begin();
+      motor.has_command_slot = true;
+    }
+  }
+
+  ~MotorGroup() {
+    for (const auto &motor : motors_) {
+      if (motor.is_subscribed) {
+        can_.unsubscribe(motor.config.feedback_id, false);
+      }
+    }
+  }
+
+  MotorGroup(const MotorGroup &) = delete;
+  MotorGroup &operator=(const MotorGroup &) = delete;
+
+  size_t size() const { return motors_.size(); }
+
+  // フィードバックの受信を登録できたか。false のモーターは
+  // `get_feedback()` / `is_online()` が常に失敗する
+  bool is_subscribed(size_t index) const {
+    return index < motors_.size() && motors_[index].is_subscribed;
+  }
+
+  // 指令値を送るスロットを割り当てられたか。false のモーターは
+  // `set_command()` が常に失敗する
+  bool has_command_slot(size_t index) const {
+    return index < motors_.size() && motors_[index].has_command_slot;
+  }
+
+  // 次の transmit() で送信する指令値を設定する
+  bool set_command(size_t index, int16_t command) {
+    if (!has_command_slot(index)) {
+      return false;
+    }
+    const auto &motor = motors_[index];
+    auto &data = frames_[motor.frame_index].data;
+    data[motor.config.command_slot * 2] = static_cast<uint16_t>(command) >> 8;
+    data[motor.config.command_slot * 2 + 1] = static_cast<uint8_t>(command);
+    return true;
+  }
+
+  // 全モーターの指令値を送信する
+  bool transmit(uint32_t timeout) {
+    return can_.transmit_burst(frames_, timeout) == frames_.size();
+  }
+
+  // 一度もフィードバックを受信していなければ std::nullopt
+  std::optional<MotorFeedback> get_feedback(size_t index) const {
+    if (index >= motors_.size() ||
+        !motors_[index].has_feedback.load(std::memory_order_acquire)) {
+      return std::nullopt;
+    }
+    return motors_[index].feedback.load();
+  }
+
+  // 直近 `timeout` [ms] 以内にフィードバックを受信したか
+  bool is_online(size_t index, uint32_t timeout = 100) const {
+    if (index >= motors_.size() ||
+        !motors_[index].has_feedback.load(std::memory_order_acquire)) {
+      return false;
+    }
+    uint32_t last_tick =
+        motors_[index].last_tick.load(std::memory_order_relaxed);
+    return core::get_tick() - last_tick < timeout;
+  }
+
+private:
+  struct Motor {
+    MotorConfig config{};
+    size_t frame_index = 0;
+    bool is_subscribed = false;
+    bool has_command_slot = false;
+    core::SeqLock<MotorFeedback> feedback;
+    std::atomic<bool> has_feedback{false};
+    std::atomic<uint32_t> last_tick{0};
+    // 以下は受信割り込みからのみ使う
+    MotorFeedback last_feedback{};
+
+    void receive(const peripheral::CanMessage &msg) {
+      if (msg.dlc < 7) {
+        return;
+      }
+      uint16_t angle = ((msg.data[0] << 8) | msg.data[1]) & 0x1FFF;
+      int64_t position = angle;
+      if (has_feedback.load(std::memory_order_relaxed)) {
+        // 前回からの変化を -4096 から 4095 の範囲に折り返して積算する
+        int32_t delta = angle - last_feedback.angle;
+        delta = ((delta + 4096) & 0x1FFF) - 4096;
+        position = last_feedback.position + delta;
+      }
+      last_feedback = {
+          .angle = angle,
+          .position = position,
+          .rpm = static_cast<int16_t>((msg.data[2] << 8) | msg.data[3]),
+          .current = static_cast<int16_t>((msg.data[4] << 8) | msg.data[5]),
+          .temperature = msg.data[6],
+          .timestamp = msg.timestamp,
+      };
+      feedback.store(last_feedback);
+      last_tick.store(core::get_tick(), std::memory_order_relaxed);
+      has_feedback.store(true, std::memory_order_release);
+    }
+  };
+
+  peripheral::CanBase &can_;
+  std::vector<Motor> motors_;
+  std::vector<peripheral::CanMessage> frames_;
+};
+
+} // namespace halx::protocol
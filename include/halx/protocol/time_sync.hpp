@@ -0,0 +1,335 @@
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <optional>
+
+#include "halx/core/seq_lock.hpp"
+#include "halx/peripheral/can/common.hpp"
+
+namespace halx::protocol {
+
+/**
+ * 時刻同期の設定です。
+ *
+ * - `sync_id` / `follow_up_id`: SYNC / FOLLOW_UP フレームの ID。SYNC は
+ *   調停で待たされないように優先度の高い(小さい) ID にしてください
+ * - `clock_frequency`: CAN のタイムスタンプと `get_clock()` の周波数 [Hz]。
+ *   実機では `SystemCoreClock`、`get_clock` は `core::get_cycle_count64`
+ */
+struct TimeSyncConfig {
+  uint32_t sync_id;
+  uint32_t follow_up_id;
+  bool ide = false;
+  uint32_t clock_frequency;
+  uint64_t (*get_clock)();
+};
+
+namespace detail {
+
+inline uint64_t to_nanoseconds(uint64_t clock, uint32_t clock_frequency) {
+  return clock / clock_frequency * 1000000000 +
+         clock % clock_frequency * 1000000000 / clock_frequency;
+}
+
+} // namespace detail
+
+/**
+ * 時刻同期のマスターです。`sync()` を呼ぶたびに SYNC フレームを送信し、
+ * 次の `sync()` でその SYNC を実際に送信した時刻(送信完了のタイムスタンプ)
+ * を FOLLOW_UP フレームで送信します(gPTP の2ステップ方式)。SYNC の送信が
+ * 調停で遅れても、スレーブは SYNC を受信した時刻と対応付けられます。
+ *
+ * `CanBase::attach_tx_callback()` を使用します。登録できなかった場合は
+ * `is_attached()` が false になり、`sync()` は失敗します。
+ *
+ * @code{.cpp}
+ * #include <halx/core.hpp>
+ * #include <halx/peripheral.hpp>
+ * #include <halx/protocol.hpp>
+ *
+ * extern FDCAN_HandleTypeDef hfdcan1;
+ *
+ * extern "C" void main_thread(void *) {
+ *   using namespace halx::core;
+ *   using namespace halx::peripheral;
+ *   using namespace halx::protocol;
+ *
+ *   enable_cycle_counter();
+ *   Can<&hfdcan1> can1;
+ *   TimeSyncConfig config{
+ *       .sync_id = 0x080,
+ *       .follow_up_id = 0x081,
+ *       .clock_frequency = SystemCoreClock,
+ *       .get_clock = get_cycle_count64,
+ *   };
+ *
+ *   // マスター
+ *   TimeSyncMaster master(can1, config);
+ *   can1.start();
+ *   uint32_t tick = get_tick();
+ *   while (true) {
+ *     master.sync(1);
+ *     delay_until(tick += 100);
+ *   }
+ *
+ *   // スレーブ (start() 前に作る)
+ *   // TimeSyncSlave slave(can1, config);
+ *   // if (!slave.is_subscribed()) { ... }
+ *   // can1.start();
+ *   // ...
+ *   // if (auto time = slave.get_time()) { ... } // マスターの時刻 [ns]
+ * }
+ * @endcode
+ */
+class TimeSyncMaster {
+public:
+  TimeSyncMaster(peripheral::CanBase &can, const TimeSyncConfig &config)
+      : can_{can}, config_{config} {
+    tx_callback_index_ = can_.attach_tx_callback(
+        [](void *context, const peripheral::CanTxEvent &event) {
+          auto *self = static_cast<TimeSyncMaster *>(context);
+          if (event.id == self->config_.sync_id &&
+              event.ide == self->config_.ide) {
+            self->tx_timestamp_ = event.timestamp;
+            self->has_tx_timestamp_.store(true, std::memory_order_release);
+          }
+        },
+        this);
+  }
+
+  ~TimeSyncMaster() {
+    if (tx_callback_index_) {
+      can_.detach_tx_callback(*tx_callback_index_);
+    }
+  }
+
+  TimeSyncMaster(const TimeSyncMaster &) = delete;
+  TimeSyncMaster &operator=(const TimeSyncMaster &) = delete;
+
+  bool is_attached() const { return tx_callback_index_.has_value(); }
+
+  // 前回の SYNC の FOLLOW_UP と、新しい SYNC を送信する。周期的に呼ぶ
+  bool sync(uint32_t timeout) {
+    if (!tx_callback_index_) {
+      return false;
+    }
+    if (has_tx_timestamp_.exchange(false, std::memory_order_acquire)) {
+      uint64_t time =
+          detail::to_nanoseconds(tx_timestamp_, config_.clock_frequency);
+      peripheral::CanMessage follow_up{
+          .id = config_.follow_up_id,
+          .ide = config_.ide,
+          .dlc = 8,
+          .data = {sequence_},
+          .timestamp = 0,
+      };
+      for (size_t i = 1; i < follow_up.data.size(); ++i) {
+        follow_up.data[i] = time >> (8 * (i - 1));
+      }
+      if (!can_.transmit(follow_up, timeout)) {
+        return false;
+      }
+    }
+    peripheral::CanMessage sync{
+        .id = config_.sync_id,
+        .ide = config_.ide,
+        .dlc = 1,
+        .data = {++sequence_},
+        .timestamp = 0,
+    };
+    return can_.transmit(sync, timeout);
+  }
+
+  // マスターの時刻 [ns]
+  uint64_t get_time() const {
+    return detail::to_nanoseconds(config_.get_clock(),
+                                  config_.clock_frequency);
+  }
+
+private:
+  peripheral::CanBase &can_;
+  TimeSyncConfig config_;
+  std::optional<size_t> tx_callback_index_;
+  uint8_t sequence_ = 0;
+  uint64_t tx_timestamp_ = 0;
+  std::atomic<bool> has_tx_timestamp_{false};
+};
+
+/**
+ * 時刻同期のスレーブです。SYNC を受信した時刻(自分の時計)と FOLLOW_UP の
+ * マスターの送信時刻の組から、自分の時計とマスターの時刻の対応(オフセット
+ * と時計の速さの比)を推定し、マスターの時刻を返します。
+ *
+ * SYNC の送受信時刻にハードウェアタイムスタンプ (FDCAN、bxCAN の TTCM) を
+ * 使えれば、誤差は時計の分解能とドリフト程度に収まります。使えない場合は
+ * 割り込み応答のばらつきが誤差になります。
+ *
+ * 受信コールバックで更新し、`get_time()` / `to_master_time()` はシーケンス
+ * ロックで読むので、スレッドから呼び出せます(CAN の受信割り込みより優先度
+ * の高い割り込みからは呼ばないでください)。
+ */
+class TimeSyncSlave {
+public:
+  TimeSyncSlave(peripheral::CanBase &can, const TimeSyncConfig &config)
+      : can_{can}, config_{config},
+        nominal_rate_{1e9 / static_cast<double>(config.clock_frequency)} {
+    if (!can_.subscribe(
+            config_.sync_id, config_.ide,
+            [](void *context, const peripheral::CanMessage &msg) {
+              static_cast<TimeSyncSlave *>(context)->receive_sync(msg);
+            },
+            this)) {
+      return;
+    }
+    if (!can_.subscribe(
+            config_.follow_up_id, config_.ide,
+            [](void *context, const peripheral::CanMessage &msg) {
+              static_cast<TimeSyncSlave *>(context)->receive_follow_up(msg);
+            },
+            this)) {
+      can_.unsubscribe(config_.sync_id, config_.ide);
+      return;
+    }
+    is_subscribed_ = true;
+  }
+
+  ~TimeSyncSlave() {
+    if (is_subscribed_) {
+      can_.unsubscribe(config_.sync_id, config_.ide);
+      can_.unsubscribe(config_.follow_up_id, config_.ide);
+    }
+  }
+
+  TimeSyncSlave(const TimeSyncSlave &) = delete;
+  TimeSyncSlave &operator=(const TimeSyncSlave &) = delete;
+
+  // SYNC と FOLLOW_UP を受信できるか。start() 後に作った場合や、ID が
+  // 登録済みの場合は false で、同期しない
+  bool is_subscribed() const { return is_subscribed_; }
+
+  bool is_synchronized() const { return read_anchor().has_value(); }
+
+  // マスターの時刻 [ns]。同期前は std::nullopt
+  std::optional<uint64_t> get_time() const {
+    return to_master_time(config_.get_clock());
+  }
+
+  // 自分の時計の値 (受信フレームのタイムスタンプなど) をマスターの時刻に
+  // 変換する
+  std::optional<uint64_t> to_master_time(uint64_t clock) const {
+    auto anchor = read_anchor();
+    if (!anchor) {
+      return std::nullopt;
+    }
+    double elapsed =
+        static_cast<double>(static_cast<int64_t>(clock - anchor->clock));
+    return anchor->time + static_cast<int64_t>(elapsed * anchor->rate);
+  }
+
+  // 直近の FOLLOW_UP で、推定したマスターの時刻と実際の時刻の差 [ns]
+  int32_t get_offset_error() const {
+    return offset_error_.load(std::memory_order_relaxed);
+  }
+
+private:
+  // これより大きくずれたら推定をやり直す [ns]
+  static constexpr int64_t RESYNC_THRESHOLD = 1000000;
+  // 時計の速さの比を更新するときの重み
+  static constexpr double RATE_GAIN = 0.25;
+
+  static constexpr size_t SYNC_HISTORY_SIZE = 4;
+
+  struct SyncRecord {
+    uint8_t sequence;
+    uint64_t clock;
+    bool valid;
+  };
+
+  struct Anchor {
+    uint64_t time;  // マスターの時刻 [ns]
+    uint64_t clock; // そのときの自分の時計の値
+    double rate;    // 自分の時計 1 カウントあたりのマスターの時間 [ns]
+    uint32_t pair_count;
+  };
+
+  peripheral::CanBase &can_;
+  TimeSyncConfig config_;
+  double nominal_rate_;
+  bool is_subscribed_ = false;
+  // 以下は受信割り込みからのみ書き込む。SYNC は FOLLOW_UP より ID が小さく
+  // 調停で先に送信されるので、次の SYNC の後に前の FOLLOW_UP が届くことがある。
+  // そのため直近の SYNC をいくつか覚えておく
+  std::array<SyncRecord, SYNC_HISTORY_SIZE> sync_records_{};
+  core::SeqLock<Anchor> anchor_;
+  std::atomic<int32_t> offset_error_{0};
+
+  void receive_sync(const peripheral::CanMessage &msg) {
+    if (msg.dlc < 1) {
+      return;
+    }
+    sync_records_[msg.data[0] % SYNC_HISTORY_SIZE] = {
+        .sequence = msg.data[0],
+        .clock = msg.timestamp,
+        .valid = true,
+    };
+  }
+
+  void receive_follow_up(const peripheral::CanMessage &msg) {
+    if (msg.dlc < 8) {
+      return;
+    }
+    auto &sync_record = sync_records_[msg.data[0] % SYNC_HISTORY_SIZE];
+    if (!sync_record.valid || sync_record.sequence != msg.data[0]) {
+      return;
+    }
+    sync_record.valid = false;
+    uint64_t time = 0;
+    for (size_t i = 1; i < msg.data.size(); ++i) {
+      time |= static_cast<uint64_t>(msg.data[i]) << (8 * (i - 1));
+    }
+    update(time, sync_record.clock);
+  }
+
+  void update(uint64_t time, uint64_t clock) {
+    Anchor last_anchor = anchor_.load();
+    Anchor anchor{
+        .time = time,
+        .clock = clock,
+        .rate = nominal_rate_,
+        .pair_count = 1,
+    };
+    if (last_anchor.pair_count > 0) {
+      double elapsed = static_cast<double>(clock - last_anchor.clock);
+      int64_t predicted =
+          last_anchor.time + static_cast<int64_t>(elapsed * last_anchor.rate);
+      int64_t error = predicted - static_cast<int64_t>(time);
+      offset_error_.store(static_cast<int32_t>(std::clamp<int64_t>(
+                              error, INT32_MIN, INT32_MAX)),
+                          std::memory_order_relaxed);
+      if (error <= RESYNC_THRESHOLD && error >= -RESYNC_THRESHOLD &&
+          clock != last_anchor.clock) {
+        double rate = static_cast<double>(time - last_anchor.time) / elapsed;
+        anchor.rate =
+            last_anchor.pair_count == 1
+                ? rate
+                : last_anchor.rate + (rate - last_anchor.rate) * RATE_GAIN;
+        anchor.pair_count = last_anchor.pair_count + 1;
+      }
+    }
+    anchor_.store(anchor);
+  }
+
+  std::optional<Anchor> read_anchor() const {
+    Anchor anchor = anchor_.load();
+    if (anchor.pair_count < 2) {
+      return std::nullopt;
+    }
+    return anchor;
+  }
+};
+
+} // namespace halx::protocol
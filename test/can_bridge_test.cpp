@@ -0,0 +1,84 @@
+#include <cstdint>
+
+#include <halx/peripheral/can/bridge.hpp>
+#include <halx/peripheral/can/virtual_can.hpp>
+
+#include "check.hpp"
+
+using namespace halx::peripheral;
+
+namespace {
+
+// bxCAN のように CAN FD を送信できないノード
+class ClassicCan : public VirtualCan {
+public:
+  using VirtualCan::VirtualCan;
+
+  bool supports_fd() const override { return false; }
+};
+
+void count(void *context, const CanMessage &) {
+  ++*static_cast<uint32_t *>(context);
+}
+
+CanBridgeRule make_rule(uint32_t id, bool fd) {
+  return {.filter = {.id = id, .mask = 0x7FF, .ide = false, .fifo = 0},
+          .rewrite_id = 0x400,
+          .rewrite_mask = 0x700,
+          .ide = false,
+          .fd = fd,
+          .brs = false};
+}
+
+void test_reject_fd_rule() {
+  VirtualCanBus bus_a(1000000);
+  VirtualCanBus bus_b(1000000);
+  VirtualCan can_a(bus_a);
+  ClassicCan can_b(bus_b);
+  CanBridge bridge(can_a, can_b, 4);
+  // クラシック CAN に CAN FD で転送するルールは追加できない
+  CHECK(!bridge.add_rule(CanBridgeDirection::A_TO_B, make_rule(0x100, true)));
+  CHECK(bridge.add_rule(CanBridgeDirection::B_TO_A, make_rule(0x100, true)));
+  CHECK(bridge.add_rule(CanBridgeDirection::A_TO_B, make_rule(0x100, false)));
+}
+
+void test_forward() {
+  VirtualCanBus bus_a(1000000);
+  VirtualCanBus bus_b(1000000);
+  VirtualCan can_a(bus_a);
+  ClassicCan can_b(bus_b);
+  VirtualCan sender(bus_a);
+  VirtualCan receiver(bus_b);
+  CanBridge bridge(can_a, can_b, 4);
+  CHECK(bridge.add_rule(CanBridgeDirection::A_TO_B, make_rule(0x120, false)));
+  uint32_t rx_count = 0;
+  CHECK(receiver.subscribe(0x420, false, count, &rx_count));
+  for (auto *can : {&can_a, static_cast<VirtualCan *>(&can_b), &sender,
+                    &receiver}) {
+    can->start();
+  }
+
+  CanMessage msg{.id = 0x120, .ide = false, .dlc = 8, .data = {},
+                 .timestamp = 0};
+  for (uint32_t i = 0; i < 3; ++i) {
+    CHECK(sender.transmit(msg, 0));
+    bus_a.run();
+    CHECK(bridge.forward(0) == 1);
+    bus_b.run();
+  }
+  CHECK(rx_count == 3);
+  auto stats = bridge.get_stats(CanBridgeDirection::A_TO_B);
+  CHECK(stats.forwarded_count == 3);
+  CHECK(stats.drop_count == 0 && stats.reject_count == 0);
+  CHECK(stats.average_latency <= stats.max_latency);
+  // 同じスレッドですぐに転送するので、遅延は 1 秒よりずっと短い
+  CHECK(stats.max_latency < SystemCoreClock);
+}
+
+} // namespace
+
+int main() {
+  test_reject_fd_rule();
+  test_forward();
+  return check_result();
+}
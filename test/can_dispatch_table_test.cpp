@@ -0,0 +1,95 @@
+#include <cstdint>
+
+#include <halx/peripheral/can/common.hpp>
+#include <halx/peripheral/can/dispatch_table.hpp>
+
+#include "check.hpp"
+
+using namespace halx::peripheral;
+
+namespace {
+
+void count(void *context, const CanMessage &) {
+  ++*static_cast<uint32_t *>(context);
+}
+
+CanMessage make_message(uint32_t id, bool ide) {
+  return {.id = id, .ide = ide, .dlc = 0, .data = {}, .timestamp = 0};
+}
+
+void test_dispatch() {
+  CanDispatchTable<CanMessage> table;
+  uint32_t std_count = 0;
+  uint32_t ext_count = 0;
+  for (uint32_t id = 0x100; id < 0x400; ++id) {
+    CHECK(table.subscribe(id, false, count, &std_count));
+  }
+  for (uint32_t i = 0; i < 300; ++i) {
+    CHECK(table.subscribe(0x18FF0000 + 7 * i, true, count, &ext_count));
+  }
+  CHECK(!table.subscribe(0x100, false, count, &std_count));
+  CHECK(!table.subscribe(0x800, false, count, &std_count));
+  CHECK(!table.subscribe(0x20000000, true, count, &ext_count));
+  CHECK(!table.subscribe(0x500, false, nullptr, nullptr));
+
+  // build() 前は何も呼ばない
+  CHECK(!table.dispatch(make_message(0x100, false)));
+  table.build();
+  CHECK(table.dispatch(make_message(0x100, false)));
+  CHECK(table.dispatch(make_message(0x3FF, false)));
+  CHECK(!table.dispatch(make_message(0x400, false)));
+  CHECK(table.dispatch(make_message(0x18FF0000 + 7 * 299, true)));
+  CHECK(!table.dispatch(make_message(0x18FF0001, true)));
+  // 標準 ID と拡張 ID は区別する
+  CHECK(!table.dispatch(make_message(0x100, true)));
+  CHECK(std_count == 2 && ext_count == 1);
+}
+
+void test_modify_while_built() {
+  CanDispatchTable<CanMessage> table;
+  uint32_t rx_count = 0;
+  CHECK(table.subscribe(0x201, false, count, &rx_count));
+  CHECK(table.subscribe(0x202, false, count, &rx_count));
+  CHECK(table.subscribe(0x1000, true, count, &rx_count));
+  table.build();
+
+  // 通信中は追加できず、削除はその ID だけを無効にする
+  CHECK(!table.subscribe(0x203, false, count, &rx_count));
+  CHECK(table.unsubscribe(0x201, false));
+  CHECK(!table.unsubscribe(0x201, false));
+  CHECK(table.unsubscribe(0x1000, true));
+  CHECK(!table.dispatch(make_message(0x201, false)));
+  CHECK(!table.contains(0x201, false));
+  CHECK(!table.dispatch(make_message(0x1000, true)));
+  CHECK(table.dispatch(make_message(0x202, false)));
+  CHECK(rx_count == 1);
+
+  table.release();
+  CHECK(!table.dispatch(make_message(0x202, false)));
+  CHECK(table.subscribe(0x201, false, count, &rx_count));
+  CHECK(table.subscribe(0x203, false, count, &rx_count));
+  table.build();
+  CHECK(table.get_ids().size() == 3);
+  CHECK(table.dispatch(make_message(0x201, false)));
+  CHECK(table.dispatch(make_message(0x203, false)));
+  CHECK(rx_count == 3);
+}
+
+void test_build_empty() {
+  CanDispatchTable<CanMessage> table;
+  table.build();
+  CHECK(table.empty());
+  CHECK(!table.subscribe(0x201, false, count, nullptr));
+  CHECK(!table.dispatch(make_message(0x201, false)));
+  table.release();
+  CHECK(table.subscribe(0x201, false, count, nullptr));
+}
+
+} // namespace
+
+int main() {
+  test_dispatch();
+  test_modify_while_built();
+  test_build_empty();
+  return check_result();
+}
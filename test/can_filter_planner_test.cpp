@@ -0,0 +1,206 @@
+#include <algorithm>
+#include <cstdint>
+#include <vector>
+
+#include <halx/peripheral/can/filter_planner.hpp>
+
+#include "check.hpp"
+
+using namespace halx::peripheral;
+
+namespace {
+
+// bxCAN のフィルターバンクと同じ規則で受信フレームを照合する
+// (RM0008 24.7.4 / HAL_CAN_ConfigFilter のレジスタ配置)
+bool bxcan_accepts(const BxCanFilterBank &bank, uint32_t id, bool ide) {
+  if (bank.scale_32bit) {
+    uint32_t frame = ide ? (id << 3) | 0x4 : id << 21;
+    uint32_t fr1 = (bank.filter_id_high << 16) | bank.filter_id_low;
+    uint32_t fr2 = (bank.filter_mask_id_high << 16) | bank.filter_mask_id_low;
+    if (bank.list_mode) {
+      return frame == fr1 || frame == fr2;
+    }
+    return ((frame ^ fr1) & fr2) == 0;
+  }
+  if (ide) {
+    // テストでは拡張 ID を 16bit のバンクに割り当てない
+    return false;
+  }
+  uint32_t frame = id << 5;
+  if (bank.list_mode) {
+    return frame == bank.filter_id_low || frame == bank.filter_mask_id_low ||
+           frame == bank.filter_id_high || frame == bank.filter_mask_id_high;
+  }
+  return ((frame ^ bank.filter_id_low) & bank.filter_mask_id_low) == 0 ||
+         ((frame ^ bank.filter_id_high) & bank.filter_mask_id_high) == 0;
+}
+
+bool bxcan_accepts(const BxCanFilterPlan &plan, uint32_t id, bool ide) {
+  return std::any_of(plan.banks.begin(), plan.banks.end(),
+                     [&](const BxCanFilterBank &bank) {
+                       return bxcan_accepts(bank, id, ide);
+                     });
+}
+
+bool fdcan_accepts(const std::vector<FdCanFilterElement> &elements,
+                   uint32_t id) {
+  return std::any_of(elements.begin(), elements.end(),
+                     [id](const FdCanFilterElement &element) {
+                       switch (element.type) {
+                       case FdCanFilterType::RANGE:
+                         return element.id1 <= id && id <= element.id2;
+                       case FdCanFilterType::DUAL:
+                         return id == element.id1 || id == element.id2;
+                       case FdCanFilterType::MASK:
+                         return ((id ^ element.id1) & element.id2) == 0;
+                       }
+                       return false;
+                     });
+}
+
+bool contains(const std::vector<CanId> &ids, uint32_t id, bool ide) {
+  return std::any_of(ids.begin(), ids.end(), [&](const CanId &can_id) {
+    return can_id.id == id && can_id.ide == ide;
+  });
+}
+
+std::vector<CanId> make_ids() {
+  std::vector<CanId> ids;
+  // DJI のモーターのような連続した ID
+  for (uint32_t i = 0; i < 16; ++i) {
+    ids.push_back({0x201 + i, false});
+  }
+  // 間隔の空いた ID
+  for (uint32_t i = 0; i < 6; ++i) {
+    ids.push_back({0x100 + 7 * i, false});
+  }
+  for (uint32_t i = 0; i < 5; ++i) {
+    ids.push_back({0x18FF0000 + 3 * i, true});
+  }
+  return ids;
+}
+
+// 要求した ID はすべて通過し、余分に通過する標準 ID の数が `extra_ids` と
+// 一致する。拡張 ID は要求した ID の周辺だけを調べる
+void check_bxcan_plan(const std::vector<CanId> &ids, size_t bank_count) {
+  auto plan = plan_bxcan_filters(ids, bank_count);
+  CHECK(plan);
+  if (!plan) {
+    return;
+  }
+  CHECK(plan->banks.size() <= bank_count);
+  for (const auto &id : ids) {
+    CHECK(bxcan_accepts(*plan, id.id, id.ide));
+  }
+  uint64_t extra_ids = 0;
+  for (uint32_t id = 0; id <= 0x7FF; ++id) {
+    if (bxcan_accepts(*plan, id, false) && !contains(ids, id, false)) {
+      ++extra_ids;
+    }
+  }
+  bool has_ext_mask = std::any_of(
+      plan->banks.begin(), plan->banks.end(), [](const BxCanFilterBank &bank) {
+        return bank.scale_32bit && !bank.list_mode;
+      });
+  if (!has_ext_mask) {
+    CHECK(extra_ids == plan->extra_ids);
+    for (uint32_t id = 0x18FEFFF0; id < 0x18FF0020; ++id) {
+      CHECK(bxcan_accepts(*plan, id, true) == contains(ids, id, true));
+    }
+  } else {
+    CHECK(extra_ids <= plan->extra_ids);
+  }
+}
+
+void test_bxcan_exact() {
+  auto ids = make_ids();
+  auto plan = plan_bxcan_filters(ids, 14);
+  CHECK(plan);
+  if (!plan) {
+    return;
+  }
+  // 標準 ID 22 個は 16bit リスト 6 バンク、拡張 ID 5 個は 32bit リスト 3 バンク
+  CHECK(plan->banks.size() == 9);
+  CHECK(plan->extra_ids == 0);
+  check_bxcan_plan(ids, 14);
+}
+
+void test_bxcan_merge() {
+  auto ids = make_ids();
+  for (size_t bank_count : {8, 6, 5, 4, 3, 2}) {
+    check_bxcan_plan(ids, bank_count);
+  }
+  // 標準 ID と拡張 ID は同じバンクに入らない
+  CHECK(!plan_bxcan_filters(ids, 1));
+  // 連続した 16 個は1つのマスクにまとまり、余分な ID は増えない
+  std::vector<CanId> motor_ids;
+  for (uint32_t id = 0x200; id < 0x210; ++id) {
+    motor_ids.push_back({id, false});
+  }
+  auto plan = plan_bxcan_filters(motor_ids, 1);
+  CHECK(plan && plan->banks.size() == 1 && plan->extra_ids == 0);
+
+  // 2 と 3 を 32bit マスクにまとめても完全一致のリストより 1 バンク増える
+  // だけなので、バンク数で比べて {2, 3, 6, 7} を 1 つのマスクにし、4 は
+  // リストに残す
+  std::vector<CanId> ext_ids;
+  for (uint32_t id : {2, 3, 4, 6, 7}) {
+    ext_ids.push_back({0x18FF0000 + id, true});
+  }
+  plan = plan_bxcan_filters(ext_ids, 2);
+  CHECK(plan && plan->banks.size() == 2 && plan->extra_ids == 0);
+  check_bxcan_plan(ext_ids, 2);
+}
+
+void test_bxcan_no_bank() {
+  auto ids = make_ids();
+  CHECK(!plan_bxcan_filters(ids, 0));
+  auto plan = plan_bxcan_filters({}, 0);
+  CHECK(plan && plan->banks.empty() && plan->extra_ids == 0);
+}
+
+void test_fdcan() {
+  auto ids = make_ids();
+  for (size_t element_count : {28, 8, 4, 2, 1}) {
+    auto plan = plan_fdcan_filters(ids, element_count, 2);
+    CHECK(plan);
+    if (!plan) {
+      continue;
+    }
+    CHECK(plan->std_elements.size() <= element_count);
+    CHECK(plan->ext_elements.size() <= 2);
+    uint64_t extra_ids = 0;
+    for (uint32_t id = 0; id <= 0x7FF; ++id) {
+      bool accepted = fdcan_accepts(plan->std_elements, id);
+      if (contains(ids, id, false)) {
+        CHECK(accepted);
+      } else if (accepted) {
+        ++extra_ids;
+      }
+    }
+    for (const auto &id : ids) {
+      if (id.ide) {
+        CHECK(fdcan_accepts(plan->ext_elements, id.id));
+      }
+    }
+    // 拡張 ID は 2 要素にまとめるときに隙間を埋める
+    uint64_t ext_extra_ids = 0;
+    for (uint32_t id = 0x18FF0000; id <= 0x18FF000C; ++id) {
+      if (fdcan_accepts(plan->ext_elements, id) && !contains(ids, id, true)) {
+        ++ext_extra_ids;
+      }
+    }
+    CHECK(extra_ids + ext_extra_ids == plan->extra_ids);
+  }
+  CHECK(!plan_fdcan_filters(ids, 0, 2));
+}
+
+} // namespace
+
+int main() {
+  test_bxcan_exact();
+  test_bxcan_merge();
+  test_bxcan_no_bank();
+  test_fdcan();
+  return check_result();
+}
@@ -0,0 +1,283 @@
+#include <array>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <random>
+#include <vector>
+
+#include <halx/protocol/can_signal.hpp>
+
+#include "check.hpp"
+
+using namespace halx::protocol;
+
+namespace {
+
+// DBC の定義どおり1ビットずつたどる実装。INTEL は LSB から上位へ、
+// MOTOROLA は MSB からバイト内を下位へ進み、バイトの最後で次のバイトの
+// ビット 7 に移る
+template <size_t N>
+uint64_t get_raw_bitwise(const CanSignal &signal,
+                         const std::array<uint8_t, N> &data) {
+  uint64_t raw = 0;
+  size_t bit = signal.start_bit;
+  for (size_t i = 0; i < signal.length; ++i) {
+    uint64_t value = (data[bit / 8] >> (bit % 8)) & 1;
+    if (signal.byte_order == CanByteOrder::INTEL) {
+      raw |= value << i;
+      ++bit;
+    } else {
+      raw |= value << (signal.length - 1 - i);
+      bit = bit % 8 == 0 ? bit + 15 : bit - 1;
+    }
+  }
+  return raw;
+}
+
+template <size_t N>
+void set_raw_bitwise(const CanSignal &signal, std::array<uint8_t, N> &data,
+                     uint64_t raw) {
+  size_t bit = signal.start_bit;
+  for (size_t i = 0; i < signal.length; ++i) {
+    size_t shift = signal.byte_order == CanByteOrder::INTEL
+                       ? i
+                       : signal.length - 1 - i;
+    uint8_t mask = 1 << (bit % 8);
+    data[bit / 8] = ((raw >> shift) & 1) ? data[bit / 8] | mask
+                                         : data[bit / 8] & ~mask;
+    bit = signal.byte_order == CanByteOrder::INTEL ? bit + 1
+          : bit % 8 == 0                           ? bit + 15
+                                                   : bit - 1;
+  }
+}
+
+// 乱数のデータで読み出しと書き込みをビットごとの実装と比べる。書き込みは
+// 信号以外のビットを変えない
+template <CanSignal Signal, size_t N> void check_signal() {
+  std::mt19937_64 random(Signal.start_bit * 64 + Signal.length);
+  for (int i = 0; i < 1000; ++i) {
+    std::array<uint8_t, N> data;
+    for (auto &byte : data) {
+      byte = random();
+    }
+    CHECK(get_can_signal_raw<Signal>(data) == get_raw_bitwise(Signal, data));
+
+    uint64_t raw = random();
+    auto expected = data;
+    set_raw_bitwise(Signal, expected, raw);
+    set_can_signal_raw<Signal>(data, raw);
+    CHECK(data == expected);
+  }
+}
+
+void test_layouts() {
+  // 12bit はバイト境界をまたぐ
+  check_signal<CanSignal{.start_bit = 4, .length = 12}, 8>();
+  check_signal<CanSignal{.start_bit = 11,
+                         .length = 12,
+                         .byte_order = CanByteOrder::MOTOROLA},
+               8>();
+  check_signal<CanSignal{.start_bit = 0, .length = 1}, 8>();
+  check_signal<CanSignal{.start_bit = 63, .length = 1}, 8>();
+  // 窓に収まる最大の長さと、データの末尾で窓が8バイトに満たない場合
+  check_signal<CanSignal{.start_bit = 7, .length = 57}, 8>();
+  check_signal<CanSignal{.start_bit = 7,
+                         .length = 57,
+                         .byte_order = CanByteOrder::MOTOROLA},
+               8>();
+  check_signal<CanSignal{.start_bit = 52, .length = 12}, 8>();
+  check_signal<CanSignal{.start_bit = 55,
+                         .length = 16,
+                         .byte_order = CanByteOrder::MOTOROLA},
+               8>();
+  // CAN FD の 64 バイト
+  check_signal<CanSignal{.start_bit = 485, .length = 20}, 64>();
+  check_signal<CanSignal{.start_bit = 491,
+                         .length = 20,
+                         .byte_order = CanByteOrder::MOTOROLA},
+               64>();
+}
+
+void test_physical_value() {
+  constexpr CanSignal TEMPERATURE{.start_bit = 36,
+                                  .length = 12,
+                                  .byte_order = CanByteOrder::INTEL,
+                                  .is_signed = true,
+                                  .scale = 0.5f,
+                                  .offset = -10.0f};
+  std::array<uint8_t, 8> data{};
+  set_can_signal<TEMPERATURE>(data, -500.5f);
+  // (-500.5 + 10) / 0.5 = -981 を 12bit の2の補数で
+  CHECK(get_can_signal_raw<TEMPERATURE>(data) == 0xC2B);
+  CHECK(get_can_signal<TEMPERATURE>(data) == -500.5f);
+
+  constexpr CanSignal RPM{.start_bit = 23,
+                          .length = 16,
+                          .byte_order = CanByteOrder::MOTOROLA,
+                          .is_signed = true};
+  set_can_signal<RPM>(data, int16_t{-1234});
+  CHECK(data[2] == 0xFB && data[3] == 0x2E);
+  CHECK((get_can_signal<RPM, int16_t>(data) == -1234));
+  CHECK(get_can_signal<TEMPERATURE>(data) == -500.5f);
+}
+
+struct MotorFeedback {
+  float angle;
+  int16_t rpm;
+  float current;
+  uint8_t temperature;
+};
+
+using MotorFeedbackCodec = CanCodec<
+    MotorFeedback,
+    CanField<&MotorFeedback::angle,
+             CanSignal{.start_bit = 7,
+                       .length = 16,
+                       .byte_order = CanByteOrder::MOTOROLA,
+                       .scale = 360.0f / 8192}>,
+    CanField<&MotorFeedback::rpm,
+             CanSignal{.start_bit = 23,
+                       .length = 16,
+                       .byte_order = CanByteOrder::MOTOROLA,
+                       .is_signed = true}>,
+    CanField<&MotorFeedback::current,
+             CanSignal{.start_bit = 39,
+                       .length = 16,
+                       .byte_order = CanByteOrder::MOTOROLA,
+                       .is_signed = true,
+                       .scale = 20.0f / 16384}>,
+    CanField<&MotorFeedback::temperature,
+             CanSignal{.start_bit = 48, .length = 8}>>;
+
+// 比較用の手書きのシフト
+MotorFeedback unpack_by_hand(const std::array<uint8_t, 8> &data) {
+  return {
+      .angle = static_cast<uint16_t>((data[0] << 8) | data[1]) *
+               (360.0f / 8192),
+      .rpm = static_cast<int16_t>((data[2] << 8) | data[3]),
+      .current = static_cast<int16_t>((data[4] << 8) | data[5]) *
+                 (20.0f / 16384),
+      .temperature = data[6],
+  };
+}
+
+void pack_by_hand(const MotorFeedback &value, std::array<uint8_t, 8> &data) {
+  auto round = [](float x) {
+    return static_cast<int32_t>(x + (x < 0.0f ? -0.5f : 0.5f));
+  };
+  uint16_t angle = round(value.angle * (8192 / 360.0f));
+  int16_t current = round(value.current * (16384 / 20.0f));
+  data[0] = angle >> 8;
+  data[1] = angle;
+  data[2] = static_cast<uint16_t>(value.rpm) >> 8;
+  data[3] = value.rpm;
+  data[4] = static_cast<uint16_t>(current) >> 8;
+  data[5] = current;
+  data[6] = value.temperature;
+}
+
+bool operator==(const MotorFeedback &a, const MotorFeedback &b) {
+  return a.angle == b.angle && a.rpm == b.rpm && a.current == b.current &&
+         a.temperature == b.temperature;
+}
+
+// コンパイル時にも評価できる
+constexpr bool check_constexpr() {
+  std::array<uint8_t, 8> data{0x12, 0x34, 0xFF, 0x38};
+  return MotorFeedbackCodec::unpack(data).rpm == -200;
+}
+static_assert(check_constexpr());
+
+template <class F> double measure_ns(size_t count, F f) {
+  auto begin = std::chrono::steady_clock::now();
+  f();
+  std::chrono::duration<double, std::nano> elapsed =
+      std::chrono::steady_clock::now() - begin;
+  return elapsed.count() / count;
+}
+
+void test_codec() {
+  std::mt19937 random(1);
+  std::vector<std::array<uint8_t, 8>> frames(1024);
+  for (auto &frame : frames) {
+    for (auto &byte : frame) {
+      byte = random();
+    }
+    frame[7] = 0;
+    auto value = MotorFeedbackCodec::unpack(frame);
+    CHECK(value == unpack_by_hand(frame));
+
+    std::array<uint8_t, 8> packed{};
+    std::array<uint8_t, 8> packed_by_hand{};
+    MotorFeedbackCodec::pack(value, packed);
+    pack_by_hand(value, packed_by_hand);
+    CHECK(packed == frame);
+    CHECK(packed_by_hand == frame);
+  }
+
+  // 結果を捨てると最適化で消えるので合計する
+  constexpr size_t ROUNDS = 2000;
+  size_t count = ROUNDS * frames.size();
+  volatile float sink = 0.0f;
+  double codec_ns = measure_ns(count, [&] {
+    float sum = 0.0f;
+    for (size_t i = 0; i < ROUNDS; ++i) {
+      for (const auto &frame : frames) {
+        auto value = MotorFeedbackCodec::unpack(frame);
+        sum += value.angle + value.rpm + value.current + value.temperature;
+      }
+    }
+    sink = sum;
+  });
+  double hand_ns = measure_ns(count, [&] {
+    float sum = 0.0f;
+    for (size_t i = 0; i < ROUNDS; ++i) {
+      for (const auto &frame : frames) {
+        auto value = unpack_by_hand(frame);
+        sum += value.angle + value.rpm + value.current + value.temperature;
+      }
+    }
+    sink = sum;
+  });
+  std::printf("unpack: codec %.2f ns, hand-written %.2f ns\n", codec_ns,
+              hand_ns);
+
+  std::vector<MotorFeedback> values;
+  for (const auto &frame : frames) {
+    values.push_back(unpack_by_hand(frame));
+  }
+  volatile uint8_t byte_sink = 0;
+  codec_ns = measure_ns(count, [&] {
+    std::array<uint8_t, 8> data{};
+    uint8_t sum = 0;
+    for (size_t i = 0; i < ROUNDS; ++i) {
+      for (const auto &value : values) {
+        MotorFeedbackCodec::pack(value, data);
+        sum += data[0] ^ data[5];
+      }
+    }
+    byte_sink = sum;
+  });
+  hand_ns = measure_ns(count, [&] {
+    std::array<uint8_t, 8> data{};
+    uint8_t sum = 0;
+    for (size_t i = 0; i < ROUNDS; ++i) {
+      for (const auto &value : values) {
+        pack_by_hand(value, data);
+        sum += data[0] ^ data[5];
+      }
+    }
+    byte_sink = sum;
+  });
+  std::printf("pack: codec %.2f ns, hand-written %.2f ns\n", codec_ns,
+              hand_ns);
+}
+
+} // namespace
+
+int main() {
+  test_layouts();
+  test_physical_value();
+  test_codec();
+  return check_result();
+}
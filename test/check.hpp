@@ -0,0 +1,16 @@
+#pragma once
+
+#include <cstdio>
+
+// 失敗しても続けて、main() の最後に `check_result()` を返す
+inline int check_failure_count = 0;
+
+#define CHECK(expr)                                                            \
+  do {                                                                         \
+    if (!(expr)) {                                                             \
+      std::printf("%s:%d: CHECK(%s) failed\n", __FILE__, __LINE__, #expr);     \
+      ++check_failure_count;                                                   \
+    }                                                                          \
+  } while (false)
+
+inline int check_result() { return check_failure_count == 0 ? 0 : 1; }
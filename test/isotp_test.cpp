@@ -0,0 +1,212 @@
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <mutex>
+#include <optional>
+#include <thread>
+#include <vector>
+
+#include <halx/peripheral/can/virtual_can.hpp>
+#include <halx/protocol/isotp.hpp>
+
+#include "check.hpp"
+
+using namespace halx::peripheral;
+using namespace halx::protocol;
+
+namespace {
+
+// 送信したらバスがアイドルになるまで進める。IsoTp はフロー制御を待つ間
+// バスを進めないので、送信したスレッドでバスを進める。送信側と受信側の
+// スレッドが同じバスを使うので、バスを進める間はロックする
+class LoopbackCan : public VirtualCan {
+public:
+  using VirtualCan::transmit_burst;
+
+  LoopbackCan(VirtualCanBus &bus) : VirtualCan{bus}, bus_{bus} {}
+
+  size_t transmit_burst(std::span<const CanMessage> msgs,
+                        uint32_t timeout) override {
+    std::lock_guard lock{mutex_};
+    size_t count = VirtualCan::transmit_burst(msgs, timeout);
+    bus_.run();
+    return count;
+  }
+
+  size_t transmit_burst(std::span<const CanFdMessage> msgs,
+                        uint32_t timeout) override {
+    std::lock_guard lock{mutex_};
+    size_t count = VirtualCan::transmit_burst(msgs, timeout);
+    bus_.run();
+    return count;
+  }
+
+private:
+  static inline std::mutex mutex_;
+
+  VirtualCanBus &bus_;
+};
+
+std::vector<uint8_t> make_data(size_t size) {
+  std::vector<uint8_t> data(size);
+  for (size_t i = 0; i < size; ++i) {
+    data[i] = static_cast<uint8_t>(i * 7 + 3);
+  }
+  return data;
+}
+
+// `size` バイトを送って受信側で一致するか調べ、スループットを表示する
+void check_transfer(const char *name, VirtualCanBus &bus, IsoTp &sender,
+                    IsoTp &receiver, size_t size) {
+  auto data = make_data(size);
+  std::vector<uint8_t> buffer(size);
+  uint64_t begin_time = bus.get_time();
+  uint64_t begin_frame_count = bus.get_frame_count();
+  auto begin = std::chrono::steady_clock::now();
+  // フロー制御は受信を待つスレッドが送る
+  std::optional<size_t> received;
+  std::thread receiving([&] { received = receiver.receive(buffer, 1000); });
+  CHECK(sender.send(data, 1000));
+  receiving.join();
+  std::chrono::duration<double> elapsed =
+      std::chrono::steady_clock::now() - begin;
+  CHECK(received && *received == size);
+  CHECK(buffer == data);
+
+  double bus_time = (bus.get_time() - begin_time) * 1e-9;
+  std::printf("%s: %zu bytes, %llu frames, %.1f KB/s (bus), %.1f MB/s (host)\n",
+              name, size,
+              static_cast<unsigned long long>(bus.get_frame_count() -
+                                              begin_frame_count),
+              size / bus_time * 1e-3, size / elapsed.count() * 1e-6);
+}
+
+void test_classic() {
+  VirtualCanBus bus(1000000);
+  LoopbackCan can1(bus);
+  LoopbackCan can2(bus);
+  IsoTp sender(can1, {.tx_id = 0x7E0, .rx_id = 0x7E8});
+  IsoTp receiver(can2, {.tx_id = 0x7E8, .rx_id = 0x7E0});
+  CHECK(sender.is_subscribed() && receiver.is_subscribed());
+  can1.start();
+  can2.start();
+
+  check_transfer("classic single frame", bus, sender, receiver, 7);
+  uint64_t begin_time = bus.get_time();
+  check_transfer("classic", bus, sender, receiver, 4095);
+  // 最初のフレーム + フロー制御 + 連続フレーム 585 個。パディングで
+  // すべて 8 バイトになり、バスは途切れずに埋まる
+  CHECK(bus.get_time() - begin_time ==
+        587 * (get_can_frame_bits(false, 8) * 1000ull));
+}
+
+void test_block_size() {
+  VirtualCanBus bus(1000000);
+  LoopbackCan can1(bus);
+  LoopbackCan can2(bus);
+  IsoTp sender(can1, {.tx_id = 0x7E0, .rx_id = 0x7E8});
+  IsoTp receiver(can2, {.tx_id = 0x7E8, .rx_id = 0x7E0, .block_size = 8});
+  can1.start();
+  can2.start();
+
+  uint64_t begin_frame_count = bus.get_frame_count();
+  check_transfer("classic bs=8", bus, sender, receiver, 1000);
+  // 連続フレーム 142 個に対して、フロー制御は最初の 1 個と 8 個ごとの 17 個
+  CHECK(bus.get_frame_count() - begin_frame_count == 1 + 142 + 1 + 17);
+}
+
+void test_fd() {
+  VirtualCanBus bus(1000000, 5000000);
+  LoopbackCan can1(bus);
+  LoopbackCan can2(bus);
+  IsoTp sender(can1,
+               {.tx_id = 0x7E0, .rx_id = 0x7E8, .fd = true, .brs = true,
+                .tx_dl = 64});
+  // 4095 バイトを超える長さは 32bit で送られる
+  IsoTp receiver(can2,
+                 {.tx_id = 0x7E8, .rx_id = 0x7E0, .fd = true, .brs = true,
+                  .tx_dl = 64},
+                 16384);
+  can1.start();
+  can2.start();
+
+  check_transfer("fd single frame", bus, sender, receiver, 62);
+  check_transfer("fd", bus, sender, receiver, 4095);
+  check_transfer("fd 32bit length", bus, sender, receiver, 10000);
+}
+
+void test_zero_length_first_frame() {
+  VirtualCanBus bus(1000000);
+  LoopbackCan can1(bus);
+  LoopbackCan can2(bus);
+  IsoTp receiver(can2, {.tx_id = 0x7E8, .rx_id = 0x7E0});
+  can1.start();
+  can2.start();
+
+  std::vector<uint8_t> buffer(4095);
+  // 長さ 0、32bit の長さで 4095 以下、最初のフレームに収まる長さはどれも
+  // 不正なので、フロー制御を返さない
+  for (auto data : {std::array<uint8_t, 8>{0x10, 0x00, 0, 0, 0, 0, 1, 2},
+                    std::array<uint8_t, 8>{0x10, 0x00, 0, 0, 0x0F, 0xFF, 1, 2},
+                    std::array<uint8_t, 8>{0x10, 0x06, 1, 2, 3, 4, 5, 6}}) {
+    uint64_t frame_count = bus.get_frame_count();
+    CHECK(can1.transmit({.id = 0x7E0, .ide = false, .dlc = 8, .data = data,
+                         .timestamp = 0},
+                        0));
+    CHECK(!receiver.receive(buffer, 0));
+    CHECK(bus.get_frame_count() == frame_count + 1);
+  }
+}
+
+void test_invalid_config() {
+  VirtualCanBus bus(1000000, 5000000);
+  LoopbackCan can1(bus);
+  // DLC で表せない長さはパディングされ、8 未満や 64 を超える長さは
+  // フレームに収まらない
+  for (uint8_t tx_dl : {0, 4, 10, 13, 63, 65, 255}) {
+    IsoTp isotp(can1, {.tx_id = 0x7E0, .rx_id = 0x7E8, .fd = true,
+                       .tx_dl = tx_dl});
+    CHECK(!isotp.is_subscribed());
+  }
+  IsoTp isotp(can1, {.tx_id = 0x7E0, .rx_id = 0x7E8, .fd = true,
+                     .tx_dl = 12});
+  CHECK(isotp.is_subscribed());
+  can1.start();
+  // 長さ 0 の単一フレームは予約されている
+  CHECK(!isotp.send({}, 0));
+}
+
+void test_subscribe_failure() {
+  VirtualCanBus bus(1000000);
+  LoopbackCan can1(bus);
+  LoopbackCan can2(bus);
+  IsoTp sender(can1, {.tx_id = 0x7E0, .rx_id = 0x7E8});
+  IsoTp receiver(can2, {.tx_id = 0x7E8, .rx_id = 0x7E0});
+  {
+    // 同じ rx_id は登録できず、破棄しても先に登録した受信を外さない
+    IsoTp duplicate(can2, {.tx_id = 0x7E8, .rx_id = 0x7E0});
+    CHECK(!duplicate.is_subscribed());
+    CHECK(!duplicate.send(make_data(4), 0));
+  }
+  can1.start();
+  can2.start();
+
+  IsoTp late(can1, {.tx_id = 0x7E1, .rx_id = 0x7E9});
+  CHECK(!late.is_subscribed());
+  std::vector<uint8_t> buffer(16);
+  CHECK(!late.receive(buffer, 0));
+
+  check_transfer("after failure", bus, sender, receiver, 100);
+}
+
+} // namespace
+
+int main() {
+  test_classic();
+  test_block_size();
+  test_fd();
+  test_zero_length_first_frame();
+  test_invalid_config();
+  test_subscribe_failure();
+  return check_result();
+}
@@ -0,0 +1,104 @@
+#include <array>
+#include <cstdint>
+
+#include <halx/peripheral/can/virtual_can.hpp>
+#include <halx/protocol/motor_group.hpp>
+
+#include "check.hpp"
+
+using namespace halx::peripheral;
+using namespace halx::protocol;
+
+namespace {
+
+CanMessage make_feedback(uint32_t id, uint16_t angle, int16_t rpm) {
+  return {.id = id,
+          .ide = false,
+          .dlc = 8,
+          .data = {static_cast<uint8_t>(angle >> 8),
+                   static_cast<uint8_t>(angle),
+                   static_cast<uint8_t>(static_cast<uint16_t>(rpm) >> 8),
+                   static_cast<uint8_t>(rpm), 0, 0, 30},
+          .timestamp = 0};
+}
+
+void test_overlapping_ids() {
+  VirtualCanBus bus(1000000);
+  VirtualCan can1(bus);
+  VirtualCan esc(bus);
+  // C620 の 5 と GM6020 の 1 はどちらもフィードバックが 0x205
+  std::array<MotorConfig, 3> motors{make_dji_c620_motor(4),
+                                    make_dji_c620_motor(5),
+                                    make_dji_gm6020_motor(1)};
+  MotorGroup group(can1, motors);
+  CHECK(group.is_subscribed(0));
+  CHECK(group.is_subscribed(1));
+  CHECK(!group.is_subscribed(2));
+  CHECK(!group.is_subscribed(3));
+  // 指令値もどちらも 0x1FF の先頭なので、後のモーターには割り当てない
+  CHECK(group.has_command_slot(1));
+  CHECK(!group.has_command_slot(2));
+  CHECK(!group.set_command(2, 100));
+  can1.start();
+  esc.start();
+
+  CHECK(esc.transmit(make_feedback(0x204, 100, -20), 0));
+  CHECK(esc.transmit(make_feedback(0x205, 200, 30), 0));
+  bus.run();
+  auto feedback = group.get_feedback(0);
+  CHECK(feedback && feedback->angle == 100 && feedback->rpm == -20);
+  feedback = group.get_feedback(1);
+  CHECK(feedback && feedback->angle == 200 && feedback->rpm == 30);
+  CHECK(!group.get_feedback(2));
+  CHECK(group.is_online(1) && !group.is_online(2));
+}
+
+void test_after_start() {
+  VirtualCanBus bus(1000000);
+  VirtualCan can1(bus);
+  can1.start();
+  std::array<MotorConfig, 1> motors{make_dji_c620_motor(1)};
+  MotorGroup group(can1, motors);
+  CHECK(!group.is_subscribed(0));
+}
+
+void test_command_slot() {
+  VirtualCanBus bus(1000000);
+  VirtualCan can1(bus);
+  VirtualCan esc(bus);
+  // ID 0 はスロット 255 になる
+  std::array<MotorConfig, 3> motors{make_dji_c620_motor(0),
+                                    make_dji_c620_motor(1),
+                                    make_dji_c620_motor(4)};
+  MotorGroup group(can1, motors);
+  CHECK(!group.has_command_slot(0));
+  CHECK(!group.set_command(0, 1));
+  CHECK(group.has_command_slot(1) && group.has_command_slot(2));
+  CanMessage command{};
+  CHECK(esc.subscribe(
+      0x200, false,
+      [](void *context, const CanMessage &msg) {
+        *static_cast<CanMessage *>(context) = msg;
+      },
+      &command));
+  can1.start();
+  esc.start();
+
+  CHECK(group.set_command(1, 0x1234));
+  CHECK(group.set_command(2, -2));
+  CHECK(group.transmit(0));
+  bus.run();
+  CHECK(command.id == 0x200);
+  CHECK(command.data[0] == 0x12 && command.data[1] == 0x34);
+  CHECK(command.data[6] == 0xFF && command.data[7] == 0xFE);
+  CHECK(command.data[2] == 0 && command.data[5] == 0);
+}
+
+} // namespace
+
+int main() {
+  test_overlapping_ids();
+  test_after_start();
+  test_command_slot();
+  return check_result();
+}
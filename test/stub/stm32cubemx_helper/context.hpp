@@ -0,0 +1,17 @@
+#pragma once
+
+// ホスト PC でのテスト用に、stm32cubemx_helper の同名のヘッダーを置き換える
+
+namespace stm32cubemx_helper {
+
+template <auto *Handle, class T> inline T *context = nullptr;
+
+template <auto *Handle, class T> inline void set_context(T *ptr) {
+  context<Handle, T> = ptr;
+}
+
+template <auto *Handle, class T> inline T *get_context() {
+  return context<Handle, T>;
+}
+
+} // namespace stm32cubemx_helper
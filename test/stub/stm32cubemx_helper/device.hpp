@@ -0,0 +1,29 @@
+#pragma once
+
+// ホスト PC でのテスト用に、stm32cubemx_helper の同名のヘッダーを置き換える。
+// halx/core.hpp の RTOS なしの実装が使う HAL と CMSIS の関数だけを定義する
+
+#include <chrono>
+#include <cstdint>
+#include <thread>
+
+#define HAL_MAX_DELAY 0xFFFFFFFFU
+
+inline uint32_t SystemCoreClock = 170000000;
+
+inline uint32_t HAL_GetTick() {
+  static auto start = std::chrono::steady_clock::now();
+  return std::chrono::duration_cast<std::chrono::milliseconds>(
+             std::chrono::steady_clock::now() - start)
+      .count();
+}
+
+inline void HAL_Delay(uint32_t delay) {
+  std::this_thread::sleep_for(std::chrono::milliseconds(delay));
+}
+
+inline void __NOP() {}
+inline uint32_t __get_PRIMASK() { return 0; }
+inline void __set_PRIMASK(uint32_t) {}
+inline void __disable_irq() {}
+inline uint32_t __get_IPSR() { return 0; }
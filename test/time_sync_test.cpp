@@ -0,0 +1,112 @@
+#include <algorithm>
+#include <cstdint>
+#include <cstdio>
+
+#include <halx/peripheral/can/virtual_can.hpp>
+#include <halx/protocol/time_sync.hpp>
+
+#include "check.hpp"
+
+using namespace halx::peripheral;
+using namespace halx::protocol;
+
+namespace {
+
+// 時計はノードごとの `VirtualCan::get_time()` [ns]
+VirtualCan *master_can = nullptr;
+VirtualCan *slave_can = nullptr;
+
+TimeSyncConfig make_config(uint64_t (*get_clock)()) {
+  return {.sync_id = 0x080,
+          .follow_up_id = 0x081,
+          .ide = false,
+          .clock_frequency = 1000000000,
+          .get_clock = get_clock};
+}
+
+uint64_t get_master_clock() { return master_can->get_time(); }
+uint64_t get_slave_clock() { return slave_can->get_time(); }
+
+// スレーブの時計がずれていても、SYNC の送受信のタイムスタンプから
+// マスターの時刻を推定できる
+void check_sync(int32_t drift_ppm, uint64_t offset) {
+  VirtualCanBus bus(1000000);
+  VirtualCan can1(bus);
+  VirtualCan can2(bus);
+  // 調停で SYNC を遅らせる高負荷のノード
+  VirtualCan noise(bus);
+  master_can = &can1;
+  slave_can = &can2;
+  can2.set_clock(drift_ppm, offset);
+
+  TimeSyncMaster master(can1, make_config(get_master_clock));
+  TimeSyncSlave slave(can2, make_config(get_slave_clock));
+  CHECK(master.is_attached());
+  CHECK(slave.is_subscribed());
+  can1.start();
+  can2.start();
+  noise.start();
+
+  int64_t max_error = 0;
+  for (uint32_t i = 0; i < 100; ++i) {
+    for (uint32_t id = 0x010; id < 0x013; ++id) {
+      noise.transmit(CanMessage{.id = id, .ide = false, .dlc = 8, .data = {},
+                                .timestamp = 0},
+                     0);
+    }
+    CHECK(master.sync(1));
+    bus.run();
+    // 10ms ごとに同期する
+    bus.advance(10000000 - bus.get_time() % 10000000);
+    if (i < 3) {
+      continue;
+    }
+    CHECK(slave.is_synchronized());
+    auto time = slave.get_time();
+    CHECK(time);
+    if (time) {
+      int64_t error = static_cast<int64_t>(*time - master.get_time());
+      max_error = std::max(max_error, error < 0 ? -error : error);
+    }
+  }
+  // 自分の時計のままではマスターの時刻とずれている
+  CHECK(offset == 0 || get_slave_clock() != get_master_clock());
+  std::printf("drift %d ppm: max error %lld ns, last offset error %d ns\n",
+              drift_ppm, static_cast<long long>(max_error),
+              slave.get_offset_error());
+  // 推定した速さの丸め誤差だけが残る
+  CHECK(max_error <= 10);
+}
+
+void test_sync() {
+  check_sync(0, 0);
+  check_sync(100, 123456789);
+  check_sync(-250, 987654321);
+}
+
+void test_subscribe_failure() {
+  VirtualCanBus bus(1000000);
+  VirtualCan can1(bus);
+  master_can = &can1;
+  slave_can = &can1;
+  TimeSyncSlave slave(can1, make_config(get_slave_clock));
+  CHECK(slave.is_subscribed());
+  {
+    // 同じ ID は登録できず、破棄しても先に登録した受信を外さない
+    TimeSyncSlave duplicate(can1, make_config(get_slave_clock));
+    CHECK(!duplicate.is_subscribed());
+  }
+  CHECK(!can1.subscribe(0x080, false,
+                        [](void *, const CanMessage &) {}, nullptr));
+  can1.start();
+  TimeSyncSlave late(can1, make_config(get_slave_clock));
+  CHECK(!late.is_subscribed());
+}
+
+} // namespace
+
+int main() {
+  test_sync();
+  test_subscribe_failure();
+  return check_result();
+}
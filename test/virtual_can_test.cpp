@@ -0,0 +1,162 @@
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+
+#include <halx/peripheral/can/dispatch_table.hpp>
+#include <halx/peripheral/can/tx_coalescer.hpp>
+#include <halx/peripheral/can/virtual_can.hpp>
+
+#include "check.hpp"
+
+using namespace halx::peripheral;
+
+namespace {
+
+void count(void *context, const CanMessage &) {
+  ++*static_cast<uint32_t *>(context);
+}
+
+void count_fd(void *context, const CanFdMessage &) {
+  ++*static_cast<uint32_t *>(context);
+}
+
+CanMessage make_message(uint32_t id) {
+  return {.id = id, .ide = false, .dlc = 8, .data = {}, .timestamp = 0};
+}
+
+void test_unsubscribe() {
+  VirtualCanBus bus(1000000);
+  VirtualCan node1(bus);
+  VirtualCan node2(bus);
+  uint32_t rx_count = 0;
+  uint32_t fd_rx_count = 0;
+  CHECK(node2.subscribe(0x201, false, count, &rx_count));
+  CHECK(node2.subscribe(0x201, false, count_fd, &fd_rx_count));
+  // クラシックと FD の両方から外す
+  CHECK(node2.unsubscribe(0x201, false));
+  CHECK(!node2.unsubscribe(0x201, false));
+  CHECK(node2.subscribe(0x201, false, count, &rx_count));
+  CHECK(node2.subscribe(0x201, false, count_fd, &fd_rx_count));
+  CHECK(node2.unsubscribe(0x201, false));
+  node1.start();
+  node2.start();
+
+  CHECK(node1.transmit(make_message(0x201), 0));
+  bus.run();
+  CHECK(rx_count == 0 && fd_rx_count == 0);
+}
+
+void count_tx(void *context, const CanTxEvent &) {
+  ++*static_cast<uint32_t *>(context);
+}
+
+void test_tx_callbacks() {
+  VirtualCanBus bus(1000000);
+  VirtualCan node1(bus, 1);
+  VirtualCan node2(bus);
+  node1.start();
+  node2.start();
+
+  // 送信完了コールバックは複数登録でき、互いを上書きしない
+  uint32_t tx_count = 0;
+  auto index = node1.attach_tx_callback(count_tx, &tx_count);
+  CHECK(index);
+  {
+    CanTxCoalescer coalescer(node1, 2);
+    CHECK(coalescer.is_attached());
+    // 送信キューは 1 つなので、2 つ目以降はスロットで待って最新の値に
+    // まとめられ、送信完了のたびに送られる
+    for (uint8_t i = 0; i < 3; ++i) {
+      auto msg = make_message(0x200);
+      msg.data[0] = i;
+      CHECK(coalescer.transmit(msg));
+    }
+    CHECK(coalescer.get_coalesced_count() == 1);
+    bus.run();
+    CHECK(coalescer.get_pending_count() == 0);
+    CHECK(tx_count == 2);
+  }
+  // coalescer が外れても先に登録したコールバックは残る
+  CHECK(node1.transmit(make_message(0x201), 0));
+  bus.run();
+  CHECK(tx_count == 3);
+
+  uint32_t other_count = 0;
+  for (size_t i = 1; i < CAN_TX_CALLBACK_SIZE; ++i) {
+    CHECK(node1.attach_tx_callback(count_tx, &other_count));
+  }
+  CHECK(!node1.attach_tx_callback(count_tx, &other_count));
+  CanTxCoalescer full(node1, 1);
+  CHECK(!full.is_attached());
+  CHECK(!full.transmit(make_message(0x202)));
+  CHECK(node1.detach_tx_callback(*index));
+  CHECK(!node1.detach_tx_callback(*index));
+}
+
+// バスを進めて 1 秒間に何フレーム送受信できるか
+void test_frame_rate() {
+  VirtualCanBus bus(1000000);
+  VirtualCan node1(bus);
+  VirtualCan node2(bus);
+  uint32_t rx_count = 0;
+  CHECK(node2.subscribe(0x201, false, count, &rx_count));
+  node1.start();
+  node2.start();
+  bus.set_error_rate(0.01f);
+
+  constexpr uint32_t FRAME_COUNT = 100000;
+  auto msg = make_message(0x201);
+  auto begin = std::chrono::steady_clock::now();
+  for (uint32_t i = 0; i < FRAME_COUNT; ++i) {
+    // 送信キューが満杯なら、空くまでバスを進める
+    CHECK(node1.transmit(msg, 10));
+  }
+  bus.run();
+  std::chrono::duration<double> elapsed =
+      std::chrono::steady_clock::now() - begin;
+  // エラーになったフレームも再送されて届く
+  CHECK(rx_count == FRAME_COUNT);
+  CHECK(bus.get_error_count() > 0);
+  std::printf("bus: %.0f frames/s (host), %.1f s of bus time\n",
+              bus.get_frame_count() / elapsed.count(), bus.get_time() * 1e-9);
+}
+
+// 受信割り込みで呼ばれる経路 (ディスパッチテーブルの検索とコールバック) が
+// 購読数によらず一定の時間で済むか
+void test_dispatch_cost() {
+  constexpr uint32_t ROUNDS = 10000;
+  for (uint32_t subscription_count : {1u, 16u, 256u, 1024u}) {
+    CanDispatchTable<CanMessage> table;
+    uint32_t rx_count = 0;
+    for (uint32_t i = 0; i < subscription_count; ++i) {
+      CHECK(table.subscribe(0x100 + i, false, count, &rx_count));
+    }
+    CHECK(table.subscribe(0x18FF0000, true, count, &rx_count));
+    table.build();
+
+    auto begin = std::chrono::steady_clock::now();
+    for (uint32_t round = 0; round < ROUNDS; ++round) {
+      for (uint32_t i = 0; i < subscription_count; ++i) {
+        table.dispatch(make_message(0x100 + i));
+      }
+      table.dispatch({.id = 0x18FF0000, .ide = true, .dlc = 8, .data = {},
+                      .timestamp = 0});
+    }
+    std::chrono::duration<double, std::nano> elapsed =
+        std::chrono::steady_clock::now() - begin;
+    uint32_t dispatch_count = ROUNDS * (subscription_count + 1);
+    CHECK(rx_count == dispatch_count);
+    std::printf("dispatch: %4u ids, %.2f ns/frame\n", subscription_count,
+                elapsed.count() / dispatch_count);
+  }
+}
+
+} // namespace
+
+int main() {
+  test_unsubscribe();
+  test_tx_callbacks();
+  test_frame_rate();
+  test_dispatch_cost();
+  return check_result();
+}